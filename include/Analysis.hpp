@@ -0,0 +1,548 @@
+#pragma once
+
+#include <SFML/Graphics.hpp>
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <numeric>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "BarnesHut.hpp"
+#include "CollisionGrid.hpp"
+#include "Config.hpp"
+#include "Particle.hpp"
+#include "TaskGraph.hpp"
+#include "Trace.hpp"
+
+/*
+In-situ analysis: every config.analysisInterval steps a set of analyzers
+reduces the live state to a few numbers, so nothing has to be dumped and
+post-processed.
+
+    density     mass map on a 64 x 64 grid, summed from the quadtree
+    profile     radial profile about the center of mass: mass, count,
+                surface density and mean radial / tangential velocity
+    momentum    mass, center of mass, bulk velocity, angular momentum and
+                kinetic energy
+    clumps      friends-of-friends groups (particles closer than
+                linkingLength), found through the collision grid
+
+Each analyzer adds tasks to one task graph that runs on the simulation's
+worker pool after the step, so the analyzers overlap each other. Per
+particle sums are split into a fixed number of chunks and reduced in chunk
+order, which keeps the output deterministic. The density map reads only
+node masses and centers of mass of the tree the step was computed with, so
+it lags the particles by one step.
+
+Every analyzer appends one JSON line per run to <dir>/<name>.jsonl. New
+analyzers implement Analyzer and are added with Analysis::add.
+*/
+
+// What every analyzer gets, with the moments shared between them.
+struct AnalysisFrame {
+    uint64_t step = 0;
+    std::vector<Particle>* particles = nullptr;
+    const Node* tree = nullptr;
+
+    double totalMass = 0.0;
+    sf::Vector2f centerOfMass;
+    sf::Vector2f bulkVelocity;
+};
+
+class Analyzer {
+public:
+    virtual ~Analyzer() = default;
+
+    virtual const char* name() const = 0;
+
+    // Adds this frame's tasks to graph. They may keep references to frame.
+    virtual void schedule(TaskGraph& graph, const AnalysisFrame& frame) = 0;
+
+    // Writes the last result as JSON members, without braces.
+    virtual void write(FILE* output) const = 0;
+};
+
+struct Analysis {
+    // Per particle work is split into this many tasks whatever the thread
+    // count, see addChunks.
+    constexpr static int chunkCount = 64;
+
+    static std::string outputDirectory;
+    static std::vector<std::unique_ptr<Analyzer>> analyzers;
+    static std::vector<FILE*> outputs;
+    static AnalysisFrame frame;
+
+    // Adds chunkCount tasks calling work(chunk, start, end) over [0, count).
+    template <typename Function>
+    static std::vector<int> addChunks(TaskGraph& graph, const char* name, size_t count, Function work,
+                                      const std::vector<int>& dependencies = {}) {
+        const size_t chunkSize = (count + chunkCount - 1) / chunkCount;
+        std::vector<int> tasks;
+        for (int chunk = 0; chunk < chunkCount; chunk++) {
+            const size_t start = std::min(count, chunk * chunkSize);
+            const size_t end = std::min(count, start + chunkSize);
+            tasks.push_back(graph.add(name, [work, chunk, start, end]() { work(chunk, start, end); }, dependencies));
+        }
+        return tasks;
+    }
+
+    static std::unique_ptr<Analyzer> create(const std::string& name);
+
+    static void add(std::unique_ptr<Analyzer> analyzer) {
+        std::string path = outputDirectory + "/" + analyzer->name() + ".jsonl";
+        FILE* output = std::fopen(path.c_str(), "w");
+        if (!output) throw std::runtime_error("Could not open " + path);
+
+        analyzers.push_back(std::move(analyzer));
+        outputs.push_back(output);
+    }
+
+    // names is a comma separated list, empty for all built-in analyzers.
+    static void initialize(const std::string& directory, const std::string& names) {
+        outputDirectory = directory;
+        std::filesystem::create_directories(directory);
+
+        std::stringstream list(names.empty() ? "density,profile,momentum,clumps" : names);
+        std::string name;
+        while (std::getline(list, name, ',')) {
+            if (!name.empty()) add(create(name));
+        }
+    }
+
+    static bool isActive() {
+        return !analyzers.empty() && config.analysisInterval > 0;
+    }
+
+    // Called after every step.
+    static void observe(uint64_t step) {
+        if (!isActive() || step % config.analysisInterval != 0) return;
+        run(step);
+    }
+
+    static void run(uint64_t step) {
+        TRACE_ZONE("Analysis::run");
+        std::vector<Particle>& particles = Particle::particles;
+        frame = AnalysisFrame();
+        frame.step = step;
+        frame.particles = &particles;
+        frame.tree = quadTree.root;
+
+        // Moments first, every analyzer measures relative to them.
+        {
+            std::vector<std::array<double, 5>> sums(chunkCount);    // m, m x, m y, m vx, m vy
+            TaskGraph graph;
+            addChunks(graph, "analysis moments", particles.size(), [&](int chunk, size_t start, size_t end) {
+                std::array<double, 5> sum = {};
+                for (size_t i = start; i < end; i++) {
+                    const Particle& particle = particles[i];
+                    sum[0] += particle.mass;
+                    sum[1] += particle.mass * particle.position.x;
+                    sum[2] += particle.mass * particle.position.y;
+                    sum[3] += particle.mass * particle.velocity.x;
+                    sum[4] += particle.mass * particle.velocity.y;
+                }
+                sums[chunk] = sum;
+            });
+            graph.run();
+
+            std::array<double, 5> total = {};
+            for (const auto& sum : sums) {
+                for (int k = 0; k < 5; k++) total[k] += sum[k];
+            }
+            frame.totalMass = total[0];
+            if (total[0] > 0.0) {
+                frame.centerOfMass = sf::Vector2f(total[1] / total[0], total[2] / total[0]);
+                frame.bulkVelocity = sf::Vector2f(total[3] / total[0], total[4] / total[0]);
+            }
+        }
+
+        TaskGraph graph;
+        for (auto& analyzer : analyzers) {
+            analyzer->schedule(graph, frame);
+        }
+        graph.run();
+
+        for (size_t i = 0; i < analyzers.size(); i++) {
+            std::fprintf(outputs[i], "{\"step\":%llu,", static_cast<unsigned long long>(step));
+            analyzers[i]->write(outputs[i]);
+            std::fprintf(outputs[i], "}\n");
+            std::fflush(outputs[i]);
+        }
+    }
+
+    static void finish() {
+        for (FILE* output : outputs) {
+            std::fclose(output);
+        }
+        outputs.clear();
+        analyzers.clear();
+    }
+
+    static void writeArray(FILE* output, const char* name, const std::vector<double>& values) {
+        std::fprintf(output, "\"%s\":[", name);
+        for (size_t i = 0; i < values.size(); i++) {
+            std::fprintf(output, "%s%.6g", i ? "," : "", values[i]);
+        }
+        std::fprintf(output, "]");
+    }
+};
+
+// Mass per cell of a grid over the window. The grid is a power of two, so
+// its cells line up with quadtree nodes and a node no larger than a cell is
+// added whole. Each top level subtree covers its own cells and is a task.
+class DensityMap : public Analyzer {
+public:
+    constexpr static int size = 64;
+    constexpr static int taskDepth = 2;
+
+    std::vector<double> mass;
+
+    const char* name() const override { return "density"; }
+
+    void schedule(TaskGraph& graph, const AnalysisFrame& frame) override {
+        mass.assign(size * size, 0.0);
+
+        std::vector<const Node*> subtrees;
+        collect(frame.tree, taskDepth, subtrees);
+        for (const Node* subtree : subtrees) {
+            graph.add("analysis density", [this, subtree]() {
+                // Cells are clamped to the subtree's own, so tasks never share one.
+                int first = static_cast<int>(std::lround(subtree->position.x / cellSize()));
+                int top = static_cast<int>(std::lround(subtree->position.y / cellSize()));
+                int span = std::max(1, static_cast<int>(std::lround(subtree->size / cellSize())));
+                deposit(subtree, first, top, span);
+            });
+        }
+    }
+
+    void write(FILE* output) const override {
+        std::fprintf(output, "\"size\":%d,\"cellSize\":%.6g,", size, cellSize());
+        Analysis::writeArray(output, "mass", mass);
+    }
+
+private:
+    static float cellSize() {
+        return static_cast<float>(Config::windowWidth) / size;
+    }
+
+    static void collect(const Node* node, int depth, std::vector<const Node*>& nodes) {
+        if (!node || node->totalMass <= 0.0f) return;
+        if (depth == 0 || node->isLeaf) {
+            nodes.push_back(node);
+            return;
+        }
+        for (const Node* child : node->children) {
+            collect(child, depth - 1, nodes);
+        }
+    }
+
+    void deposit(const Node* node, int first, int top, int span) {
+        if (!node || node->totalMass <= 0.0f) return;
+
+        if (node->isLeaf || node->size <= cellSize()) {
+            int column = std::clamp(static_cast<int>(node->centerOfMass.x / cellSize()), first, std::min(size, first + span) - 1);
+            int row = std::clamp(static_cast<int>(node->centerOfMass.y / cellSize()), top, std::min(size, top + span) - 1);
+            mass[row * size + column] += node->totalMass;
+            return;
+        }
+        for (const Node* child : node->children) {
+            deposit(child, first, top, span);
+        }
+    }
+};
+
+// Annuli about the center of mass, velocities relative to the bulk motion.
+class RadialProfile : public Analyzer {
+public:
+    constexpr static int bins = 32;
+
+    struct Bins {
+        std::array<double, bins> mass = {};
+        std::array<double, bins> count = {};
+        std::array<double, bins> radialMomentum = {};
+        std::array<double, bins> tangentialMomentum = {};
+    };
+
+    std::vector<Bins> chunks;
+    Bins total;
+
+    const char* name() const override { return "profile"; }
+
+    static float maxRadius() {
+        return 0.5f * std::min(Config::windowWidth, Config::windowHeight);
+    }
+
+    void schedule(TaskGraph& graph, const AnalysisFrame& frame) override {
+        chunks.assign(Analysis::chunkCount, Bins());
+        const std::vector<Particle>& particles = *frame.particles;
+        const sf::Vector2f center = frame.centerOfMass;
+        const sf::Vector2f bulk = frame.bulkVelocity;
+        const float binWidth = maxRadius() / bins;
+
+        std::vector<int> parts = Analysis::addChunks(graph, "analysis profile", particles.size(),
+            [this, &particles, center, bulk, binWidth](int chunk, size_t start, size_t end) {
+                Bins& own = chunks[chunk];
+                for (size_t i = start; i < end; i++) {
+                    const Particle& particle = particles[i];
+                    sf::Vector2f offset = particle.position - center;
+                    float radius = std::sqrt(offset.x * offset.x + offset.y * offset.y);
+                    int bin = static_cast<int>(radius / binWidth);
+                    if (bin >= bins) continue;
+
+                    sf::Vector2f velocity = particle.velocity - bulk;
+                    float radial = radius > 0.0f ? (offset.x * velocity.x + offset.y * velocity.y) / radius : 0.0f;
+                    float tangential = radius > 0.0f ? (offset.x * velocity.y - offset.y * velocity.x) / radius : 0.0f;
+
+                    own.mass[bin] += particle.mass;
+                    own.count[bin] += 1.0;
+                    own.radialMomentum[bin] += particle.mass * radial;
+                    own.tangentialMomentum[bin] += particle.mass * tangential;
+                }
+            });
+
+        graph.add("analysis profile reduce", [this]() {
+            total = Bins();
+            for (const Bins& chunk : chunks) {
+                for (int b = 0; b < bins; b++) {
+                    total.mass[b] += chunk.mass[b];
+                    total.count[b] += chunk.count[b];
+                    total.radialMomentum[b] += chunk.radialMomentum[b];
+                    total.tangentialMomentum[b] += chunk.tangentialMomentum[b];
+                }
+            }
+        }, parts);
+    }
+
+    void write(FILE* output) const override {
+        const double binWidth = maxRadius() / bins;
+        std::vector<double> mass(bins), count(bins), density(bins), radial(bins), tangential(bins);
+        for (int b = 0; b < bins; b++) {
+            double area = M_PI * binWidth * binWidth * ((b + 1) * (b + 1) - b * b);
+            mass[b] = total.mass[b];
+            count[b] = total.count[b];
+            density[b] = total.mass[b] / area;
+            radial[b] = total.mass[b] > 0.0 ? total.radialMomentum[b] / total.mass[b] : 0.0;
+            tangential[b] = total.mass[b] > 0.0 ? total.tangentialMomentum[b] / total.mass[b] : 0.0;
+        }
+
+        std::fprintf(output, "\"binWidth\":%.6g,", binWidth);
+        Analysis::writeArray(output, "mass", mass);
+        std::fprintf(output, ",");
+        Analysis::writeArray(output, "count", count);
+        std::fprintf(output, ",");
+        Analysis::writeArray(output, "surfaceDensity", density);
+        std::fprintf(output, ",");
+        Analysis::writeArray(output, "radialVelocity", radial);
+        std::fprintf(output, ",");
+        Analysis::writeArray(output, "tangentialVelocity", tangential);
+    }
+};
+
+// Angular momentum about the center of mass and kinetic energy.
+class Momentum : public Analyzer {
+public:
+    std::vector<std::array<double, 3>> chunks;  // Lz, kinetic, internal kinetic
+    std::array<double, 3> total = {};
+    size_t count = 0;
+    double mass = 0.0;
+    sf::Vector2f centerOfMass;
+    sf::Vector2f bulkVelocity;
+
+    const char* name() const override { return "momentum"; }
+
+    void schedule(TaskGraph& graph, const AnalysisFrame& frame) override {
+        chunks.assign(Analysis::chunkCount, {});
+        const std::vector<Particle>& particles = *frame.particles;
+        count = particles.size();
+        mass = frame.totalMass;
+        centerOfMass = frame.centerOfMass;
+        bulkVelocity = frame.bulkVelocity;
+
+        const sf::Vector2f center = centerOfMass;
+        const sf::Vector2f bulk = bulkVelocity;
+        std::vector<int> parts = Analysis::addChunks(graph, "analysis momentum", particles.size(),
+            [this, &particles, center, bulk](int chunk, size_t start, size_t end) {
+                std::array<double, 3> sum = {};
+                for (size_t i = start; i < end; i++) {
+                    const Particle& particle = particles[i];
+                    sf::Vector2f offset = particle.position - center;
+                    sf::Vector2f velocity = particle.velocity - bulk;
+                    sum[0] += particle.mass * (offset.x * velocity.y - offset.y * velocity.x);
+                    sum[1] += 0.5 * particle.mass * (particle.velocity.x * particle.velocity.x + particle.velocity.y * particle.velocity.y);
+                    sum[2] += 0.5 * particle.mass * (velocity.x * velocity.x + velocity.y * velocity.y);
+                }
+                chunks[chunk] = sum;
+            });
+
+        graph.add("analysis momentum reduce", [this]() {
+            total = {};
+            for (const auto& chunk : chunks) {
+                for (int k = 0; k < 3; k++) total[k] += chunk[k];
+            }
+        }, parts);
+    }
+
+    void write(FILE* output) const override {
+        std::fprintf(output,
+            "\"particles\":%zu,\"mass\":%.6g,\"centerOfMass\":[%.6g,%.6g],\"bulkVelocity\":[%.6g,%.6g],"
+            "\"angularMomentum\":%.6g,\"kineticEnergy\":%.6g,\"internalKineticEnergy\":%.6g",
+            count, mass, centerOfMass.x, centerOfMass.y, bulkVelocity.x, bulkVelocity.y,
+            total[0], total[1], total[2]);
+    }
+};
+
+// Friends-of-friends groups: particles closer than linkingLength belong to
+// the same clump. Candidates come from the collision grid, refilled with
+// the current positions. Union-find runs as one task next to the others.
+class Clumps : public Analyzer {
+public:
+    constexpr static float linkingLength = 2.0f * Config::particleSize;
+    constexpr static int minMembers = 8;        // Smaller groups are only counted
+    constexpr static int maxListed = 50;        // Most massive clumps written out
+
+    struct Clump {
+        int members = 0;
+        double mass = 0.0;
+        sf::Vector2f center;
+        sf::Vector2f velocity;
+        float radius = 0.0f;                    // RMS distance from the center
+    };
+
+    std::vector<uint32_t> parent;
+    std::vector<Clump> clumps;
+    size_t groups = 0;
+
+    const char* name() const override { return "clumps"; }
+
+    void schedule(TaskGraph& graph, const AnalysisFrame& frame) override {
+        std::vector<Particle>* particles = frame.particles;
+        graph.add("analysis clumps", [this, particles]() { find(*particles); });
+    }
+
+    void write(FILE* output) const override {
+        std::fprintf(output, "\"linkingLength\":%.6g,\"minMembers\":%d,\"groups\":%zu,\"clumps\":%zu,\"list\":[",
+                     linkingLength, minMembers, groups, clumps.size());
+        for (size_t i = 0; i < clumps.size() && i < static_cast<size_t>(maxListed); i++) {
+            const Clump& clump = clumps[i];
+            std::fprintf(output, "%s{\"members\":%d,\"mass\":%.6g,\"center\":[%.6g,%.6g],\"velocity\":[%.6g,%.6g],\"radius\":%.6g}",
+                         i ? "," : "", clump.members, clump.mass, clump.center.x, clump.center.y,
+                         clump.velocity.x, clump.velocity.y, clump.radius);
+        }
+        std::fprintf(output, "]");
+    }
+
+private:
+    uint32_t root(uint32_t i) {
+        while (parent[i] != i) {
+            parent[i] = parent[parent[i]];
+            i = parent[i];
+        }
+        return i;
+    }
+
+    void join(uint32_t a, uint32_t b) {
+        a = root(a);
+        b = root(b);
+        if (a != b) parent[std::max(a, b)] = std::min(a, b);
+    }
+
+    void find(std::vector<Particle>& particles) {
+        TRACE_ZONE("Clumps::find");
+        CollisionGrid::assignParticlesToGrid(particles);
+
+        const Particle* base = particles.data();
+        const int nColumns = CollisionGrid::nColumns;
+        const int nRows = CollisionGrid::nRows;
+        const int reach = static_cast<int>(std::ceil(linkingLength / CollisionGrid::cellSize));
+        const float linkingSquared = linkingLength * linkingLength;
+
+        parent.resize(particles.size());
+        std::iota(parent.begin(), parent.end(), 0u);
+
+        for (int col = 0; col < nColumns; col++) {
+            for (int row = 0; row < nRows; row++) {
+                for (const Particle* particle1 : CollisionGrid::cells[col][row]) {
+                    const uint32_t i = static_cast<uint32_t>(particle1 - base);
+
+                    for (int adjCol = std::max(0, col - reach); adjCol <= std::min(nColumns - 1, col + reach); adjCol++) {
+                        for (int adjRow = std::max(0, row - reach); adjRow <= std::min(nRows - 1, row + reach); adjRow++) {
+                            for (const Particle* particle2 : CollisionGrid::cells[adjCol][adjRow]) {
+                                if (particle2 <= particle1) continue;   // Each pair once
+
+                                sf::Vector2f d = particle2->position - particle1->position;
+                                if (d.x * d.x + d.y * d.y < linkingSquared) {
+                                    join(i, static_cast<uint32_t>(particle2 - base));
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+
+        // Sums per group, indexed by the group's root (its lowest index).
+        std::vector<int> members(particles.size(), 0);
+        std::vector<std::array<double, 5>> sums(particles.size());     // m, m x, m y, m vx, m vy
+        for (uint32_t i = 0; i < particles.size(); i++) {
+            uint32_t r = root(i);
+            const Particle& particle = particles[i];
+            members[r]++;
+            sums[r][0] += particle.mass;
+            sums[r][1] += particle.mass * particle.position.x;
+            sums[r][2] += particle.mass * particle.position.y;
+            sums[r][3] += particle.mass * particle.velocity.x;
+            sums[r][4] += particle.mass * particle.velocity.y;
+        }
+
+        groups = 0;
+        clumps.clear();
+        std::vector<int> clumpOf(particles.size(), -1);
+        for (uint32_t i = 0; i < particles.size(); i++) {
+            if (members[i] == 0) continue;
+            groups++;
+            if (members[i] < minMembers) continue;
+
+            Clump clump;
+            clump.members = members[i];
+            clump.mass = sums[i][0];
+            clump.center = sf::Vector2f(sums[i][1] / sums[i][0], sums[i][2] / sums[i][0]);
+            clump.velocity = sf::Vector2f(sums[i][3] / sums[i][0], sums[i][4] / sums[i][0]);
+            clumpOf[i] = static_cast<int>(clumps.size());
+            clumps.push_back(clump);
+        }
+
+        std::vector<double> spread(clumps.size(), 0.0);
+        for (uint32_t i = 0; i < particles.size(); i++) {
+            int c = clumpOf[root(i)];
+            if (c < 0) continue;
+            sf::Vector2f offset = particles[i].position - clumps[c].center;
+            spread[c] += particles[i].mass * (offset.x * offset.x + offset.y * offset.y);
+        }
+        for (size_t c = 0; c < clumps.size(); c++) {
+            clumps[c].radius = static_cast<float>(std::sqrt(spread[c] / clumps[c].mass));
+        }
+
+        std::stable_sort(clumps.begin(), clumps.end(), [](const Clump& a, const Clump& b) { return a.mass > b.mass; });
+    }
+};
+
+std::unique_ptr<Analyzer> Analysis::create(const std::string& name) {
+    if (name == "density") return std::make_unique<DensityMap>();
+    if (name == "profile") return std::make_unique<RadialProfile>();
+    if (name == "momentum") return std::make_unique<Momentum>();
+    if (name == "clumps") return std::make_unique<Clumps>();
+    throw std::invalid_argument("Unknown analysis: " + name);
+}
+
+std::string Analysis::outputDirectory;
+std::vector<std::unique_ptr<Analyzer>> Analysis::analyzers;
+std::vector<FILE*> Analysis::outputs;
+AnalysisFrame Analysis::frame;
@@ -5,7 +5,16 @@
 #include "Particle.hpp"
 #include "WindowManager.hpp"
 #include "Solver.hpp"
-
+#include "Trace.hpp"
+#include "Camera.hpp"
+#include "FrameGovernor.hpp"
+#include "ParticleMesh.hpp"
+#include "Numa.hpp"
+#include "PerfCounters.hpp"
+#include "RigidBodies.hpp"
+
+#include <algorithm>
+#include <atomic>
 #include <thread>
 #include <vector>
 #include <functional>
@@ -18,6 +27,7 @@ struct Node {
     sf::Vector2f centerOfMass; // Center of mass for the node
     float size;                // Size of the node (width and height)
     float totalMass = 0.0f;    // Total mass in the node
+    array<float, 3> quadrupole = {0.0f, 0.0f, 0.0f}; // Second mass moment about centerOfMass: xx, xy, yy
     bool isLeaf = true;        // Leaf status
     Particle* particle = nullptr; // Pointer to a particle (if any)
     array<Node*, 4> children = {nullptr, nullptr, nullptr, nullptr};
@@ -29,7 +39,10 @@ struct Node {
     // Rendering //
     // sf::RectangleShape rectangle;
 
-    static vector<Node*> nodePool;
+    int homeNode = 0;          // NUMA node whose pool this came from
+
+    // One pool per NUMA node (just one without --numa)
+    static vector<vector<Node*>> nodePools;
     static mutex poolMutex;
 
     Node(const sf::Vector2f& position, float size)
@@ -48,29 +61,64 @@ struct Node {
     }
 
     static Node* acquireNode() {
-        lock_guard<mutex> lock(poolMutex);
-        if (!nodePool.empty()) {
-            Node* node = nodePool.back();
-            nodePool.pop_back();
-            return node;
+        int home = 0;
+        {
+            lock_guard<mutex> lock(poolMutex);
+            if (nodePools.empty()) nodePools.resize(1);
+            home = std::min(Numa::currentNode, static_cast<int>(nodePools.size()) - 1);
+
+            vector<Node*>& nodePool = nodePools[home];
+            if (!nodePool.empty()) {
+                Node* node = nodePool.back();
+                nodePool.pop_back();
+                return node;
+            }
         }
-        
-        return new Node({0.0f, 0.0f}, 0.0f);
+
+        // Allocated by the calling worker, so first touched on its node.
+        Node* node = new Node({0.0f, 0.0f}, 0.0f);
+        node->homeNode = home;
+        return node;
     }
 
     static void releaseNode(Node* node) {
         if (node) {
             node->resetNode(); 
             lock_guard<mutex> lock(poolMutex);
-            nodePool.push_back(node);
+            nodePools[node->homeNode].push_back(node);
         }
     }
 
 
+    // With NUMA each node's share is allocated by a thread pinned there.
     static void initializeNodePool(int nodeCount) {
-        lock_guard<mutex> lock(poolMutex);
-        for (int i = 0; i < nodeCount; i++) {
-            nodePool.push_back(new Node({0.0f, 0.0f}, 0.0f));
+        const int numaNodes = Numa::nodeCount();
+        nodePools.resize(numaNodes);
+
+        auto fill = [](int home, int count) {
+            if (Numa::isActive()) Numa::pinToNode(home);
+
+            vector<Node*> nodes;
+            for (int i = 0; i < count; i++) {
+                nodes.push_back(new Node({0.0f, 0.0f}, 0.0f));
+                nodes.back()->homeNode = home;
+            }
+
+            lock_guard<mutex> lock(poolMutex);
+            nodePools[home].insert(nodePools[home].end(), nodes.begin(), nodes.end());
+        };
+
+        if (numaNodes == 1) {
+            fill(0, nodeCount);
+            return;
+        }
+
+        vector<thread> threads;
+        for (int home = 0; home < numaNodes; home++) {
+            threads.emplace_back(fill, home, nodeCount / numaNodes);
+        }
+        for (auto& t : threads) {
+            t.join();
         }
     }
 
@@ -80,6 +128,7 @@ struct Node {
         centerOfMass = {0.0f, 0.0f};
         size = 0.0f;
         totalMass = 0.0f;
+        quadrupole = {0.0f, 0.0f, 0.0f};
         isLeaf = true;
         particle = nullptr;
 
@@ -116,6 +165,7 @@ struct Node {
         particle = nullptr;
         totalMass = 0.0f;
         centerOfMass = {0.0f, 0.0f};
+        quadrupole = {0.0f, 0.0f, 0.0f};
     }
 
     bool contains(const Particle& particle) const {
@@ -152,7 +202,7 @@ struct Node {
     void _insert(vector<Particle>& particles) {
         if (particles.empty()) return;
 
-        const int numThreads = min(thread::hardware_concurrency(), static_cast<unsigned int>(particles.size()));
+        const int numThreads = min(config.threads(), static_cast<int>(particles.size()));
         vector<thread> threads;
         int particlesPerThread = particles.size() / numThreads;
 
@@ -160,7 +210,10 @@ struct Node {
             int particleStart = i * particlesPerThread;
             int particleEnd = (i == numThreads - 1) ? particles.size() : particleStart + particlesPerThread;
 
-            threads.emplace_back([this, &particles, particleStart, particleEnd]() {
+            threads.emplace_back([this, &particles, particleStart, particleEnd, i, numThreads]() {
+                TRACE_ZONE("insert worker");
+                PERF_ZONE(PerfPhase::Gravity);
+                Numa::pinWorker(i, numThreads);
                 for (int j = particleStart; j < particleEnd; j++) {
                     this->insert(particles[j]);
                 }
@@ -224,16 +277,26 @@ struct Node {
 
 
 
-    // Compute center of mass using DFS
-    void computeMassDistribution() {
-        if (isLeaf) return;
+    // Compute center of mass and quadrupole moment using DFS. A leaf holds
+    // a single particle, so its moment about its center of mass is zero.
+    // With `refit`, leaves re-read their particle first, so the moments
+    // follow particles that moved since they were inserted.
+    void computeMassDistribution(bool refit = false) {
+        if (isLeaf) {
+            if (refit && particle) {
+                centerOfMass = particle->position;
+                totalMass = particle->mass;
+            }
+            quadrupole = {0.0f, 0.0f, 0.0f};
+            return;
+        }
 
         totalMass = 0.0f;
         centerOfMass = {0.0f, 0.0f};
 
         for (auto& child : children) {
             if (child) {
-                child->computeMassDistribution();
+                child->computeMassDistribution(refit);
 
                 totalMass += child->totalMass;
 
@@ -246,13 +309,68 @@ struct Node {
             centerOfMass.x /= totalMass;
             centerOfMass.y /= totalMass;
         }
+
+        // Shift each child's moment to our center of mass (parallel axis).
+        quadrupole = {0.0f, 0.0f, 0.0f};
+        for (auto& child : children) {
+            if (child && child->totalMass > 0) {
+                sf::Vector2f offset = child->centerOfMass - centerOfMass;
+                quadrupole[0] += child->quadrupole[0] + child->totalMass * offset.x * offset.x;
+                quadrupole[1] += child->quadrupole[1] + child->totalMass * offset.x * offset.y;
+                quadrupole[2] += child->quadrupole[2] + child->totalMass * offset.y * offset.y;
+            }
+        }
     }
 
-    void calculateForce(Particle& particle, const Node* node) {
+    // Tunables read once per force pass rather than from the global config
+    // on every visit.
+    struct ForceParams {
+        float theta;
+        float gravitationalConstant;
+        float softening;
+        float splitRadius = 0.0f;   // TreePM only, see ParticleMesh
+        float cutoff = 0.0f;
+        bool quadrupole = false;
+
+        static ForceParams fromConfig() {
+            ForceParams params = {FrameGovernor::theta(), config.gravitational_constant, config.gravitationalSoftening};
+            params.quadrupole = config.multipoleOrder >= 2;
+            if (config.gravitySolver == Config::GravitySolver::TreePM) {
+                params.splitRadius = ParticleMesh::splitRadius();
+                params.cutoff = ParticleMesh::cutoffSplits * params.splitRadius;
+            }
+            return params;
+        }
+    };
+
+    // Softened is a template parameter so the common unsoftened / softened
+    // cases compile to the same code as when softening was a constant.
+    // ShortRange adds only the part of the force the mesh leaves out and
+    // skips nodes beyond the cutoff.
+    //
+    // Quadrupole adds the second order term of the expansion of the node's
+    // mass about its center of mass (the first order term vanishes there).
+    // For the law f(r) = G / (r^2 + eps) and d = center - particle:
+    //
+    //     a = M g d + h Q d + (k (d.Q.d) + h tr Q) d / 2
+    //     g = G / (r u),  h = g' / r,  k = h' / r,  u = r^2 + eps
+    //
+    // which holds the same force error at a noticeably larger theta. It is
+    // not combined with ShortRange, whose nodes are all close anyway.
+    template <bool Softened, bool ShortRange = false, bool Quadrupole = false>
+    void calculateForce(Particle& particle, const Node* node, const ForceParams& params) {
         if (node->particle == &particle && node->isLeaf) {
             return;
         }
 
+        if (ShortRange) {
+            float dx = std::max({node->position.x - particle.position.x, 0.0f,
+                                 particle.position.x - (node->position.x + node->size)});
+            float dy = std::max({node->position.y - particle.position.y, 0.0f,
+                                 particle.position.y - (node->position.y + node->size)});
+            if (dx * dx + dy * dy > params.cutoff * params.cutoff) return;
+        }
+
         sf::Vector2f direction = node->centerOfMass - particle.position;
         float distance = sqrt(direction.x * direction.x + direction.y * direction.y);
         
@@ -264,18 +382,39 @@ struct Node {
 
         // Here we check if the we meet the approximation criteria, if so use that 
         // data, if not recurse into children to get a more accurate force.
-        if (node->isLeaf || (node->size / distance < config.theta)) {
-            float force = 
-                (config.gravitational_constant * particle.mass * node->totalMass) / 
-                ((distance * distance) + config.gravitationalSoftening);
+        if (node->isLeaf || (node->size < params.theta * distance)) {
+            float distanceSquared = distance * distance;
+            if (Softened) distanceSquared += params.softening;
+
+            float force = (params.gravitationalConstant * particle.mass * node->totalMass) / distanceSquared;
+            if (ShortRange) force *= std::erfc(distance / (2.0f * params.splitRadius));
 
             sf::Vector2f forceVector = (force / distance) * direction;
+
+            if (Quadrupole && !node->isLeaf) {
+                const array<float, 3>& q = node->quadrupole;
+                float invR = 1.0f / distance;
+                float invR2 = invR * invR;
+                float invU = 1.0f / distanceSquared;
+                float g = params.gravitationalConstant * invR * invU;
+
+                float h = -g * (invR2 + 2.0f * invU);
+                float k = g * (3.0f * invR2 * invR2 + 4.0f * invR2 * invU + 8.0f * invU * invU);
+
+                sf::Vector2f qd(q[0] * direction.x + q[1] * direction.y,
+                                q[1] * direction.x + q[2] * direction.y);
+                float dqd = direction.x * qd.x + direction.y * qd.y;
+                float radial = 0.5f * (k * dqd + h * (q[0] + q[2]));
+
+                forceVector += particle.mass * (h * qd + radial * direction);
+            }
+
             particle.force += forceVector;
 
         } else {
             for (auto& child : node->children) {
                 if (child) {
-                    calculateForce(particle, child);
+                    calculateForce<Softened, ShortRange, Quadrupole>(particle, child, params);
                 }
             }
         }
@@ -283,7 +422,7 @@ struct Node {
 
 };
 
-std::vector<Node*> Node::nodePool;
+std::vector<std::vector<Node*>> Node::nodePools;
 std::mutex Node::poolMutex;
 
 class QuadTree {
@@ -306,27 +445,141 @@ public:
     }
 
     void update() {
-        sf::Clock clock; // Create a clock for timing
-        
-        clock.restart();
-        reset();
-        cout << "reset() took: " << clock.getElapsedTime().asMicroseconds() << " us" << endl;
+        TRACE_ZONE("QuadTree::update");
+        build();
+        {
+            TRACE_ZONE("QuadTree::calculateForces");
+            calculateForces(Particle::particles);
+        }
+    }
 
-        clock.restart();
-        insert(Particle::particles);
-        cout << "insert() took: " << clock.getElapsedTime().asMicroseconds() << " us" << endl;
+    // Builds the tree and its mass distribution without computing forces.
+    void build() {
+        {
+            TRACE_ZONE("QuadTree::reset");
+            reset();
+        }
+        {
+            TRACE_ZONE("QuadTree::insert");
+            insert(Particle::particles);
+        }
+        {
+            TRACE_ZONE("QuadTree::computeMassDistribution");
+            computeMassDistribution();
+        }
+        collectHidden();
+    }
 
-        clock.restart();
-        computeMassDistribution();
-        cout << "computeMassDistribution() took: " << clock.getElapsedTime().asMicroseconds() << " us" << endl;
+    /*
+    Updates the moments of the existing tree from the current particle
+    positions without re-inserting anything. Only valid while the particles
+    the tree was built from are still in place (no inserts, removals or
+    reallocation). Particles keep the leaf they were inserted in, so the
+    tree gets less accurate as they move away from it; callers rebuild once
+    they have moved too far.
+    */
+    void refit() {
+        TRACE_ZONE("QuadTree::refit");
+        root->computeMassDistribution(true);
+        collectHidden();
+    }
 
-        clock.restart();
-        calculateForces(Particle::particles);
-        cout << "calculateForces() took: " << clock.getElapsedTime().asMicroseconds() << " us" << endl;
+    // Rigid body centers are in the tree for gravity, but their members
+    // are drawn one by one.
+    void collectHidden() {
+        const vector<Particle>& particles = Particle::particles;
+        size_t end = std::min(RigidBodies::firstSurface, particles.size());
+        size_t begin = std::min(RigidBodies::firstBody, end);
+        lodHidden.assign(particles.begin() + begin, particles.begin() + end);
     }
     
     void insert(vector<Particle>& particles) {
-        root->_insert(particles);
+        if (config.deterministic) insertOrdered(particles);
+        else root->_insert(particles);
+    }
+
+    /*
+    Ordered construction for deterministic runs. Concurrent inserts into one
+    tree race on the nodes they share near the root, so instead the root is
+    split to a fixed depth and every resulting subtree is filled by a single
+    thread, in particle index order. Which thread that is does not matter,
+    and the masses are summed afterwards by computeMassDistribution in child
+    order, so the tree is the same for any thread count.
+    */
+    constexpr static int orderedDepth = 4;
+    constexpr static size_t orderedSubtrees = size_t(1) << (2 * orderedDepth);
+
+    vector<Node*> subtrees;                     // Leaves of the split, in a fixed order
+    vector<vector<uint32_t>> subtreeParticles;  // Particle indices per subtree
+
+    static void split(Node* node, int depth, vector<Node*>& leaves) {
+        if (depth == 0) {
+            leaves.push_back(node);
+            return;
+        }
+        node->subdivide();
+        for (Node* child : node->children) {
+            split(child, depth - 1, leaves);
+        }
+    }
+
+    // Splits the (reset) root and sorts the particles into the subtrees.
+    void prepareOrderedInsert(const vector<Particle>& particles) {
+        subtrees.clear();
+        split(root, orderedDepth, subtrees);
+        subtreeParticles.resize(subtrees.size());
+        for (auto& indices : subtreeParticles) {
+            indices.clear();
+        }
+
+        for (uint32_t i = 0; i < particles.size(); i++) {
+            const Node* node = root;
+            if (!node->contains(particles[i])) continue;
+
+            size_t index = 0;
+            for (int depth = 0; depth < orderedDepth; depth++) {
+                int quadrant = 0;
+                while (quadrant < 3 && !node->children[quadrant]->contains(particles[i])) quadrant++;
+                node = node->children[quadrant];
+                index = index * 4 + quadrant;
+            }
+            subtreeParticles[index].push_back(i);
+        }
+    }
+
+    void insertSubtree(size_t subtree, vector<Particle>& particles) {
+        for (uint32_t index : subtreeParticles[subtree]) {
+            subtrees[subtree]->insert(particles[index]);
+        }
+    }
+
+    void insertOrdered(vector<Particle>& particles) {
+        prepareOrderedInsert(particles);
+
+        // Largest subtrees first, so a dense clump does not end up last.
+        vector<size_t> order(subtrees.size());
+        for (size_t s = 0; s < order.size(); s++) order[s] = s;
+        std::sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+            return subtreeParticles[a].size() > subtreeParticles[b].size();
+        });
+
+        const int numThreads = std::max(1, std::min(config.threads(), static_cast<int>(subtrees.size())));
+        std::atomic<size_t> next(0);
+        vector<thread> threads;
+        for (int i = 0; i < numThreads; i++) {
+            threads.emplace_back([this, &particles, &order, &next, i, numThreads]() {
+                TRACE_ZONE("insert worker");
+                PERF_ZONE(PerfPhase::Gravity);
+                Numa::pinWorker(i, numThreads);
+                for (size_t s = next++; s < order.size(); s = next++) {
+                    insertSubtree(order[s], particles);
+                }
+            });
+        }
+
+        for (auto& t : threads) {
+            t.join();
+        }
     }
 
     // void render() {
@@ -356,6 +609,7 @@ public:
 
             root->centerOfMass = {0.0f, 0.0f}; 
             root->totalMass = 0.0f;
+            root->quadrupole = {0.0f, 0.0f, 0.0f};
             root->isLeaf = true;
             root->particle = nullptr;
             root->children.fill(nullptr);
@@ -363,30 +617,114 @@ public:
     }
 
 
+    vector<Particle> lodHidden;     // Particles in the tree that collectLevelOfDetail leaves out
+
+    // Appends what `camera` can see to positions/masses. Nodes smaller than
+    // camera.lodPixels on screen are emitted as one point at their center of
+    // mass, so the output grows with the number of visible pixels rather than
+    // with the number of particles.
+    void collectLevelOfDetail(const CameraState& camera, vector<sf::Vector2f>& positions, vector<float>& masses) const {
+        TRACE_ZONE("QuadTree::collectLevelOfDetail");
+        collectLevelOfDetail(root, camera.visibleRect(), camera.lodPixels / camera.zoom, lodHidden, positions, masses);
+    }
+
+    // `hidden` holds the lodHidden particles inside `node`, whose mass is
+    // taken back out of what it emits.
+    static void collectLevelOfDetail(const Node* node, const sf::FloatRect& visible, float minSize,
+                                     const vector<Particle>& hidden,
+                                     vector<sf::Vector2f>& positions, vector<float>& masses) {
+        if (!node || node->totalMass <= 0.0f) return;
+
+        if (node->position.x > visible.left + visible.width || node->position.x + node->size < visible.left ||
+            node->position.y > visible.top + visible.height || node->position.y + node->size < visible.top) {
+            return;
+        }
+
+        vector<Particle> inside;
+        for (const Particle& particle : hidden) {
+            if (node->contains(particle)) inside.push_back(particle);
+        }
+
+        // Leaves use the stored center of mass rather than the particle, which
+        // may have moved or been erased since the tree was built.
+        if (node->isLeaf || node->size < minSize) {
+            float mass = node->totalMass;
+            sf::Vector2f moment = node->centerOfMass * node->totalMass;
+            for (const Particle& particle : inside) {
+                mass -= particle.mass;
+                moment -= particle.position * particle.mass;
+            }
+            if (mass <= node->totalMass * 1e-5f) return;
+
+            positions.push_back(moment / mass);
+            masses.push_back(mass);
+            return;
+        }
+
+        for (const Node* child : node->children) {
+            collectLevelOfDetail(child, visible, minSize, inside, positions, masses);
+        }
+    }
+
     void _calculateForces(vector<Particle>& particles) {
+        const Node::ForceParams params = Node::ForceParams::fromConfig();
         for (auto& particle : particles) {
-            root->calculateForce(particle, root);
+            root->calculateForce<true>(particle, root, params);
+        }
+    }
+
+    template <bool Softened, bool ShortRange, bool Quadrupole = false>
+    void calculateForceRange(vector<Particle>& particles, const vector<uint32_t>* subset,
+                             size_t start, size_t end, const Node::ForceParams& params) {
+        for (size_t i = start; i < end; ++i) {
+            Particle& particle = subset ? particles[(*subset)[i]] : particles[i];
+            root->calculateForce<Softened, ShortRange, Quadrupole>(particle, root, params);
+        }
+    }
+
+    // Picks the calculateForce variant that matches params.
+    void calculateForceRange(vector<Particle>& particles, const vector<uint32_t>* subset,
+                             size_t start, size_t end, const Node::ForceParams& params) {
+        bool softened = params.softening > 0.0f;
+        if (params.splitRadius > 0.0f) {
+            if (softened) calculateForceRange<true, true>(particles, subset, start, end, params);
+            else calculateForceRange<false, true>(particles, subset, start, end, params);
+        } else if (params.quadrupole) {
+            if (softened) calculateForceRange<true, false, true>(particles, subset, start, end, params);
+            else calculateForceRange<false, false, true>(particles, subset, start, end, params);
+        } else {
+            if (softened) calculateForceRange<true, false>(particles, subset, start, end, params);
+            else calculateForceRange<false, false>(particles, subset, start, end, params);
         }
     }
 
     void calculateForces(vector<Particle>& particles) {
-        const size_t numThreads = thread::hardware_concurrency();
-        const size_t numParticles = particles.size();
+        calculateForces(particles, Node::ForceParams::fromConfig());
+    }
+
+    // Walks the tree for every particle, or only for the indices in subset.
+    void calculateForces(vector<Particle>& particles, const Node::ForceParams& params,
+                         const vector<uint32_t>* subset = nullptr) {
+        if (params.gravitationalConstant == 0.0f) return;
+
+        const size_t numThreads = config.threads();
+        const size_t numParticles = subset ? subset->size() : particles.size();
         const size_t chunkSize = (numParticles + numThreads - 1) / numThreads; 
 
         vector<thread> threads;
 
-        auto calculateChunk = [&](size_t start, size_t end) {
-            for (size_t i = start; i < end; ++i) {
-                root->calculateForce(particles[i], root);
-            }
+        auto calculateChunk = [&](size_t worker, size_t start, size_t end) {
+            TRACE_ZONE("force worker");
+            PERF_ZONE(PerfPhase::Gravity);
+            Numa::pinWorker(static_cast<int>(worker), static_cast<int>(numThreads));
+            calculateForceRange(particles, subset, start, end, params);
         };
 
         for (size_t t = 0; t < numThreads; ++t) {
             size_t start = t * chunkSize;
             size_t end = min(start + chunkSize, numParticles); 
             if (start < end) {
-                threads.emplace_back(calculateChunk, start, end);
+                threads.emplace_back(calculateChunk, t, start, end);
             }
         }
 
@@ -0,0 +1,177 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "BarnesHut.hpp"
+#include "Config.hpp"
+#include "Particle.hpp"
+#include "Trace.hpp"
+
+/*
+Hierarchical (power of two) block timesteps, enabled with
+config.blockTimesteps.
+
+A frame of Config::dt is split into 2^maxRung substeps. A particle on rung r
+takes steps of 2^-r frames, so rung 0 particles are evaluated once per frame
+and rung maxRung particles on every substep. A substep where some step ends
+drifts every particle and walks the tree only for the particles whose step
+ends there; substeps where none does only add to the next drift. Those
+particles get a kick-drift-kick leapfrog update and pick a new rung:
+
+    h = min(1, eta * particleSize / |v|, sqrt(2 eta particleSize / |a|))
+    rung = ceil(-log2(h))
+
+eta is config.timestepAccuracy. In words, no particle should move more than
+eta particle sizes per step. A particle may always move to a finer rung,
+but only moves to a coarser one where that rung's steps line up with the
+current substep. All rungs are synchronised at the end of every frame.
+
+The tree is built at the first evaluation of a frame. Later evaluations
+refit it to the drifted positions (QuadTree::refit), until the fastest
+particle may have moved more than a particle size since the build, which
+rebuilds it.
+
+Unlike the default integrator, forces here are not accumulated across steps:
+Particle::force holds the force from the particle's last evaluation, and
+the opening kick of a frame reuses the one from the end of the last.
+Contacts leave it alone in this mode (see Solver::resolve_collision).
+*/
+struct BlockTimesteps {
+    static std::vector<uint32_t> active;
+    static bool isPrimed;               // Forces and rungs are valid for the current state
+    static uint64_t forceEvaluations;   // Tree walks since startup
+    static int frameEvaluations;        // Tree walks in the last frame
+    static float movedSinceBuild;       // Bound on how far any particle moved since the tree was built
+
+    static int period(int rung) {
+        return 1 << (config.maxRung - rung);
+    }
+
+    static int chooseRung(const Particle& particle) {
+        float speed = std::sqrt(particle.velocity.x * particle.velocity.x + particle.velocity.y * particle.velocity.y);
+        sf::Vector2f acceleration = particle.force / particle.mass * Config::dt;
+        float accelerationMagnitude = std::sqrt(acceleration.x * acceleration.x + acceleration.y * acceleration.y);
+
+        const float length = config.timestepAccuracy * Config::particleSize;
+        float step = 1.0f;
+        if (speed > 0.0f) step = std::min(step, length / speed);
+        if (accelerationMagnitude > 0.0f) step = std::min(step, std::sqrt(2.0f * length / accelerationMagnitude));
+
+        int rung = static_cast<int>(std::ceil(-std::log2(step)));
+        return std::clamp(rung, 0, config.maxRung);
+    }
+
+    // Fraction of a frame
+    static float stepOf(int rung) {
+        return 1.0f / static_cast<float>(1 << rung);
+    }
+
+    static void kick(Particle& particle, float fraction) {
+        particle.velocity += particle.force / particle.mass * (Config::dt * fraction);
+    }
+
+    // Recomputes the force on the active particles from the current positions.
+    // Without `rebuild` the tree of the last evaluation is refitted instead.
+    static void evaluate(std::vector<Particle>& particles, bool rebuild = true) {
+        TRACE_ZONE("BlockTimesteps::evaluate");
+        for (uint32_t index : active) {
+            particles[index].force = {0.0f, 0.0f};
+        }
+
+        // The block integrator always uses the full tree force.
+        Node::ForceParams params = Node::ForceParams::fromConfig();
+        params.splitRadius = 0.0f;
+
+        if (rebuild) {
+            quadTree.build();
+            movedSinceBuild = 0.0f;
+        } else {
+            quadTree.refit();
+        }
+        quadTree.calculateForces(particles, params, &active);
+
+        forceEvaluations += active.size();
+        frameEvaluations += static_cast<int>(active.size());
+    }
+
+    // Starting state: forces for everyone and a rung each.
+    static void prime(std::vector<Particle>& particles) {
+        active.resize(particles.size());
+        for (uint32_t i = 0; i < particles.size(); i++) {
+            active[i] = i;
+        }
+        evaluate(particles);
+
+        for (Particle& particle : particles) {
+            particle.rung = chooseRung(particle);
+        }
+        isPrimed = true;
+    }
+
+    // Advances every particle by one frame.
+    static void advance(std::vector<Particle>& particles) {
+        TRACE_ZONE("BlockTimesteps::advance");
+        frameEvaluations = 0;
+        if (particles.empty()) return;
+        if (!isPrimed) prime(particles);
+
+        const int substeps = 1 << config.maxRung;
+        const float drift = 1.0f / substeps;
+
+        for (Particle& particle : particles) {
+            particle.rung = std::clamp(particle.rung, 0, config.maxRung);
+            kick(particle, 0.5f * stepOf(particle.rung));
+        }
+
+        // Velocities only change at evaluations, so the drifts of the
+        // substeps in between are done in one go. Every particle is active
+        // on the last substep, so nothing is left over.
+        int pendingDrifts = 0;
+        bool isTreeBuilt = false;
+
+        for (int substep = 1; substep <= substeps; substep++) {
+            pendingDrifts++;
+
+            active.clear();
+            for (uint32_t i = 0; i < particles.size(); i++) {
+                if (substep % period(particles[i].rung) == 0) active.push_back(i);
+            }
+            if (active.empty()) continue;
+
+            const float fraction = drift * pendingDrifts;
+            float maxSpeedSquared = 0.0f;
+            for (Particle& particle : particles) {
+                particle.position += particle.velocity * fraction;
+                maxSpeedSquared = std::max(maxSpeedSquared, particle.velocity.x * particle.velocity.x + particle.velocity.y * particle.velocity.y);
+            }
+            movedSinceBuild += std::sqrt(maxSpeedSquared) * fraction;
+            pendingDrifts = 0;
+
+            evaluate(particles, !isTreeBuilt || movedSinceBuild > Config::particleSize);
+            isTreeBuilt = true;
+
+            for (uint32_t index : active) {
+                Particle& particle = particles[index];
+                kick(particle, 0.5f * stepOf(particle.rung));
+
+                int rung = chooseRung(particle);
+                while (rung < particle.rung && substep % period(rung) != 0) {
+                    rung++;
+                }
+                particle.rung = rung;
+
+                // The opening kick of the next frame happens at its start.
+                if (substep < substeps) kick(particle, 0.5f * stepOf(particle.rung));
+            }
+        }
+    }
+};
+
+std::vector<uint32_t> BlockTimesteps::active;
+bool BlockTimesteps::isPrimed = false;
+uint64_t BlockTimesteps::forceEvaluations = 0;
+int BlockTimesteps::frameEvaluations = 0;
+float BlockTimesteps::movedSinceBuild = 0.0f;
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <SFML/Graphics.hpp>
+#include <algorithm>
+#include "Config.hpp"
+
+// What the simulation thread needs to know about the camera to build the
+// level of detail draw list.
+struct CameraState {
+    sf::Vector2f center = {Config::windowWidth / 2.0f, Config::windowHeight / 2.0f};
+    float zoom = 1.0f;              // Screen pixels per world unit
+    bool levelOfDetail = true;
+    float lodPixels = 1.0f;         // Nodes smaller than this on screen are drawn as one point
+
+    sf::FloatRect visibleRect() const {
+        float width = Config::windowWidth / zoom;
+        float height = Config::windowHeight / zoom;
+        return {center.x - width / 2.0f, center.y - height / 2.0f, width, height};
+    }
+};
+
+// Zoom and pan for the interactive view. Owned by the render thread.
+struct Camera {
+    constexpr static float minZoom = 0.05f;
+    constexpr static float maxZoom = 64.0f;
+
+    static CameraState state;
+
+    static bool isPanning;
+    static sf::Vector2i panStart;
+
+    static sf::View view() {
+        return sf::View(state.center, {Config::windowWidth / state.zoom, Config::windowHeight / state.zoom});
+    }
+
+    static sf::Vector2f toWorld(sf::Vector2i pixel) {
+        sf::Vector2f fromCenter(pixel.x - Config::windowWidth / 2.0f, pixel.y - Config::windowHeight / 2.0f);
+        return state.center + fromCenter / state.zoom;
+    }
+
+    // Zooms by factor while keeping the world point under `pixel` in place.
+    static void zoomAt(sf::Vector2i pixel, float factor) {
+        sf::Vector2f anchor = toWorld(pixel);
+        state.zoom = std::clamp(state.zoom * factor, minZoom, maxZoom);
+
+        sf::Vector2f fromCenter(pixel.x - Config::windowWidth / 2.0f, pixel.y - Config::windowHeight / 2.0f);
+        state.center = anchor - fromCenter / state.zoom;
+    }
+
+    static void pan(sf::Vector2i pixelDelta) {
+        state.center -= sf::Vector2f(pixelDelta) / state.zoom;
+    }
+
+    static void reset() {
+        bool levelOfDetail = state.levelOfDetail;
+        state = CameraState();
+        state.levelOfDetail = levelOfDetail;
+    }
+};
+
+CameraState Camera::state;
+bool Camera::isPanning = false;
+sf::Vector2i Camera::panStart;
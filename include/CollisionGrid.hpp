@@ -1,27 +1,43 @@
 #pragma once
 #include "Config.hpp"
+#include <atomic>
 #include <vector>
 #include "Particle.hpp"
 #include "Solver.hpp"
 #include <thread>
+#include "Trace.hpp"
+#include "Merging.hpp"
+#include "Numa.hpp"
+#include "PerfCounters.hpp"
+#include "RigidBodies.hpp"
 
 struct CollisionGrid {
-    constexpr static int cellSize = Config::particleSize; 
-    constexpr static int nColumns = Config::windowWidth / cellSize;
-    constexpr static int nRows = Config::windowHeight / cellSize;
+    // Set from config.gridCellSize by initialize()
+    static int cellSize;
+    static int nColumns;
+    static int nRows;
 
     static std::vector<std::vector<std::vector<Particle*>>> cells;
 
     static void initialize() {
+        cellSize = std::clamp(config.gridCellSize, Config::particleSize, Config::maxGridCellSize);
+        nColumns = Config::windowWidth / cellSize;
+        nRows = Config::windowHeight / cellSize;
+
+        cells.clear();
         cells.resize(nColumns, std::vector<std::vector<Particle*>>(nRows));
     }
 
-    static void update(std::vector<Particle>& particles) {
-        assignParticlesToGrid(particles);
-        checkCollisionsInGrid();
+    static void update(std::vector<Particle>& particles, int substeps = 1, bool merge = config.mergeOnContact) {
+        for (int i = 0; i < substeps; i++) {
+            assignParticlesToGrid(particles);
+            checkCollisionsInGrid(particles, merge);
+            if (merge) Merging::apply(particles);
+        }
     }
 
     static void assignParticlesToGrid(std::vector<Particle>& particles) {
+        TRACE_ZONE("CollisionGrid::assignParticlesToGrid");
         // Clear all cells
         for (auto& col : cells) {
             for (auto& cell : col) {
@@ -29,8 +45,11 @@ struct CollisionGrid {
             }
         }
 
-        // Assign particles to their respective cells
-        for (Particle& particle : particles) {
+        // Assign particles to their respective cells. Rigid body centers
+        // stand in for gravity only.
+        for (size_t i = 0; i < particles.size(); i++) {
+            if (RigidBodies::isCenter(i)) continue;
+            Particle& particle = particles[i];
             int col = static_cast<int>(particle.position.x / cellSize);
             int row = static_cast<int>(particle.position.y / cellSize);
 
@@ -65,51 +84,125 @@ struct CollisionGrid {
         }
     }
 
-    // Threaded
-    static void checkCollisionsInGrid() {
-        const int dx[9] = {-1, -1, -1,  0, 0, 0,  1, 1, 1};
-        const int dy[9] = {-1,  0,  1, -1, 0, 1, -1, 0, 1};
+    // Threaded. In merge mode slow contacts are recorded for Merging instead
+    // of being resolved, and the neighbourhood grows with the largest merged
+    // particle.
+    static void checkCollisionsInGrid(std::vector<Particle>& particles, bool merge) {
+        TRACE_ZONE("CollisionGrid::checkCollisionsInGrid");
+        const int numThreads = std::max(1, std::min(config.threads(), nRows));
+
+        int reach = 1;
+        if (merge) {
+            Merging::prepare(numThreads, particles);
+            float contact = 2.0f * Merging::maxRadius - Solver::contactEpsilon;
+            reach = std::max(1, static_cast<int>(std::ceil(contact / cellSize)));
+        }
 
-        auto collisionCheck = [&](int rowStart, int rowEnd) {
-            for (int col = 0; col < nColumns; ++col) {
-                for (int row = rowStart; row < rowEnd; ++row) {
-                    
-                    for (Particle* particle1 : cells[col][row]) {
-                        for (int dir = 0; dir < 9; ++dir) {
-                            int adjCol = col + dx[dir];
-                            int adjRow = row + dy[dir];
-
-                            if (adjCol >= 0 && adjCol < nColumns &&
-                                adjRow >= 0 && adjRow < nRows) {
-                                for (Particle* particle2 : cells[adjCol][adjRow]) {
-                                    if (particle1 != particle2) {
-                                        Solver::resolve_collision(*particle1, *particle2);
-                                    }
-                                }
-                            }
-                        }
-                    }
-                }
-            }
+        auto collisionCheck = [&](int thread, int rowStart, int rowEnd) {
+            TRACE_ZONE("collision worker");
+            PERF_ZONE(PerfPhase::Collision);
+            Numa::pinWorker(thread, numThreads);
+            checkCollisionsInRows(particles, rowStart, rowEnd, merge, thread, reach);
         };
 
-        const int numThreads = std::thread::hardware_concurrency();; 
+        if (config.deterministic) {
+            sweepBands(reach, numThreads, [&](int thread, int rowStart, int rowEnd) {
+                checkCollisionsInRows(particles, rowStart, rowEnd, merge, thread, reach);
+            });
+            return;
+        }
+
         std::vector<std::thread> threads;
         int rowsPerThread = nRows / numThreads;
 
         for (int i = 0; i < numThreads; ++i) {
             int rowStart = i * rowsPerThread;
             int rowEnd = (i == numThreads - 1) ? nRows : (i + 1) * rowsPerThread;
-            threads.emplace_back(collisionCheck, rowStart, rowEnd);
+            threads.emplace_back(collisionCheck, i, rowStart, rowEnd);
         }
 
         for (auto& t : threads) {
             t.join();
         }
     }
+
+    // Rows per band of a deterministic sweep. A band's contacts reach `reach`
+    // rows beyond it, so two bands of at least 2 * reach rows with one band
+    // between them never touch the same particle. The count does not depend
+    // on the thread count.
+    constexpr static int sweepBandCount = 64;
+
+    static int sweepBandRows(int reach) {
+        return std::max(2 * reach, nRows / sweepBandCount);
+    }
+
+    // Conflict free sweep for deterministic runs: resolveRows(thread, rowStart,
+    // rowEnd) runs for every even band, then for every odd one. Bands of one
+    // colour are independent, so each band's result is the same whichever
+    // thread takes it and in whatever order.
+    template <typename Function>
+    static void sweepBands(int reach, int numThreads, Function resolveRows) {
+        const int rowsPerBand = sweepBandRows(reach);
+        const int bandCount = (nRows + rowsPerBand - 1) / rowsPerBand;
+
+        for (int colour = 0; colour < 2; colour++) {
+            std::atomic<int> next(colour);
+            std::vector<std::thread> threads;
+            for (int i = 0; i < numThreads; ++i) {
+                threads.emplace_back([&, i]() {
+                    TRACE_ZONE("collision worker");
+                    PERF_ZONE(PerfPhase::Collision);
+                    Numa::pinWorker(i, numThreads);
+                    for (int band = next.fetch_add(2); band < bandCount; band = next.fetch_add(2)) {
+                        resolveRows(i, band * rowsPerBand, std::min(nRows, (band + 1) * rowsPerBand));
+                    }
+                });
+            }
+
+            for (auto& t : threads) {
+                t.join();
+            }
+        }
+    }
+
+    // Resolves the contacts of the particles in rows [rowStart, rowEnd). The
+    // neighbours looked at can lie `reach` rows outside the band.
+    static void checkCollisionsInRows(std::vector<Particle>& particles, int rowStart, int rowEnd,
+                                      bool merge = false, int thread = 0, int reach = 1) {
+        const Particle* base = particles.data();
+
+        for (int col = 0; col < nColumns; ++col) {
+            for (int row = rowStart; row < rowEnd; ++row) {
+                
+                for (Particle* particle1 : cells[col][row]) {
+                    for (int adjCol = std::max(0, col - reach); adjCol <= std::min(nColumns - 1, col + reach); ++adjCol) {
+                        for (int adjRow = std::max(0, row - reach); adjRow <= std::min(nRows - 1, row + reach); ++adjRow) {
+                            for (Particle* particle2 : cells[adjCol][adjRow]) {
+                                if (particle1 == particle2) continue;
+                                if (RigidBodies::isSameBody(base, particle1, particle2)) continue;
+
+                                if (merge && Merging::shouldMerge(base, *particle1, *particle2)) {
+                                    if (particle1 < particle2) {
+                                        Merging::record(thread, static_cast<uint32_t>(particle1 - base),
+                                                        static_cast<uint32_t>(particle2 - base));
+                                    }
+                                    continue;
+                                }
+
+                                if (merge) Solver::resolve_collision(*particle1, *particle2, Solver::sumOfRadii(*particle1, *particle2));
+                                else Solver::resolve_collision(*particle1, *particle2);
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
 };
 
 std::vector<std::vector<std::vector<Particle*>>> CollisionGrid::cells;
 
-// constexpr int CollisionGrid::cellSize = Config::particleSize;
+int CollisionGrid::cellSize = Config::particleSize;
+int CollisionGrid::nColumns = 0;
+int CollisionGrid::nRows = 0;
 extern CollisionGrid collisionGrid;
\ No newline at end of file
@@ -1,6 +1,8 @@
 #pragma once 
 
+#include <algorithm>
 #include <string>
+#include <thread>
 
 struct Config {
     // Epsilon value, typically small and constant
@@ -10,10 +12,9 @@ struct Config {
     constexpr static int FPS = 60;
     constexpr static float dt = 1.0f / FPS;
 
-    // Gravity
-    // Gravity constant can be made constexpr if it remains constant throughout the program
-    constexpr static float gravitational_constant = 10.0f;
-    constexpr static float gravitationalSoftening = 1e5f;
+    // Gravity (runtime tunable, see LiveConfig)
+    float gravitational_constant = 10.0f;
+    float gravitationalSoftening = 1e5f;
 
     // Collision settings
     constexpr static float COLLISION_DAMPENING = 0.25f;
@@ -26,7 +27,67 @@ struct Config {
     constexpr static int particleSize = 2;
 
     // Barnes Hut
-    constexpr static float theta = 0.3f; // gravity approximation threshold
+    float theta = 0.3f; // gravity approximation threshold
+    int multipoleOrder = 0; // 0 = monopole, 2 = add quadrupole moments to far nodes
+
+    // Gravity solver (see ParticleMesh)
+    enum class GravitySolver { Tree, ParticleMesh, TreePM };
+    GravitySolver gravitySolver = GravitySolver::Tree;
+    int meshSize = 256;     // Mesh cells per side, power of two
+
+    // Worker threads per parallel phase, 0 = one per hardware thread
+    int threadCount = 0;
+    constexpr static int maxThreads = 256;
+
+    // Collision grid cell size, at least particleSize. Cells larger than half
+    // the window would leave the grid with fewer than two rows.
+    int gridCellSize = particleSize;
+    constexpr static int maxGridCellSize = windowHeight / 2;
+
+    // Collision passes per step
+    int collisionSubsteps = 1;
+
+    // Particles moving more than this many particle radii per step get a
+    // swept test so they cannot pass through others, 0 = off (see
+    // SweptCollisions)
+    float sweptThreshold = 0.5f;
+
+    // Reuse per particle contact candidates while nothing has moved more
+    // than half the skin (see NeighbourList)
+    bool neighbourLists = false;
+    float neighbourSkin = 1.0f;
+
+    // Run gravity, collisions and integration as one task graph so the
+    // phases overlap (see Simulation::updateOverlapped)
+    bool taskGraph = true;
+
+    // Steps between in-situ analysis runs, when analyzers are set up
+    // (see Analysis)
+    int analysisInterval = 60;
+
+    // Bit-identical results for any thread count: ordered tree builds,
+    // two-colour collision sweeps and fixed-order mesh sums, and no frame
+    // governor (see Simulation::verifyDeterminism)
+    bool deterministic = false;
+
+    // Block timesteps (see BlockTimesteps)
+    bool blockTimesteps = false;
+    int maxRung = 6;                // Finest step is dt / 2^maxRung
+    float timestepAccuracy = 0.5f;  // Particle sizes moved per step at most
+
+    // Accretion (see Merging): contacts slower than mergeVelocity combine
+    bool mergeOnContact = false;
+    float mergeVelocity = 0.5f;
+
+    // Frame pacing (see FixedStep and FrameGovernor)
+    float timeScale = 1.0f;         // Simulated seconds per real second
+    int maxStepsPerFrame = 4;       // Steps taken at most to catch up before time is dropped
+    float frameBudgetMs = 0.0f;     // Target frame time for the governor, 0 = off
+
+    int threads() const {
+        if (threadCount > 0) return std::min(threadCount, maxThreads);
+        return static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+    }
 };
 
 extern Config config;
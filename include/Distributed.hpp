@@ -0,0 +1,478 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <numeric>
+#include <stdexcept>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "BarnesHut.hpp"
+#include "CollisionGrid.hpp"
+#include "Config.hpp"
+#include "LiveConfig.hpp"
+#include "Particle.hpp"
+#include "PerfCounters.hpp"
+#include "Simulation.hpp"
+#include "Snapshot.hpp"
+#include "Trace.hpp"
+#include "TrajectoryWriter.hpp"
+#include "Transport.hpp"
+
+/*
+Runs one simulation as several cooperating processes (--ranks, headless).
+
+The window is split by orthogonal recursive bisection into one rectangle
+per rank, cut along the longer side so both halves carry equal work. Each
+rank owns the particles inside its rectangle. A step is:
+
+    1. Build the local tree and send every other rank its locally essential
+       tree: the local tree walked against the receiver's rectangle, cut off
+       at nodes that are already small enough (size < theta * distance to
+       the rectangle) to be used as one body anywhere in it. The received
+       nodes are inserted as massive pseudo-particles and the forces on the
+       local particles are computed from the combined tree.
+    2. Exchange the particles within collision range of each boundary and
+       resolve collisions with them as ghosts.
+    3. Integrate, then send particles that left the rectangle to their new
+       owner.
+
+Every rebalanceInterval steps the ranks share their force times and a
+sample of positions. When the slowest rank is more than rebalanceThreshold
+above the mean, every rank recomputes the same bisection, weighting each
+sample by its rank's time per particle, and particles migrate.
+
+Checkpoints, trajectories and rendered frames are written by rank 0 from
+the particles gathered from all ranks.
+*/
+struct Distributed {
+    constexpr static int sampleCount = 4096;    // Positions per rank used for bisection
+    constexpr static int rebalanceInterval = 50;
+    constexpr static float rebalanceThreshold = 1.1f;
+
+    static std::unique_ptr<Transport> transport;
+    static std::vector<pid_t> children;
+    static std::vector<sf::FloatRect> domains;  // Indexed by rank
+
+    static std::vector<uint32_t> localIndices;
+    static int64_t forceTimeUs;                 // Since the last rebalance check
+
+    // Serialized pseudo-particle
+    struct Body {
+        float x, y, mass;
+    };
+
+    struct Sample {
+        float x, y, weight;
+    };
+
+    static bool isActive() {
+        return transport != nullptr;
+    }
+
+    static int rank() {
+        return transport ? transport->rank() : 0;
+    }
+
+    static int size() {
+        return transport ? transport->size() : 1;
+    }
+
+    template <typename T>
+    static void append(std::vector<char>& bytes, const T* values, size_t count) {
+        const char* data = reinterpret_cast<const char*>(values);
+        bytes.insert(bytes.end(), data, data + count * sizeof(T));
+    }
+
+    template <typename T>
+    static std::vector<T> unpack(const std::vector<char>& bytes, size_t offset = 0) {
+        std::vector<T> values((bytes.size() - offset) / sizeof(T));
+        if (!values.empty()) std::memcpy(values.data(), bytes.data() + offset, values.size() * sizeof(T));
+        return values;
+    }
+
+    // Forks ranks - 1 children connected by socketpairs. Returns in every
+    // process with its transport set up.
+    static void launch(int ranks) {
+        if (ranks <= 1) return;
+
+        std::vector<std::vector<int>> sockets(ranks, std::vector<int>(ranks, -1));
+        for (int a = 0; a < ranks; a++) {
+            for (int b = a + 1; b < ranks; b++) {
+                int pair[2];
+                if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0) {
+                    throw std::runtime_error("Could not create sockets for the distributed run");
+                }
+                sockets[a][b] = pair[0];
+                sockets[b][a] = pair[1];
+            }
+        }
+
+        int ownRank = 0;
+        for (int r = 1; r < ranks; r++) {
+            pid_t pid = fork();
+            if (pid < 0) throw std::runtime_error("Could not fork rank " + std::to_string(r));
+            if (pid == 0) {
+                ownRank = r;
+                children.clear();
+                break;
+            }
+            children.push_back(pid);
+        }
+
+        // Keep only this rank's ends.
+        for (int a = 0; a < ranks; a++) {
+            for (int b = 0; b < ranks; b++) {
+                if (a != ownRank && sockets[a][b] >= 0) ::close(sockets[a][b]);
+            }
+        }
+        transport = std::make_unique<SocketTransport>(ownRank, sockets[ownRank]);
+
+        // Share the machine between the ranks unless told otherwise.
+        if (config.threadCount == 0) {
+            config.threadCount = std::max(1, static_cast<int>(std::thread::hardware_concurrency()) / ranks);
+        }
+        if (ownRank != 0) {
+            Trace::outputPath += ".rank" + std::to_string(ownRank);
+            if (!PerfCounters::outputPath.empty()) PerfCounters::outputPath += ".rank" + std::to_string(ownRank);
+        }
+    }
+
+    // Waits for the other ranks to exit (rank 0 only).
+    static void finish() {
+        transport.reset();
+        for (pid_t child : children) {
+            int status = 0;
+            waitpid(child, &status, 0);
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                std::cerr << "Rank process " << child << " failed" << std::endl;
+            }
+        }
+        children.clear();
+    }
+
+    static int owner(sf::Vector2f position) {
+        for (int r = 0; r < static_cast<int>(domains.size()); r++) {
+            const sf::FloatRect& domain = domains[r];
+            bool lastColumn = domain.left + domain.width >= Config::windowWidth;
+            bool lastRow = domain.top + domain.height >= Config::windowHeight;
+
+            if (position.x >= domain.left && (position.x < domain.left + domain.width || lastColumn) &&
+                position.y >= domain.top && (position.y < domain.top + domain.height || lastRow)) {
+                return r;
+            }
+        }
+        return 0;
+    }
+
+    // Splits rect between `count` ranks starting at firstRank so that each
+    // gets an equal share of the sample weight.
+    static void bisect(std::vector<Sample>& samples, size_t begin, size_t end, sf::FloatRect rect,
+                       int firstRank, int count) {
+        if (count == 1) {
+            domains[firstRank] = rect;
+            return;
+        }
+
+        const int leftRanks = count / 2;
+        const bool alongX = rect.width >= rect.height;
+        auto coordinate = [alongX](const Sample& sample) { return alongX ? sample.x : sample.y; };
+
+        std::sort(samples.begin() + begin, samples.begin() + end, [&](const Sample& a, const Sample& b) {
+            return coordinate(a) < coordinate(b);
+        });
+
+        double total = 0.0;
+        for (size_t i = begin; i < end; i++) total += samples[i].weight;
+        const double target = total * leftRanks / count;
+
+        const float low = alongX ? rect.left : rect.top;
+        const float high = low + (alongX ? rect.width : rect.height);
+        float cut = low + (high - low) * leftRanks / count;
+        size_t middle = begin;
+
+        if (total > 0.0) {
+            double sum = 0.0;
+            while (middle < end && sum + samples[middle].weight <= target) {
+                sum += samples[middle].weight;
+                middle++;
+            }
+            if (middle > begin && middle < end) {
+                cut = 0.5f * (coordinate(samples[middle - 1]) + coordinate(samples[middle]));
+            } else if (middle < end) {
+                cut = coordinate(samples[middle]);
+            }
+        }
+        cut = std::clamp(cut, low, high);
+
+        // Samples exactly on the cut belong to the right side.
+        middle = std::partition_point(samples.begin() + begin, samples.begin() + end,
+                                      [&](const Sample& sample) { return coordinate(sample) < cut; }) - samples.begin();
+
+        sf::FloatRect left = rect;
+        sf::FloatRect right = rect;
+        if (alongX) {
+            left.width = cut - rect.left;
+            right.left = cut;
+            right.width = rect.left + rect.width - cut;
+        } else {
+            left.height = cut - rect.top;
+            right.top = cut;
+            right.height = rect.top + rect.height - cut;
+        }
+
+        bisect(samples, begin, middle, left, firstRank, leftRanks);
+        bisect(samples, middle, end, right, firstRank + leftRanks, count - leftRanks);
+    }
+
+    static void decompose(std::vector<Sample> samples) {
+        domains.assign(size(), sf::FloatRect());
+        sf::FloatRect window(0.0f, 0.0f, static_cast<float>(Config::windowWidth), static_cast<float>(Config::windowHeight));
+        bisect(samples, 0, samples.size(), window, 0, size());
+    }
+
+    // Every rank holds the same initial conditions; keep only our share.
+    static void partition() {
+        if (!isActive()) return;
+
+        std::vector<Particle>& particles = Particle::particles;
+        const size_t stride = std::max<size_t>(1, particles.size() / (sampleCount * size()));
+        std::vector<Sample> samples;
+        for (size_t i = 0; i < particles.size(); i += stride) {
+            samples.push_back({particles[i].position.x, particles[i].position.y, 1.0f});
+        }
+        decompose(samples);
+
+        const int ownRank = rank();
+        particles.erase(std::remove_if(particles.begin(), particles.end(),
+                                       [&](const Particle& particle) { return owner(particle.position) != ownRank; }),
+                        particles.end());
+    }
+
+    static float distanceToRect(const Node* node, const sf::FloatRect& rect) {
+        float dx = std::max({rect.left - (node->position.x + node->size), 0.0f, node->position.x - (rect.left + rect.width)});
+        float dy = std::max({rect.top - (node->position.y + node->size), 0.0f, node->position.y - (rect.top + rect.height)});
+        return std::sqrt(dx * dx + dy * dy);
+    }
+
+    static void exportEssential(const Node* node, const sf::FloatRect& rect, float theta, std::vector<Body>& bodies) {
+        if (!node || node->totalMass <= 0.0f) return;
+
+        if (node->isLeaf || node->size < theta * distanceToRect(node, rect)) {
+            bodies.push_back({node->centerOfMass.x, node->centerOfMass.y, node->totalMass});
+            return;
+        }
+
+        for (const Node* child : node->children) {
+            exportEssential(child, rect, theta, bodies);
+        }
+    }
+
+    static std::vector<std::vector<char>> exchangeEssentialTrees() {
+        TRACE_ZONE("Distributed::exchangeEssentialTrees");
+        std::vector<std::vector<char>> outgoing(size());
+        const float theta = FrameGovernor::theta();
+
+        for (int peer = 0; peer < size(); peer++) {
+            if (peer == rank()) continue;
+            std::vector<Body> bodies;
+            exportEssential(quadTree.root, domains[peer], theta, bodies);
+            append(outgoing[peer], bodies.data(), bodies.size());
+        }
+
+        return transport->allToAll(outgoing);
+    }
+
+    static std::vector<std::vector<char>> exchangeBoundary() {
+        TRACE_ZONE("Distributed::exchangeBoundary");
+        const float margin = 2.0f * CollisionGrid::cellSize + 2.0f * Config::particleSize;
+        std::vector<std::vector<char>> outgoing(size());
+
+        for (int peer = 0; peer < size(); peer++) {
+            if (peer == rank()) continue;
+            sf::FloatRect reach = domains[peer];
+            reach.left -= margin;
+            reach.top -= margin;
+            reach.width += 2.0f * margin;
+            reach.height += 2.0f * margin;
+
+            for (const Particle& particle : Particle::particles) {
+                if (reach.contains(particle.position)) append(outgoing[peer], &particle, 1);
+            }
+        }
+
+        return transport->allToAll(outgoing);
+    }
+
+    static void migrate() {
+        TRACE_ZONE("Distributed::migrate");
+        std::vector<Particle>& particles = Particle::particles;
+        std::vector<std::vector<char>> outgoing(size());
+        const int ownRank = rank();
+
+        size_t kept = 0;
+        for (size_t i = 0; i < particles.size(); i++) {
+            int destination = owner(particles[i].position);
+            if (destination == ownRank) {
+                particles[kept++] = particles[i];
+            } else {
+                append(outgoing[destination], &particles[i], 1);
+            }
+        }
+        particles.resize(kept);
+
+        std::vector<std::vector<char>> incoming = transport->allToAll(outgoing);
+        for (int peer = 0; peer < size(); peer++) {
+            if (peer == ownRank) continue;
+            std::vector<Particle> arrived = unpack<Particle>(incoming[peer]);
+            particles.insert(particles.end(), arrived.begin(), arrived.end());
+        }
+    }
+
+    static void rebalance() {
+        TRACE_ZONE("Distributed::rebalance");
+        const std::vector<Particle>& particles = Particle::particles;
+
+        // Header: force time and particle count, then the samples.
+        std::vector<char> message;
+        int64_t header[2] = {forceTimeUs, static_cast<int64_t>(particles.size())};
+        append(message, header, 2);
+        const size_t stride = std::max<size_t>(1, particles.size() / sampleCount);
+        for (size_t i = 0; i < particles.size(); i += stride) {
+            Sample sample = {particles[i].position.x, particles[i].position.y, static_cast<float>(stride)};
+            append(message, &sample, 1);
+        }
+        forceTimeUs = 0;
+
+        std::vector<std::vector<char>> reports = transport->allGather(message);
+
+        double slowest = 0.0;
+        double mean = 0.0;
+        for (const auto& report : reports) {
+            int64_t time = unpack<int64_t>(report)[0];
+            slowest = std::max(slowest, static_cast<double>(time));
+            mean += static_cast<double>(time) / size();
+        }
+        if (mean <= 0.0 || slowest / mean < rebalanceThreshold) return;
+
+        // Weight each sample by its rank's force time per particle.
+        std::vector<Sample> samples;
+        for (const auto& report : reports) {
+            std::vector<int64_t> reportHeader = unpack<int64_t>(std::vector<char>(report.begin(), report.begin() + 2 * sizeof(int64_t)));
+            float perParticle = reportHeader[1] > 0 ? static_cast<float>(reportHeader[0]) / reportHeader[1] : 0.0f;
+
+            for (Sample sample : unpack<Sample>(report, 2 * sizeof(int64_t))) {
+                sample.weight *= perParticle;
+                samples.push_back(sample);
+            }
+        }
+
+        decompose(samples);
+        migrate();
+
+        if (rank() == 0) {
+            std::cout << "Rebalanced " << size() << " ranks at step " << Simulation::step
+                      << ", imbalance was " << slowest / mean << std::endl;
+        }
+    }
+
+    // Collects every rank's particles on rank 0 and calls write() there
+    // with them in place of Particle::particles.
+    template <typename Function>
+    static void withGathered(Function write) {
+        TRACE_ZONE("Distributed::gather");
+        std::vector<std::vector<char>> outgoing(size());
+        if (rank() != 0) append(outgoing[0], Particle::particles.data(), Particle::particles.size());
+
+        std::vector<std::vector<char>> incoming = transport->allToAll(outgoing);
+        if (rank() != 0) return;
+
+        std::vector<Particle> local;
+        local.swap(Particle::particles);
+        Particle::particles = local;
+        for (int peer = 1; peer < size(); peer++) {
+            std::vector<Particle> remote = unpack<Particle>(incoming[peer]);
+            Particle::particles.insert(Particle::particles.end(), remote.begin(), remote.end());
+        }
+
+        write();
+        Particle::particles.swap(local);
+    }
+
+    // One simulation step across all ranks. Mirrors Simulation::update with
+    // the tree solver and the default integrator.
+    static void step(float dt) {
+        TRACE_ZONE("Distributed::step");
+        LiveConfig::poll();
+        std::vector<Particle>& particles = Particle::particles;
+        const size_t localCount = particles.size();
+
+        // Gravity: local tree, then local + essential trees of the others.
+        Simulation::gravityTimer.restart();
+        quadTree.build();
+        std::vector<std::vector<char>> essential = exchangeEssentialTrees();
+        for (int peer = 0; peer < size(); peer++) {
+            if (peer == rank()) continue;
+            for (const Body& body : unpack<Body>(essential[peer])) {
+                Particle pseudo;
+                pseudo.position = {body.x, body.y};
+                pseudo.mass = body.mass;
+                particles.push_back(pseudo);
+            }
+        }
+
+        localIndices.resize(localCount);
+        std::iota(localIndices.begin(), localIndices.end(), 0u);
+        Node::ForceParams params = Node::ForceParams::fromConfig();
+        params.splitRadius = 0.0f;
+
+        quadTree.build();
+        quadTree.calculateForces(particles, params, &localIndices);
+        particles.resize(localCount);
+        forceTimeUs += Simulation::gravityTimer.getElapsedTime().asMicroseconds();
+
+        // Collisions, with the neighbours' boundary particles as ghosts.
+        std::vector<std::vector<char>> boundary = exchangeBoundary();
+        for (int peer = 0; peer < size(); peer++) {
+            if (peer == rank()) continue;
+            std::vector<Particle> ghosts = unpack<Particle>(boundary[peer]);
+            particles.insert(particles.end(), ghosts.begin(), ghosts.end());
+        }
+        // Merging would reorder the particles and could absorb ghosts, so it
+        // is off in distributed runs.
+        CollisionGrid::update(particles, FrameGovernor::collisionSubsteps(), false);
+        particles.resize(localCount);
+
+        {
+            PERF_ZONE(PerfPhase::Integration);
+            Particle::updateAll(dt);
+        }
+        Simulation::step++;
+        PerfCounters::endFrame(Simulation::step);
+        migrate();
+        if (Simulation::step % rebalanceInterval == 0) rebalance();
+
+        const uint64_t step = Simulation::step;
+        bool checkpointDue = Snapshot::checkpointInterval > 0 && step % Snapshot::checkpointInterval == 0;
+        bool trajectoryDue = TrajectoryWriter::interval > 0 && !TrajectoryWriter::directory.empty() &&
+                             step % TrajectoryWriter::interval == 0;
+        if (checkpointDue || trajectoryDue) {
+            withGathered([step]() {
+                Snapshot::checkpoint(step);
+                TrajectoryWriter::capture(step);
+            });
+        }
+    }
+};
+
+std::unique_ptr<Transport> Distributed::transport;
+std::vector<pid_t> Distributed::children;
+std::vector<sf::FloatRect> Distributed::domains;
+
+std::vector<uint32_t> Distributed::localIndices;
+int64_t Distributed::forceTimeUs = 0;
@@ -0,0 +1,277 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <new>
+#include <numeric>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "BarnesHut.hpp"
+#include "CollisionGrid.hpp"
+#include "Config.hpp"
+#include "LiveConfig.hpp"
+#include "Particle.hpp"
+#include "Scenarios.hpp"
+#include "Simulation.hpp"
+#include "Snapshot.hpp"
+
+/*
+Runs many small, independent simulations side by side (--ensemble).
+
+A jobs file has one simulation per line: a scenario spec as for --scenario
+followed by settings, with the liveconfig.json keys plus "steps".
+
+    # parameter study
+    disc:5000:1 steps=600 theta=0.5
+    disc:5000:2 steps=600 theta=0.7 multipoleOrder=2
+    gas:5000:1 steps=600 gravitational_constant=0
+
+Small scenes cannot keep many cores busy from inside one step, so the
+ensemble runs each simulation on a single thread and many of them at once.
+The engine's state is static, so the workers are forked processes rather
+than threads. They share a job counter and each takes the next job when it
+finishes one, largest jobs (particles x steps) first. Settings not given on
+a job's line come from the command line.
+
+Every finished job appends one JSON line to <dir>/results.jsonl and writes
+its final state to <dir>/job_<n>.snap. At the end the aggregate throughput
+in particle-steps per second is printed.
+*/
+struct Ensemble {
+    struct Job {
+        int index = 0;
+        std::string scenario;
+        uint64_t steps = 0;
+        std::map<std::string, double> settings;
+        double cost = 0.0;      // Particles x steps
+    };
+
+    // Lives in memory shared by all workers.
+    struct Shared {
+        std::atomic<uint32_t> nextJob;
+        std::atomic<uint64_t> particleSteps;
+        std::atomic<uint32_t> failedJobs;
+    };
+
+    static std::vector<Job> parse(const std::string& path, uint64_t defaultSteps) {
+        std::ifstream file(path);
+        if (!file) throw std::runtime_error("Could not open jobs file " + path);
+
+        std::vector<Job> jobs;
+        std::string line;
+        int lineNumber = 0;
+        while (std::getline(file, line)) {
+            lineNumber++;
+            line = line.substr(0, line.find('#'));
+
+            std::istringstream words(line);
+            Job job;
+            if (!(words >> job.scenario)) continue;
+            job.index = static_cast<int>(jobs.size());
+            job.steps = defaultSteps;
+
+            std::string word;
+            while (words >> word) {
+                size_t equals = word.find('=');
+                if (equals == std::string::npos) {
+                    throw std::runtime_error(path + ":" + std::to_string(lineNumber) + ": expected key=value, got " + word);
+                }
+                std::string key = word.substr(0, equals);
+                double value = parseNumber(word.substr(equals + 1), path, lineNumber);
+                if (key == "steps") job.steps = value > 0.0 ? static_cast<uint64_t>(value) : 0;
+                else job.settings[key] = value;
+            }
+
+            size_t nameEnd = job.scenario.find(':');
+            size_t countEnd = job.scenario.find(':', nameEnd + 1);
+            double count = nameEnd == std::string::npos ? 1000.0 :
+                parseNumber(job.scenario.substr(nameEnd + 1, countEnd - nameEnd - 1), path, lineNumber);
+            job.cost = count * static_cast<double>(job.steps);
+            jobs.push_back(job);
+        }
+        return jobs;
+    }
+
+    // The whole of `text` as a number, or a runtime_error naming the line.
+    static double parseNumber(const std::string& text, const std::string& path, int lineNumber) {
+        size_t used = 0;
+        double value = 0.0;
+        try {
+            value = std::stod(text, &used);
+        } catch (const std::exception&) {
+            used = 0;
+        }
+        if (used == 0 || used != text.size()) {
+            throw std::runtime_error(path + ":" + std::to_string(lineNumber) + ": bad value " + text);
+        }
+        return value;
+    }
+
+    // Runs one job in this process and returns its particle-steps.
+    static uint64_t runJob(const Job& job, const Config& baseConfig, const std::string& outputDirectory, int resultsFile) {
+        config = baseConfig;
+        config.threadCount = 1;
+        LiveConfig::apply(job.settings, "job " + std::to_string(job.index));
+        if (CollisionGrid::cellSize != config.gridCellSize) CollisionGrid::initialize();
+
+        Particle::particles.clear();
+        RigidBodies::clear();
+        Simulation::step = 0;
+        BlockTimesteps::isPrimed = false;
+        Scenarios::generateFromSpec(job.scenario);
+        const size_t initialCount = Particle::particles.size() + RigidBodies::memberCount();
+
+        auto start = std::chrono::steady_clock::now();
+        uint64_t particleSteps = 0;
+        for (uint64_t i = 0; i < job.steps; i++) {
+            particleSteps += Particle::particles.size() + RigidBodies::memberCount();
+            Simulation::update(config.dt);
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        char name[32];
+        std::snprintf(name, sizeof(name), "job_%04d.snap", job.index);
+        std::string snapshotPath = outputDirectory + "/" + name;
+        const size_t finalCount = Particle::particles.size() + RigidBodies::memberCount();
+        RigidBodies::withMembers([&snapshotPath]() { Snapshot::saveAsync(snapshotPath, Simulation::step); });
+        Snapshot::wait();
+
+        char timing[96];
+        std::snprintf(timing, sizeof(timing), "\"seconds\":%.3f,\"particleStepsPerSecond\":%.0f",
+                      seconds, seconds > 0.0 ? particleSteps / seconds : 0.0);
+        writeLine(resultsFile, "{\"job\":" + std::to_string(job.index) + ",\"scenario\":" + jsonString(job.scenario) +
+                                   ",\"steps\":" + std::to_string(job.steps) +
+                                   ",\"particles\":" + std::to_string(initialCount) +
+                                   ",\"finalParticles\":" + std::to_string(finalCount) + "," + timing +
+                                   ",\"snapshot\":" + jsonString(name) + "}\n");
+        return particleSteps;
+    }
+
+    // Quoted and escaped for JSON.
+    static std::string jsonString(const std::string& text) {
+        std::string quoted = "\"";
+        for (char c : text) {
+            if (c == '"' || c == '\\') {
+                quoted += '\\';
+                quoted += c;
+            } else if (static_cast<unsigned char>(c) < 0x20) {
+                char escape[8];
+                std::snprintf(escape, sizeof(escape), "\\u%04x", c);
+                quoted += escape;
+            } else {
+                quoted += c;
+            }
+        }
+        return quoted + "\"";
+    }
+
+    // One write() per line, so lines from different workers never interleave.
+    static void writeLine(int fd, const std::string& line) {
+        if (::write(fd, line.data(), line.size()) != static_cast<ssize_t>(line.size())) {
+            std::cerr << "Could not write an ensemble result" << std::endl;
+        }
+    }
+
+    static void workerLoop(const std::vector<Job>& jobs, const std::vector<int>& order, Shared& shared,
+                           const Config& baseConfig, const std::string& outputDirectory, int resultsFile) {
+        Node::initializeNodePool(10000);
+        CollisionGrid::initialize();
+
+        for (;;) {
+            uint32_t next = shared.nextJob.fetch_add(1);
+            if (next >= order.size()) break;
+            const Job& job = jobs[order[next]];
+
+            try {
+                shared.particleSteps += runJob(job, baseConfig, outputDirectory, resultsFile);
+            } catch (const std::exception& error) {
+                shared.failedJobs++;
+                std::cerr << "Job " << job.index << " (" << job.scenario << ") failed: " << error.what() << std::endl;
+
+                writeLine(resultsFile, "{\"job\":" + std::to_string(job.index) + ",\"scenario\":" + jsonString(job.scenario) +
+                                           ",\"error\":" + jsonString(error.what()) + "}\n");
+            }
+        }
+    }
+
+    // Runs every job in `jobsPath` on `workers` processes (0 = one per
+    // hardware thread). Returns the process exit code.
+    static int run(const std::string& jobsPath, const std::string& outputDirectory, int workers, uint64_t defaultSteps) {
+        std::vector<Job> jobs = parse(jobsPath, defaultSteps);
+        if (jobs.empty()) {
+            std::cerr << jobsPath << " has no jobs" << std::endl;
+            return 1;
+        }
+
+        std::vector<int> order(jobs.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return jobs[a].cost > jobs[b].cost; });
+
+        if (workers <= 0) workers = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+        workers = std::min(workers, static_cast<int>(jobs.size()));
+
+        std::filesystem::create_directories(outputDirectory);
+        std::string resultsPath = outputDirectory + "/results.jsonl";
+        int resultsFile = ::open(resultsPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+        if (resultsFile < 0) throw std::runtime_error("Could not open " + resultsPath);
+
+        void* memory = mmap(nullptr, sizeof(Shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) throw std::runtime_error("Could not map the ensemble job counter");
+        Shared& shared = *new (memory) Shared{{0}, {0}, {0}};
+
+        // Settings from the command line are every job's starting point.
+        const Config baseConfig = config;
+        LiveConfig::pollInterval = 0;
+        Snapshot::checkpointInterval = 0;
+
+        std::cout << "Ensemble: " << jobs.size() << " jobs on " << workers << " workers" << std::endl;
+        auto start = std::chrono::steady_clock::now();
+
+        std::vector<pid_t> children;
+        for (int w = 0; w < workers; w++) {
+            pid_t pid = fork();
+            if (pid < 0) throw std::runtime_error("Could not fork ensemble worker " + std::to_string(w));
+            if (pid == 0) {
+                workerLoop(jobs, order, shared, baseConfig, outputDirectory, resultsFile);
+                std::exit(0);
+            }
+            children.push_back(pid);
+        }
+
+        int failedWorkers = 0;
+        for (pid_t child : children) {
+            int status = 0;
+            waitpid(child, &status, 0);
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) failedWorkers++;
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        ::close(resultsFile);
+
+        uint64_t particleSteps = shared.particleSteps.load();
+        uint32_t failedJobs = shared.failedJobs.load();
+        munmap(memory, sizeof(Shared));
+
+        std::printf("Ensemble: %zu jobs, %llu particle-steps in %.2f s = %.3g particle-steps/s, results in %s\n",
+                    jobs.size(), static_cast<unsigned long long>(particleSteps), seconds,
+                    seconds > 0.0 ? particleSteps / seconds : 0.0, resultsPath.c_str());
+        if (failedJobs > 0) std::cerr << failedJobs << " jobs failed" << std::endl;
+        if (failedWorkers > 0) std::cerr << failedWorkers << " workers exited abnormally" << std::endl;
+        return failedJobs == 0 && failedWorkers == 0 ? 0 : 1;
+    }
+};
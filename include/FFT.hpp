@@ -0,0 +1,110 @@
+#pragma once
+
+#include <cmath>
+#include <complex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "PerfCounters.hpp"
+#include "Trace.hpp"
+
+/*
+Iterative radix-2 complex FFT for square power of two grids.
+
+Twiddle factors and the bit reversal permutation are computed once per size.
+A 2D transform runs the 1D transform over every row and then every column,
+with the rows (columns) split between threads.
+*/
+struct FFT {
+    using Complex = std::complex<float>;
+
+    int size = 0;
+    int log2Size = 0;
+    std::vector<Complex> twiddles;      // e^(-2 pi i k / size) for k < size / 2
+    std::vector<int> reversed;
+
+    FFT() = default;
+
+    explicit FFT(int size) : size(size) {
+        if (size < 2 || (size & (size - 1)) != 0) {
+            throw std::invalid_argument("FFT size must be a power of two");
+        }
+
+        while ((1 << log2Size) < size) log2Size++;
+
+        twiddles.resize(size / 2);
+        for (int k = 0; k < size / 2; k++) {
+            double angle = -2.0 * M_PI * k / size;
+            twiddles[k] = Complex(static_cast<float>(std::cos(angle)), static_cast<float>(std::sin(angle)));
+        }
+
+        reversed.resize(size);
+        for (int i = 0; i < size; i++) {
+            int r = 0;
+            for (int bit = 0; bit < log2Size; bit++) {
+                if (i & (1 << bit)) r |= 1 << (log2Size - 1 - bit);
+            }
+            reversed[i] = r;
+        }
+    }
+
+    // In place transform of `size` contiguous values. The inverse is not
+    // normalized.
+    void transform(Complex* data, bool inverse) const {
+        for (int i = 0; i < size; i++) {
+            if (i < reversed[i]) std::swap(data[i], data[reversed[i]]);
+        }
+
+        for (int length = 2; length <= size; length <<= 1) {
+            const int half = length / 2;
+            const int step = size / length;
+
+            for (int start = 0; start < size; start += length) {
+                for (int k = 0; k < half; k++) {
+                    Complex w = twiddles[k * step];
+                    if (inverse) w = std::conj(w);
+
+                    Complex even = data[start + k];
+                    Complex odd = data[start + k + half] * w;
+                    data[start + k] = even + odd;
+                    data[start + k + half] = even - odd;
+                }
+            }
+        }
+    }
+
+    // In place 2D transform of a size x size row major grid.
+    void transform2D(std::vector<Complex>& grid, bool inverse, int numThreads) const {
+        TRACE_ZONE("FFT::transform2D");
+        numThreads = std::max(1, std::min(numThreads, size));
+
+        auto runParallel = [&](auto function) {
+            std::vector<std::thread> threads;
+            for (int t = 0; t < numThreads; t++) {
+                threads.emplace_back([&, t]() {
+                    TRACE_ZONE("fft worker");
+                    PERF_ZONE(PerfPhase::Gravity);
+                    for (int line = t; line < size; line += numThreads) {
+                        function(line);
+                    }
+                });
+            }
+            for (auto& thread : threads) {
+                thread.join();
+            }
+        };
+
+        runParallel([&](int row) {
+            transform(grid.data() + static_cast<size_t>(row) * size, inverse);
+        });
+
+        runParallel([&](int column) {
+            thread_local std::vector<Complex> line;
+            line.resize(size);
+            for (int row = 0; row < size; row++) line[row] = grid[static_cast<size_t>(row) * size + column];
+            transform(line.data(), inverse);
+            for (int row = 0; row < size; row++) grid[static_cast<size_t>(row) * size + column] = line[row];
+        });
+    }
+};
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+
+#include "Config.hpp"
+
+/*
+Fixed timestep accumulator. Real time elapsed since the last call, scaled by
+config.timeScale, is added to an accumulator and whole steps of Config::dt
+are taken out of it, so simulated time follows the wall clock regardless of
+how often the caller runs and can be sped up or slowed down.
+
+At most config.maxStepsPerFrame steps are handed out per call. Anything
+beyond that is dropped: when the machine cannot keep up the simulation runs
+slower than real time instead of falling further and further behind.
+*/
+struct FixedStep {
+    using clock = std::chrono::steady_clock;
+
+    static double accumulator;      // Simulated seconds not yet stepped
+    static clock::time_point last;
+    static bool isStarted;
+
+    static void reset() {
+        accumulator = 0.0;
+        last = clock::now();
+        isStarted = true;
+    }
+
+    // Number of steps to take now.
+    static int due() {
+        clock::time_point now = clock::now();
+        if (!isStarted) {
+            last = now;
+            isStarted = true;
+        }
+
+        accumulator += std::chrono::duration<double>(now - last).count() * config.timeScale;
+        last = now;
+
+        int steps = static_cast<int>(accumulator / Config::dt);
+        const int maxSteps = std::max(1, config.maxStepsPerFrame);
+        if (steps > maxSteps) {
+            steps = maxSteps;
+            accumulator = 0.0;
+        } else {
+            accumulator -= steps * Config::dt;
+        }
+
+        return steps;
+    }
+
+    // Time until the next step is due.
+    static clock::duration untilNextStep() {
+        double remaining = (Config::dt - accumulator) / std::max(config.timeScale, 1e-3f);
+        return std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(std::max(remaining, 0.0)));
+    }
+};
+
+double FixedStep::accumulator = 0.0;
+FixedStep::clock::time_point FixedStep::last;
+bool FixedStep::isStarted = false;
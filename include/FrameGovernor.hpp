@@ -0,0 +1,143 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+
+#include "Config.hpp"
+
+/*
+Holds a frame budget (config.frameBudgetMs, 0 = off) by trading accuracy for
+speed. After every batch of steps the simulation thread reports what the
+phases cost; the estimated frame time is compared with the budget and, once
+per cooldown period, one knob is moved:
+
+    over budget             degrade the phase that costs the most
+                                gravity   -> raise the opening angle theta
+                                collision -> fewer collision substeps
+                                rendering -> coarser level of detail
+    under 70% of budget     restore one knob, theta first
+
+The knobs are kept as offsets on top of the configured values, so live
+config reloads still set the baseline and the governor never overwrites it.
+*/
+struct FrameGovernor {
+    constexpr static float thetaStep = 0.1f;
+    constexpr static float maxThetaBoost = 0.7f;
+    constexpr static float maxLodScale = 8.0f;
+    constexpr static float headroom = 0.7f;     // Restore below this fraction of the budget
+    constexpr static int cooldownSteps = 30;    // Let the averages settle between changes
+    constexpr static float smoothing = 0.1f;
+
+    // Written by the render thread after every frame.
+    static std::atomic<int> renderTimeUs;
+
+    // False when simulation and rendering share one thread (--sequential)
+    static bool overlapped;
+
+    // Current adjustments
+    static float thetaBoost;
+    static int substepCut;
+    static float lodScale;
+
+    // Smoothed phase costs per step, microseconds
+    static float gravityUs;
+    static float collisionUs;
+    static float otherUs;
+    static float load;          // Estimated frame time / budget
+    static int stepsSinceChange;
+
+    static float theta() {
+        return config.theta + thetaBoost;
+    }
+
+    static int collisionSubsteps() {
+        return std::max(1, config.collisionSubsteps - substepCut);
+    }
+
+    static void reset() {
+        thetaBoost = 0.0f;
+        substepCut = 0;
+        lodScale = 1.0f;
+        load = 0.0f;
+        stepsSinceChange = 0;
+    }
+
+    // Called by the simulation thread with the cost of the last step.
+    static void observe(int stepGravityUs, int stepCollisionUs, int stepTotalUs) {
+        gravityUs += (stepGravityUs - gravityUs) * smoothing;
+        collisionUs += (stepCollisionUs - collisionUs) * smoothing;
+        otherUs += (std::max(0, stepTotalUs - stepGravityUs - stepCollisionUs) - otherUs) * smoothing;
+        stepsSinceChange++;
+
+        // The knobs depend on timing, so a deterministic run leaves them alone.
+        if (config.frameBudgetMs <= 0.0f || config.deterministic) {
+            if (load != 0.0f) reset();
+            return;
+        }
+
+        // Steps simulated per displayed frame
+        const float stepsPerFrame = config.timeScale;
+        const float simulationUs = (gravityUs + collisionUs + otherUs) * stepsPerFrame;
+        const float renderUs = static_cast<float>(renderTimeUs.load(std::memory_order_relaxed));
+        const float frameUs = overlapped ? std::max(simulationUs, renderUs) : simulationUs + renderUs;
+
+        load = frameUs / (config.frameBudgetMs * 1000.0f);
+        if (stepsSinceChange < cooldownSteps) return;
+
+        if (load > 1.0f) {
+            if (degrade(gravityUs * stepsPerFrame, collisionUs * stepsPerFrame, renderUs)) stepsSinceChange = 0;
+        } else if (load < headroom) {
+            if (restore()) stepsSinceChange = 0;
+        }
+    }
+
+    // Moves the knob of the most expensive phase that still has room.
+    static bool degrade(float gravityCost, float collisionCost, float renderCost) {
+        bool canTheta = thetaBoost + thetaStep <= maxThetaBoost + 1e-4f;
+        bool canSubsteps = collisionSubsteps() > 1;
+        bool canLod = lodScale < maxLodScale;
+
+        float worst = std::max({canTheta ? gravityCost : -1.0f,
+                                canSubsteps ? collisionCost : -1.0f,
+                                canLod ? renderCost : -1.0f});
+        if (worst < 0.0f) return false;
+
+        if (canTheta && worst == gravityCost) {
+            thetaBoost += thetaStep;
+        } else if (canSubsteps && worst == collisionCost) {
+            substepCut++;
+        } else {
+            lodScale *= 2.0f;
+        }
+        return true;
+    }
+
+    static bool restore() {
+        if (thetaBoost > 0.0f) {
+            thetaBoost = std::max(0.0f, thetaBoost - thetaStep);
+            return true;
+        }
+        if (substepCut > 0) {
+            substepCut--;
+            return true;
+        }
+        if (lodScale > 1.0f) {
+            lodScale = std::max(1.0f, lodScale * 0.5f);
+            return true;
+        }
+        return false;
+    }
+};
+
+std::atomic<int> FrameGovernor::renderTimeUs(0);
+bool FrameGovernor::overlapped = true;
+
+float FrameGovernor::thetaBoost = 0.0f;
+int FrameGovernor::substepCut = 0;
+float FrameGovernor::lodScale = 1.0f;
+
+float FrameGovernor::gravityUs = 0.0f;
+float FrameGovernor::collisionUs = 0.0f;
+float FrameGovernor::otherUs = 0.0f;
+float FrameGovernor::load = 0.0f;
+int FrameGovernor::stepsSinceChange = 0;
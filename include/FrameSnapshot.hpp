@@ -0,0 +1,36 @@
+#pragma once
+
+#include <SFML/Graphics.hpp>
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "PerfCounters.hpp"
+
+// Immutable copy of everything the render thread needs from one simulation
+// step. Written by the simulation thread, read by the render thread through
+// a TripleBuffer.
+struct FrameSnapshot {
+    // Points to draw. With level of detail enabled these come from the tree
+    // and `masses` holds the mass behind each point; otherwise they are the
+    // particle positions and `masses` is empty.
+    std::vector<sf::Vector2f> positions;
+    std::vector<float> masses;
+
+    size_t particleCount = 0;
+    uint64_t step = 0;
+    bool isPaused = false;
+
+    // Timings for the HUD
+    int simulationTimeUs = 0;
+    int gravityTime = 0;
+    int collisionTime = 0;
+    float theta = 0.0f;
+    float frameLoad = 0.0f;     // Estimated frame time / budget, 0 without a budget
+    int forceEvaluations = 0;   // Tree walks in the last step, block timesteps only
+
+    // Hardware counter line per phase, see PerfCounters
+    bool hasCounters = false;
+    std::array<std::string, PerfCounters::phaseCount> counters;
+};
@@ -5,7 +5,10 @@
 #include <cmath>
 #include "Particle.hpp"
 #include "Simulation.hpp"
+#include "SimulationThread.hpp"
 #include "Config.hpp"
+#include "Camera.hpp"
+#include "Replay.hpp"
 
 using namespace std;
 
@@ -33,6 +36,7 @@ struct InputManager {
     static float particleSpacing;
 
     static void handle_inputs() {
+        TRACE_ZONE("InputManager::handle_inputs");
         frameTimer.restart();
 
         sf::Event event;
@@ -45,12 +49,16 @@ struct InputManager {
             switch (event.type) {
 
                 case sf::Event::KeyPressed:
-                    if (event.key.code == sf::Keyboard::R) {
-                        Particle::particles.clear();
+                    if (Replay::isActive() && Replay::handleKey(event.key.code)) {
+                        break;
+                    }
+                    // No simulation thread runs during a replay
+                    else if (event.key.code == sf::Keyboard::R && !Replay::isActive()) {
+                        SimulationThread::send({SimulationCommand::Clear});
                         break;
                     }
                     else if (event.key.code == sf::Keyboard::Space) {
-                        Simulation::isPaused = !Simulation::isPaused;
+                        SimulationThread::send({SimulationCommand::TogglePause});
                         break;
                     }
                     else if (event.key.code == sf::Keyboard::Z) {
@@ -62,24 +70,66 @@ struct InputManager {
                         particleSpacing +=  1.0f;
                         break;
                     }
+                    else if (event.key.code == sf::Keyboard::T) {
+                        Trace::enabled = !Trace::enabled;
+                        if (!Trace::enabled) Trace::dump(Trace::outputPath);
+                        break;
+                    }
+                    else if (event.key.code == sf::Keyboard::L) {
+                        Camera::state.levelOfDetail = !Camera::state.levelOfDetail;
+                        break;
+                    }
+                    else if (event.key.code == sf::Keyboard::Home) {
+                        Camera::reset();
+                        break;
+                    }
+                    else handleCameraKeys(event.key.code);
+                    break;
 
+                // Ctrl + scroll zooms, plain scroll changes the particle count
+                // (scrubs in a replay).
                 case sf::Event::MouseWheelScrolled:
+                    if (sf::Keyboard::isKeyPressed(sf::Keyboard::LControl)) {
+                        sf::Vector2i pixel(event.mouseWheelScroll.x, event.mouseWheelScroll.y);
+                        Camera::zoomAt(pixel, event.mouseWheelScroll.delta > 0 ? 1.25f : 0.8f);
+                        break;
+                    }
+                    if (Replay::isActive()) {
+                        Replay::scrub(event.mouseWheelScroll.delta);
+                        break;
+                    }
                     updateParticleCount(event);
                     break;
 
                 // Click and drag to add velocity to new object. // 
+                // Right drag pans the camera.
                 case sf::Event::MouseButtonPressed:
-                    if (event.mouseButton.button == sf::Mouse::Left) {
+                    if (event.mouseButton.button == sf::Mouse::Left && !Replay::isActive()) {
                         startDrag(window);
                     }
+                    else if (event.mouseButton.button == sf::Mouse::Right) {
+                        Camera::isPanning = true;
+                        Camera::panStart = {event.mouseButton.x, event.mouseButton.y};
+                    }
                     break;
 
                 case sf::Event::MouseButtonReleased:
-                    if (event.mouseButton.button == sf::Mouse::Left) {
+                    if (event.mouseButton.button == sf::Mouse::Left && isDragging) {
                         endDrag(window);
                     }
+                    else if (event.mouseButton.button == sf::Mouse::Right) {
+                        Camera::isPanning = false;
+                    }
 
                     break;
+
+                case sf::Event::MouseMoved:
+                    if (Camera::isPanning) {
+                        sf::Vector2i position(event.mouseMove.x, event.mouseMove.y);
+                        Camera::pan(position - Camera::panStart);
+                        Camera::panStart = position;
+                    }
+                    break;
                 default:
                     break;
                 
@@ -103,6 +153,19 @@ struct InputManager {
         }
     } 
 
+    // Arrow keys pan the camera. Returns false for any other key.
+    static bool handleCameraKeys(sf::Keyboard::Key key) {
+        const int step = 50;
+
+        switch (key) {
+            case sf::Keyboard::Left:  Camera::pan({step, 0});  return true;
+            case sf::Keyboard::Right: Camera::pan({-step, 0}); return true;
+            case sf::Keyboard::Up:    Camera::pan({0, step});  return true;
+            case sf::Keyboard::Down:  Camera::pan({0, -step}); return true;
+            default: return false;
+        }
+    }
+
     static void updateParticleCount(sf::Event& event) {
         if (event.mouseWheelScroll.delta > 0 && (nParticles * 2) <= 4048) {
             nParticles *= 2;
@@ -115,7 +178,7 @@ struct InputManager {
 
     static void update() {
         mousePosI = sf::Mouse::getPosition(window);
-        mousePosF = sf::Vector2f(mousePosI);
+        mousePosF = Camera::toWorld(mousePosI);
 
         size_t particleCount = static_cast<std::vector<Particle>::size_type>(nParticles);
 
@@ -160,9 +223,11 @@ struct InputManager {
         isDragging = true;
     }
 
+    // Shift while releasing drops the particles as one rigid body.
     static void endDrag(sf::RenderWindow& window) {
         sf::Vector2f velocity = dragStart - mousePosF;
-        Particle::add(particles, (velocity * 0.1f));
+        bool isBody = sf::Keyboard::isKeyPressed(sf::Keyboard::LShift) || sf::Keyboard::isKeyPressed(sf::Keyboard::RShift);
+        SimulationThread::send({isBody ? SimulationCommand::AddBody : SimulationCommand::AddParticles, particles, velocity * 0.1f});
         InputManager::particles.clear();
 
         isDragging = false;
@@ -170,6 +235,7 @@ struct InputManager {
     
  
     static void renderAll() {
+        if (Replay::isActive()) return;
         for (Particle& particle : particles) {
             particle.render();
         }
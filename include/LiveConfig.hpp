@@ -0,0 +1,207 @@
+#pragma once
+
+#include <cctype>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+
+#include <sys/stat.h>
+
+#include "Config.hpp"
+#include "CollisionGrid.hpp"
+
+/*
+Runtime tunables loaded from liveconfig.json:
+
+    {
+        "theta": 0.3,
+        "gravitational_constant": 10.0,
+        "gravitationalSoftening": 100000.0,
+        "threadCount": 0,
+        "gridCellSize": 2,
+        "collisionSubsteps": 1
+    }
+
+"multipoleOrder" (0 = monopole, 2 = quadrupole), "taskGraph",
+"deterministic", "analysisInterval", "neighbourLists", "neighbourSkin",
+"timeScale", "maxStepsPerFrame", "frameBudgetMs", "gravitySolver" (0 = tree,
+1 = particle mesh, 2 = TreePM), "meshSize", "mergeOnContact", "mergeVelocity", "blockTimesteps", "maxRung",
+"timestepAccuracy" and "sweptThreshold" are accepted as well.
+
+The file is read at startup and then stat()ed every pollInterval frames.
+When its modification time changes it is re-read and the values are applied
+before the next frame starts, so no phase ever sees a half-updated config.
+Missing keys keep their current value; a file that fails to parse is
+reported and ignored.
+*/
+struct LiveConfig {
+    static std::string path;
+    static int pollInterval;    // Frames between checks, 0 = never reload
+
+    static int framesSinceCheck;
+    static struct timespec lastModified;
+
+    // Parses a flat JSON object of numbers and booleans.
+    static bool parse(const std::string& text, std::map<std::string, double>& values) {
+        size_t i = 0;
+        auto skipSpace = [&]() {
+            while (i < text.size() && std::isspace(static_cast<unsigned char>(text[i]))) i++;
+        };
+
+        skipSpace();
+        if (i >= text.size() || text[i++] != '{') return false;
+
+        while (true) {
+            skipSpace();
+            if (i < text.size() && text[i] == '}') return true;
+            if (i >= text.size() || text[i++] != '"') return false;
+
+            size_t keyEnd = text.find('"', i);
+            if (keyEnd == std::string::npos) return false;
+            std::string key = text.substr(i, keyEnd - i);
+            i = keyEnd + 1;
+
+            skipSpace();
+            if (i >= text.size() || text[i++] != ':') return false;
+            skipSpace();
+
+            if (text.compare(i, 4, "true") == 0) {
+                values[key] = 1.0;
+                i += 4;
+            } else if (text.compare(i, 5, "false") == 0) {
+                values[key] = 0.0;
+                i += 5;
+            } else {
+                const char* start = text.c_str() + i;
+                char* end;
+                double value = std::strtod(start, &end);
+                if (end == start) return false;
+                values[key] = value;
+                i += end - start;
+            }
+
+            skipSpace();
+            if (i < text.size() && text[i] == ',') {
+                i++;
+                continue;
+            }
+            if (i < text.size() && text[i] == '}') return true;
+            return false;
+        }
+    }
+
+    // `source` names the settings in messages about rejected keys.
+    static void apply(const std::map<std::string, double>& values, const std::string& source = path) {
+        bool gridChanged = false;
+
+        for (const auto& [key, value] : values) {
+            if (key == "theta" && value >= 0.0) {
+                config.theta = static_cast<float>(value);
+            } else if (key == "multipoleOrder" && (value == 0.0 || value == 2.0)) {
+                config.multipoleOrder = static_cast<int>(value);
+            } else if (key == "gravitational_constant") {
+                config.gravitational_constant = static_cast<float>(value);
+            } else if (key == "gravitationalSoftening" && value >= 0.0) {
+                config.gravitationalSoftening = static_cast<float>(value);
+            } else if (key == "threadCount" && value >= 0.0) {
+                config.threadCount = static_cast<int>(std::min(value, double(Config::maxThreads)));
+            } else if (key == "gridCellSize" && value >= Config::particleSize) {
+                int cellSize = static_cast<int>(std::min(value, double(Config::maxGridCellSize)));
+                gridChanged = config.gridCellSize != cellSize;
+                config.gridCellSize = cellSize;
+            } else if (key == "collisionSubsteps" && value >= 1.0) {
+                config.collisionSubsteps = static_cast<int>(value);
+            } else if (key == "neighbourLists") {
+                config.neighbourLists = value != 0.0;
+            } else if (key == "neighbourSkin" && value > 0.0) {
+                config.neighbourSkin = static_cast<float>(value);
+            } else if (key == "taskGraph") {
+                config.taskGraph = value != 0.0;
+            } else if (key == "analysisInterval" && value >= 0.0) {
+                config.analysisInterval = static_cast<int>(value);
+            } else if (key == "deterministic") {
+                config.deterministic = value != 0.0;
+            } else if (key == "timeScale" && value > 0.0) {
+                config.timeScale = static_cast<float>(value);
+            } else if (key == "maxStepsPerFrame" && value >= 1.0) {
+                config.maxStepsPerFrame = static_cast<int>(value);
+            } else if (key == "frameBudgetMs" && value >= 0.0) {
+                config.frameBudgetMs = static_cast<float>(value);
+            } else if (key == "gravitySolver" && value >= 0.0 && value <= 2.0) {
+                config.gravitySolver = static_cast<Config::GravitySolver>(static_cast<int>(value));
+            } else if (key == "meshSize" && value >= 16.0 && value <= 4096.0 &&
+                       (static_cast<int>(value) & (static_cast<int>(value) - 1)) == 0) {
+                config.meshSize = static_cast<int>(value);
+            } else if (key == "blockTimesteps") {
+                config.blockTimesteps = value != 0.0;
+            } else if (key == "maxRung" && value >= 0.0 && value <= 12.0) {
+                config.maxRung = static_cast<int>(value);
+            } else if (key == "timestepAccuracy" && value > 0.0) {
+                config.timestepAccuracy = static_cast<float>(value);
+            } else if (key == "mergeOnContact") {
+                config.mergeOnContact = value != 0.0;
+            } else if (key == "mergeVelocity" && value >= 0.0) {
+                config.mergeVelocity = static_cast<float>(value);
+            } else if (key == "sweptThreshold" && value >= 0.0) {
+                config.sweptThreshold = static_cast<float>(value);
+            } else {
+                std::cerr << source << ": ignoring " << key << " = " << value << std::endl;
+            }
+        }
+
+        if (gridChanged && !CollisionGrid::cells.empty()) {
+            CollisionGrid::initialize();
+        }
+    }
+
+    static bool load() {
+        std::ifstream file(path);
+        if (!file) return false;
+
+        std::stringstream buffer;
+        buffer << file.rdbuf();
+
+        std::map<std::string, double> values;
+        if (!parse(buffer.str(), values)) {
+            std::cerr << "Could not parse " << path << ", keeping the current settings" << std::endl;
+            return false;
+        }
+
+        apply(values);
+        return true;
+    }
+
+    static bool modifiedSinceLoad() {
+        struct stat info;
+        if (stat(path.c_str(), &info) != 0) return false;
+
+        bool changed = info.st_mtim.tv_sec != lastModified.tv_sec ||
+                       info.st_mtim.tv_nsec != lastModified.tv_nsec;
+        lastModified = info.st_mtim;
+        return changed;
+    }
+
+    static void initialize() {
+        modifiedSinceLoad();
+        load();
+    }
+
+    // Called between frames.
+    static void poll() {
+        if (pollInterval <= 0 || ++framesSinceCheck < pollInterval) return;
+        framesSinceCheck = 0;
+
+        if (modifiedSinceLoad() && load()) {
+            std::cout << "Reloaded " << path << std::endl;
+        }
+    }
+};
+
+std::string LiveConfig::path = "liveconfig.json";
+int LiveConfig::pollInterval = 30;
+
+int LiveConfig::framesSinceCheck = 0;
+struct timespec LiveConfig::lastModified = {0, 0};
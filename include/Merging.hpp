@@ -0,0 +1,133 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <numeric>
+#include <utility>
+#include <vector>
+
+#include "Config.hpp"
+#include "Particle.hpp"
+#include "Solver.hpp"
+#include "Trace.hpp"
+
+/*
+Optional accretion (config.mergeOnContact). Touching particles whose
+relative speed is below config.mergeVelocity are combined instead of
+bounced, conserving mass and momentum, so clumps that have settled collapse
+into fewer, heavier bodies and N drops over time.
+
+The collision workers only record candidate pairs, one list per thread.
+They judge the relative speed from the velocities as they were before the
+pass, since bounces on other threads change them meanwhile.
+apply() then runs once per collision pass on a single thread: the pairs are
+sorted, grouped with union-find (the lowest index is always the root),
+folded into the root in index order and the absorbed particles removed with
+a stable compaction. The result depends only on the set of contacts, not on
+thread count or timing.
+*/
+struct Merging {
+    static std::vector<std::vector<std::pair<uint32_t, uint32_t>>> candidates;   // [thread]
+    static std::vector<uint32_t> parent;
+    static std::vector<sf::Vector2f> velocities;    // Per particle, from before the collision pass
+    static float maxRadius;                         // Largest particle in the pass
+    static uint64_t totalMerged;
+
+    // Called by the collision workers for each contact.
+    static bool shouldMerge(const Particle* base, const Particle& a, const Particle& b) {
+        sf::Vector2f offset = a.position - b.position;
+        float contactDistance = Solver::sumOfRadii(a, b);
+        if (offset.x * offset.x + offset.y * offset.y >= contactDistance * contactDistance) return false;
+
+        sf::Vector2f relativeVelocity = velocities[&a - base] - velocities[&b - base];
+        return relativeVelocity.x * relativeVelocity.x + relativeVelocity.y * relativeVelocity.y <
+               config.mergeVelocity * config.mergeVelocity;
+    }
+
+    static void prepare(int numThreads, const std::vector<Particle>& particles) {
+        candidates.resize(numThreads);
+        for (auto& threadCandidates : candidates) {
+            threadCandidates.clear();
+        }
+
+        velocities.resize(particles.size());
+        maxRadius = 0.0f;
+        for (size_t i = 0; i < particles.size(); i++) {
+            velocities[i] = particles[i].velocity;
+            maxRadius = std::max(maxRadius, particles[i].radius);
+        }
+    }
+
+    static void record(int thread, uint32_t a, uint32_t b) {
+        candidates[thread].emplace_back(std::min(a, b), std::max(a, b));
+    }
+
+    static uint32_t find(uint32_t i) {
+        while (parent[i] != i) {
+            parent[i] = parent[parent[i]];
+            i = parent[i];
+        }
+        return i;
+    }
+
+    // Merges all recorded groups. Returns the number of particles removed.
+    static size_t apply(std::vector<Particle>& particles) {
+        std::vector<std::pair<uint32_t, uint32_t>> pairs;
+        for (auto& threadCandidates : candidates) {
+            pairs.insert(pairs.end(), threadCandidates.begin(), threadCandidates.end());
+            threadCandidates.clear();
+        }
+        if (pairs.empty()) return 0;
+
+        TRACE_ZONE("Merging::apply");
+        std::sort(pairs.begin(), pairs.end());
+        pairs.erase(std::unique(pairs.begin(), pairs.end()), pairs.end());
+
+        parent.resize(particles.size());
+        std::iota(parent.begin(), parent.end(), 0u);
+
+        for (const auto& [a, b] : pairs) {
+            uint32_t rootA = find(a);
+            uint32_t rootB = find(b);
+            if (rootA == rootB) continue;
+            if (rootA < rootB) parent[rootB] = rootA;
+            else parent[rootA] = rootB;
+        }
+
+        // Fold every absorbed particle into its root. Roots have the lowest
+        // index in their group, so they are always visited first.
+        for (size_t i = 0; i < particles.size(); i++) {
+            uint32_t root = find(static_cast<uint32_t>(i));
+            if (root == i) continue;
+
+            Particle& target = particles[root];
+            const Particle& source = particles[i];
+            float mass = target.mass + source.mass;
+
+            target.position = (target.position * target.mass + source.position * source.mass) / mass;
+            target.velocity = (target.velocity * target.mass + source.velocity * source.mass) / mass;
+            target.force += source.force;
+            target.radius = std::sqrt(target.radius * target.radius + source.radius * source.radius);
+            target.mass = mass;
+        }
+
+        size_t kept = 0;
+        for (size_t i = 0; i < particles.size(); i++) {
+            if (parent[i] != i) continue;
+            if (kept != i) particles[kept] = particles[i];
+            kept++;
+        }
+
+        size_t removed = particles.size() - kept;
+        particles.resize(kept);
+        totalMerged += removed;
+        return removed;
+    }
+};
+
+std::vector<std::vector<std::pair<uint32_t, uint32_t>>> Merging::candidates;
+std::vector<uint32_t> Merging::parent;
+std::vector<sf::Vector2f> Merging::velocities;
+float Merging::maxRadius = 0.0f;
+uint64_t Merging::totalMerged = 0;
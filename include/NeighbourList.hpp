@@ -0,0 +1,195 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include "CollisionGrid.hpp"
+#include "Config.hpp"
+#include "Numa.hpp"
+#include "Particle.hpp"
+#include "PerfCounters.hpp"
+#include "Solver.hpp"
+#include "Trace.hpp"
+
+/*
+Verlet neighbour lists for the collision phase.
+
+Every particle gets the list of particles within contactRange + skin of it,
+found once through the collision grid and then reused while nobody has
+moved more than skin / 2 since: two particles that are in contact now were
+at most contactRange + skin apart when the lists were built. Between
+rebuilds a step is just a walk over the lists, with no grid to clear and
+fill and no empty neighbour cells to look at.
+
+Entries are grouped by the grid row their particle was in at build time
+(rowStarts), so the phase can be split into bands of rows like the grid
+path. A particle's neighbours are at most reachRows() rows away from it.
+
+The lists hold indices, so any change to the particle array (additions,
+removals, restores) forces a rebuild.
+*/
+struct NeighbourList {
+    static std::vector<uint32_t> order;         // Particle of each entry, by build row
+    static std::vector<uint32_t> rowStarts;     // First entry of each grid row, nRows + 1
+    static std::vector<uint32_t> offsets;       // Neighbour range of each entry, entries + 1
+    static std::vector<uint32_t> neighbours;
+    static std::vector<int> rows;               // Build row per particle, -1 outside the grid
+
+    static std::vector<sf::Vector2f> builtPositions;
+    static const Particle* builtData;
+    static int builtCellSize;
+    static float builtSkin;
+
+    static uint64_t rebuilds;
+
+    // The distance below which resolve_collision acts.
+    static float contactRange() {
+        return 2.0f * Config::particleSize - Solver::contactEpsilon;
+    }
+
+    static float cutoff() {
+        return contactRange() + config.neighbourSkin;
+    }
+
+    static int reachRows() {
+        return static_cast<int>(std::ceil(cutoff() / CollisionGrid::cellSize));
+    }
+
+    static bool isValid(const std::vector<Particle>& particles) {
+        if (particles.data() != builtData || particles.size() != builtPositions.size() ||
+            CollisionGrid::cellSize != builtCellSize || config.neighbourSkin != builtSkin) {
+            return false;
+        }
+
+        const float limit = 0.25f * builtSkin * builtSkin;
+        for (size_t i = 0; i < particles.size(); i++) {
+            sf::Vector2f moved = particles[i].position - builtPositions[i];
+            if (moved.x * moved.x + moved.y * moved.y > limit) return false;
+        }
+        return true;
+    }
+
+    static void build(std::vector<Particle>& particles) {
+        TRACE_ZONE("NeighbourList::build");
+        CollisionGrid::assignParticlesToGrid(particles);
+
+        const int nColumns = CollisionGrid::nColumns;
+        const int nRows = CollisionGrid::nRows;
+        const int reach = reachRows();
+        const float cutoffSquared = cutoff() * cutoff();
+        const Particle* base = particles.data();
+
+        order.clear();
+        neighbours.clear();
+        offsets.assign(1, 0);
+        rowStarts.assign(nRows + 1, 0);
+        rows.assign(particles.size(), -1);
+
+        for (int row = 0; row < nRows; row++) {
+            rowStarts[row] = static_cast<uint32_t>(order.size());
+
+            for (int col = 0; col < nColumns; col++) {
+                for (Particle* particle1 : CollisionGrid::cells[col][row]) {
+                    const uint32_t index = static_cast<uint32_t>(particle1 - base);
+                    rows[index] = row;
+                    order.push_back(index);
+
+                    for (int adjCol = std::max(0, col - reach); adjCol <= std::min(nColumns - 1, col + reach); adjCol++) {
+                        for (int adjRow = std::max(0, row - reach); adjRow <= std::min(nRows - 1, row + reach); adjRow++) {
+                            for (Particle* particle2 : CollisionGrid::cells[adjCol][adjRow]) {
+                                if (particle1 == particle2) continue;
+
+                                sf::Vector2f d = particle2->position - particle1->position;
+                                if (d.x * d.x + d.y * d.y < cutoffSquared) {
+                                    neighbours.push_back(static_cast<uint32_t>(particle2 - base));
+                                }
+                            }
+                        }
+                    }
+                    offsets.push_back(static_cast<uint32_t>(neighbours.size()));
+                }
+            }
+        }
+        rowStarts[nRows] = static_cast<uint32_t>(order.size());
+
+        builtPositions.resize(particles.size());
+        for (size_t i = 0; i < particles.size(); i++) {
+            builtPositions[i] = particles[i].position;
+        }
+        builtData = particles.data();
+        builtCellSize = CollisionGrid::cellSize;
+        builtSkin = config.neighbourSkin;
+        rebuilds++;
+    }
+
+    // Forces a rebuild on the next step, e.g. when a run starts over.
+    static void invalidate() {
+        builtData = nullptr;
+    }
+
+    // Rebuilds the lists if they no longer cover every possible contact.
+    static void refresh(std::vector<Particle>& particles) {
+        if (!isValid(particles)) build(particles);
+    }
+
+    // Resolves the contacts of the particles built into rows [rowStart, rowEnd).
+    static void resolveRows(std::vector<Particle>& particles, int rowStart, int rowEnd) {
+        for (uint32_t entry = rowStarts[rowStart]; entry < rowStarts[rowEnd]; entry++) {
+            Particle& particle1 = particles[order[entry]];
+            for (uint32_t n = offsets[entry]; n < offsets[entry + 1]; n++) {
+                Solver::resolve_collision(particle1, particles[neighbours[n]]);
+            }
+        }
+    }
+
+    // Threaded over bands of rows, like CollisionGrid::checkCollisionsInGrid.
+    static void update(std::vector<Particle>& particles, int substeps = 1) {
+        TRACE_ZONE("NeighbourList::update");
+        refresh(particles);
+
+        const int nRows = CollisionGrid::nRows;
+        const int numThreads = std::max(1, std::min(config.threads(), nRows));
+        const int rowsPerThread = nRows / numThreads;
+
+        for (int substep = 0; substep < substeps; substep++) {
+            if (config.deterministic) {
+                CollisionGrid::sweepBands(reachRows(), numThreads, [&particles](int, int rowStart, int rowEnd) {
+                    resolveRows(particles, rowStart, rowEnd);
+                });
+                continue;
+            }
+
+            std::vector<std::thread> threads;
+            for (int i = 0; i < numThreads; i++) {
+                int rowStart = i * rowsPerThread;
+                int rowEnd = (i == numThreads - 1) ? nRows : (i + 1) * rowsPerThread;
+                threads.emplace_back([&particles, i, numThreads, rowStart, rowEnd]() {
+                    TRACE_ZONE("collision worker");
+                    PERF_ZONE(PerfPhase::Collision);
+                    Numa::pinWorker(i, numThreads);
+                    resolveRows(particles, rowStart, rowEnd);
+                });
+            }
+
+            for (auto& t : threads) {
+                t.join();
+            }
+        }
+    }
+};
+
+std::vector<uint32_t> NeighbourList::order;
+std::vector<uint32_t> NeighbourList::rowStarts;
+std::vector<uint32_t> NeighbourList::offsets;
+std::vector<uint32_t> NeighbourList::neighbours;
+std::vector<int> NeighbourList::rows;
+
+std::vector<sf::Vector2f> NeighbourList::builtPositions;
+const Particle* NeighbourList::builtData = nullptr;
+int NeighbourList::builtCellSize = 0;
+float NeighbourList::builtSkin = 0.0f;
+
+uint64_t NeighbourList::rebuilds = 0;
@@ -0,0 +1,279 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <dirent.h>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "Trace.hpp"
+
+/*
+NUMA awareness for the worker threads (--numa).
+
+The topology is read from /sys/devices/system/node. Worker t of n is pinned
+to a CPU on node t * nodes / n, so consecutive workers, and with them
+consecutive chunks of the particle array, share a node. Memory is then put
+next to the workers that use it:
+
+    - Tree nodes come from one pool per NUMA node. Each pool is filled by a
+      thread pinned to that node so the first touch happens there, and a
+      worker only takes nodes from its own node's pool.
+    - Particle::particles is one std::vector used everywhere, so it can't be
+      first touched piecewise. Instead placeParticles() moves the pages of
+      each worker's chunk to that worker's node with move_pages(2).
+
+Everything is a no-op on single node machines or when the mode is off.
+*/
+struct Numa {
+    struct NumaNode {
+        int id;
+        std::vector<int> cpus;
+    };
+
+    static bool enabled;
+    static std::vector<NumaNode> nodes;
+    static thread_local int currentNode;    // Node this thread is pinned to
+
+    // Where the particle array was last placed
+    static const void* placedData;
+    static size_t placedCount;
+    static int placedThreads;
+
+    // "0-3,8,10-11" -> {0, 1, 2, 3, 8, 10, 11}
+    static std::vector<int> parseCpuList(const std::string& text) {
+        std::vector<int> cpus;
+        std::stringstream stream(text);
+        std::string range;
+
+        while (std::getline(stream, range, ',')) {
+            if (range.empty() || range == "\n") continue;
+            int first = 0;
+            int last = 0;
+            int fields = std::sscanf(range.c_str(), "%d-%d", &first, &last);
+            if (fields < 1) continue;
+            if (fields == 1) last = first;
+            for (int cpu = first; cpu <= last; cpu++) cpus.push_back(cpu);
+        }
+        return cpus;
+    }
+
+    static void discover() {
+        nodes.clear();
+
+        if (DIR* directory = opendir("/sys/devices/system/node")) {
+            while (dirent* entry = readdir(directory)) {
+                int id;
+                if (std::sscanf(entry->d_name, "node%d", &id) != 1) continue;
+
+                std::ifstream file("/sys/devices/system/node/" + std::string(entry->d_name) + "/cpulist");
+                std::string text;
+                std::getline(file, text);
+
+                std::vector<int> cpus = parseCpuList(text);
+                if (!cpus.empty()) nodes.push_back({id, cpus});
+            }
+            closedir(directory);
+        }
+
+        std::sort(nodes.begin(), nodes.end(), [](const NumaNode& a, const NumaNode& b) { return a.id < b.id; });
+
+        // No sysfs topology: one node with every CPU.
+        if (nodes.empty()) {
+            NumaNode node = {0, {}};
+            for (unsigned cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency()); cpu++) {
+                node.cpus.push_back(static_cast<int>(cpu));
+            }
+            nodes.push_back(node);
+        }
+    }
+
+    static void initialize(bool enable) {
+        enabled = enable;
+        if (!enabled) return;
+
+        discover();
+        std::cout << "NUMA: " << nodes.size() << " node(s)";
+        for (const NumaNode& node : nodes) std::cout << ", node " << node.id << ": " << node.cpus.size() << " cpus";
+        std::cout << std::endl;
+    }
+
+    static bool isActive() {
+        return enabled && nodes.size() > 1;
+    }
+
+    static int nodeCount() {
+        return isActive() ? static_cast<int>(nodes.size()) : 1;
+    }
+
+    // Index into `nodes` for worker `worker` of `numWorkers`.
+    static int nodeOfWorker(int worker, int numWorkers) {
+        if (!isActive() || numWorkers <= 0) return 0;
+        return std::min(static_cast<int>(nodes.size()) - 1, worker * static_cast<int>(nodes.size()) / numWorkers);
+    }
+
+    static bool pinToNode(int nodeIndex, int slot = 0) {
+        const NumaNode& node = nodes[nodeIndex];
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(node.cpus[slot % node.cpus.size()], &set);
+
+        currentNode = nodeIndex;
+        return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+    }
+
+    // Called at the top of each parallel worker.
+    static void pinWorker(int worker, int numWorkers) {
+        if (!isActive()) return;
+
+        int node = nodeOfWorker(worker, numWorkers);
+        int first = 0;
+        while (first < worker && nodeOfWorker(first, numWorkers) != node) first++;
+        pinToNode(node, worker - first);
+    }
+
+    static long movePages(std::vector<void*>& pages, std::vector<int>& targets, std::vector<int>& status) {
+        constexpr int moveFlag = 1 << 1;    // MPOL_MF_MOVE
+        return syscall(SYS_move_pages, 0, pages.size(), pages.data(), targets.data(), status.data(), moveFlag);
+    }
+
+    // Moves each worker's chunk of `data` to its node. Chunks match the
+    // ceil(count / numThreads) split the force workers use.
+    static void placeRange(const void* data, size_t elementSize, size_t count, int numThreads) {
+        TRACE_ZONE("Numa::placeRange");
+        const size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        const size_t chunkSize = (count + numThreads - 1) / numThreads;
+        const uintptr_t begin = reinterpret_cast<uintptr_t>(data);
+
+        std::vector<void*> pages;
+        std::vector<int> targets;
+        for (int t = 0; t < numThreads; t++) {
+            size_t start = t * chunkSize;
+            size_t end = std::min(count, start + chunkSize);
+            if (start >= end) break;
+
+            // Pages shared by two chunks go to the node of the first.
+            uintptr_t first = (begin + start * elementSize + pageSize - 1) / pageSize * pageSize;
+            if (start == 0) first = begin / pageSize * pageSize;
+            uintptr_t last = begin + end * elementSize;
+
+            for (uintptr_t page = first; page < last; page += pageSize) {
+                pages.push_back(reinterpret_cast<void*>(page));
+                targets.push_back(nodes[nodeOfWorker(t, numThreads)].id);
+            }
+        }
+
+        std::vector<int> status(pages.size());
+        if (!pages.empty() && movePages(pages, targets, status) < 0) {
+            std::cerr << "NUMA: move_pages failed, particles stay where they are" << std::endl;
+            enabled = false;
+        }
+    }
+
+    // Re-places the particle array after it was reallocated or changed size
+    // noticeably. Cheap to call every step.
+    template <typename T>
+    static void placeParticles(const std::vector<T>& particles, int numThreads) {
+        if (!isActive() || particles.empty()) return;
+
+        bool moved = particles.data() != placedData;
+        bool resized = particles.size() > placedCount + placedCount / 10 ||
+                       particles.size() + placedCount / 10 < placedCount;
+        if (!moved && !resized && numThreads == placedThreads) return;
+
+        placeRange(particles.data(), sizeof(T), particles.size(), numThreads);
+        placedData = particles.data();
+        placedCount = particles.size();
+        placedThreads = numThreads;
+    }
+
+    /*
+    --numa-bench: for every (worker node, memory node) pair, first touches a
+    buffer from a thread pinned to the memory node, then reads it from
+    threads pinned to the worker node, both as a stream and as dependent
+    random loads. The diagonal is local placement, the rest remote.
+    */
+    static void benchmark(size_t megabytes = 256) {
+        discover();
+        enabled = true;
+        const size_t count = megabytes * 1024 * 1024 / sizeof(uint64_t);
+        const int threadsPerNode = std::max<int>(1, nodes[0].cpus.size());
+
+        std::printf("NUMA benchmark, %zu node(s), %zu MB buffer\n", nodes.size(), megabytes);
+        std::printf("%-12s %-12s %14s %18s\n", "workers", "memory", "stream GB/s", "random ns/load");
+
+        for (size_t memory = 0; memory < nodes.size(); memory++) {
+            std::vector<uint64_t>* buffer = nullptr;
+
+            // Allocate and first touch on the memory node.
+            std::thread([&]() {
+                pinToNode(static_cast<int>(memory));
+                buffer = new std::vector<uint64_t>(count);
+                std::vector<uint64_t>& values = *buffer;
+
+                // A single cycle through the buffer for the dependent loads
+                uint64_t state = 0x9e3779b97f4a7c15ull;
+                for (size_t i = 0; i < count; i++) values[i] = i;
+                for (size_t i = count - 1; i > 0; i--) {
+                    state ^= state << 13; state ^= state >> 7; state ^= state << 17;
+                    std::swap(values[i], values[state % i]);
+                }
+            }).join();
+
+            for (size_t workers = 0; workers < nodes.size(); workers++) {
+                const std::vector<uint64_t>& values = *buffer;
+                const int numThreads = std::min<int>(threadsPerNode, nodes[workers].cpus.size());
+                std::vector<uint64_t> sums(numThreads);
+
+                auto start = std::chrono::steady_clock::now();
+                std::vector<std::thread> threads;
+                for (int t = 0; t < numThreads; t++) {
+                    threads.emplace_back([&, t]() {
+                        pinToNode(static_cast<int>(workers), t);
+                        uint64_t sum = 0;
+                        for (size_t i = t; i < count; i += numThreads) sum += values[i];
+                        sums[t] = sum;
+                    });
+                }
+                for (auto& thread : threads) thread.join();
+                double streamSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+                const size_t loads = std::min<size_t>(count, 4 * 1024 * 1024);
+                double randomSeconds = 0.0;
+                std::thread([&]() {
+                    pinToNode(static_cast<int>(workers));
+                    auto randomStart = std::chrono::steady_clock::now();
+                    uint64_t index = 0;
+                    for (size_t i = 0; i < loads; i++) index = values[index];
+                    randomSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - randomStart).count();
+                    sums[0] += index;
+                }).join();
+
+                std::printf("node %-7d node %-7d %14.2f %18.1f%s\n", nodes[workers].id, nodes[memory].id,
+                            count * sizeof(uint64_t) / streamSeconds / 1e9, randomSeconds / loads * 1e9,
+                            workers == memory ? "  (local)" : "");
+            }
+
+            delete buffer;
+        }
+    }
+};
+
+bool Numa::enabled = false;
+std::vector<Numa::NumaNode> Numa::nodes;
+thread_local int Numa::currentNode = 0;
+
+const void* Numa::placedData = nullptr;
+size_t Numa::placedCount = 0;
+int Numa::placedThreads = 0;
@@ -1,9 +1,11 @@
 #pragma once
 
 #include <SFML/Graphics.hpp>
+#include <cstdint>
 #include <vector>
 #include "WindowManager.hpp"
 #include "Config.hpp"
+#include "Trace.hpp"
 #include "iostream"
 #include <cmath>
 #include <random>
@@ -12,21 +14,20 @@
 struct Particle {
     static std::vector<Particle> particles;
 
-    sf::CircleShape shape;
     sf::Vector2f position = {0.0f, 0.0f};
     sf::Vector2f positionOffset = {0.0f, 0.0f};
     sf::Vector2f velocity = {0.0f, 0.0f};
     sf::Vector2f force = {0.0f, 0.0f};
 
-    float radius;
-    float mass;
+    float radius = 0.0f;
+    float mass = 0.0f;
 
-    Particle(sf::Vector2f position, float radius, sf::Vector2f velocity) 
-        : position(position), velocity(velocity) {
+    int rung = 0;   // Block timestep level, see BlockTimesteps
 
-        shape.setRadius(radius);
-        shape.setPosition(position);
-        shape.setFillColor(sf::Color::Green);
+    Particle() = default;
+
+    Particle(sf::Vector2f position, float radius, sf::Vector2f velocity) 
+        : position(position), velocity(velocity), radius(radius) {
 
         mass = 3.14159f * radius * radius;
     }
@@ -57,6 +58,7 @@ struct Particle {
     // Removes out of bound particles and moves the particles
     // based on the force applied.
     static void updateAll(float dt) {
+        TRACE_ZONE("Particle::updateAll");
         for (auto it = particles.begin(); it != particles.end();) {
             Particle& particle = *it; 
 
@@ -70,21 +72,31 @@ struct Particle {
         }
     }
 
-    static void renderAll() {
-        sf::VertexArray particlesArray(sf::Points, particles.size());
-
-        for (size_t i = 0; i < particles.size(); ++i) {
-            Particle& particle = particles[i];
-
-            particlesArray[i].position = particle.position;
-            particlesArray[i].color = sf::Color::Green;
+    // FNV-1a over the raw bytes of every particle, so two states hash the
+    // same only if they are bit-identical.
+    static uint64_t hash(const std::vector<Particle>& particles) {
+        uint64_t hash = 0xcbf29ce484222325ull;
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(particles.data());
+        for (size_t i = 0; i < particles.size() * sizeof(Particle); i++) {
+            hash = (hash ^ bytes[i]) * 0x100000001b3ull;
         }
+        return hash;
+    }
 
-        window.draw(particlesArray);
+    // Only the removal half of updateAll, for integrators that move the
+    // particles themselves.
+    static void removeOutOfBounds() {
+        TRACE_ZONE("Particle::removeOutOfBounds");
+        particles.erase(std::remove_if(particles.begin(), particles.end(), isOutOfBounds), particles.end());
     }
 
+    // Draws the particle as a circle. Only used for the handful of particles
+    // under the cursor, so one shape is shared instead of stored per particle.
     void render() {
-        shape.setPosition(position);  
+        static sf::CircleShape shape;
+        shape.setRadius(radius);
+        shape.setPosition(position);
+        shape.setFillColor(sf::Color::Green);
 
         window.draw(shape); 
     }
@@ -98,55 +110,6 @@ struct Particle {
         particles.insert(particles.end(), particlesToAdd.begin(), particlesToAdd.end());
     }
 
-
-    static void uniform_disc(int n) {
-        std::mt19937 rng(0); // Seed for deterministic results
-        std::uniform_real_distribution<float> dist(0.0f, 1.0f);
-        std::uniform_real_distribution<float> angleDist(0.0f, 2.0f * M_PI);
-
-        float inner_radius = 5.0f;
-        float outer_radius = sqrt(static_cast<float>(n)) * 10.0f;
-
-        std::vector<Particle> particleList;
-        float centralMass = 5.0f; // Mass of the central particle
-        
-        // Create the central particle (massive center object)
-        Particle center(sf::Vector2f(config.windowWidth / 2, config.windowHeight / 2),
-                        inner_radius, sf::Vector2f(0.0f, 0.0f));
-        center.mass = centralMass;
-        particleList.push_back(center);
-        
-        // Generate the remaining particles
-        while (particleList.size() < n) {
-            float angle = angleDist(rng);
-            float radius = dist(rng) * (outer_radius - inner_radius) + inner_radius;
-
-            // Calculate position
-            sf::Vector2f pos = sf::Vector2f(std::cos(angle), std::sin(angle)) * radius;
-            pos += sf::Vector2f(config.windowWidth / 2, config.windowHeight / 2);
-
-            // Calculate orbital velocity
-            float r = radius;
-            float v = std::sqrt((config.gravitational_constant * centralMass) / r); // Orbital velocity
-
-            // Velocity is perpendicular to the radial vector
-            sf::Vector2f vel = sf::Vector2f(std::sin(angle), -std::cos(angle)) * (v + 0.80f) ;
-
-            // Create the particle
-            float mass = 1.0f; // Mass of individual particle
-            float particleRadius = cbrt(mass); // Adjust radius based on mass
-            Particle p(pos, particleRadius, vel);
-            p.mass = mass;
-
-            particleList.push_back(p);
-        }
-
-        // Add particles to the main list
-        for (Particle& particle : particleList) {
-            particles.push_back(particle);
-        }
-    }
-
 };
 
 std::vector<Particle> Particle::particles;
@@ -0,0 +1,305 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <thread>
+#include <vector>
+
+#include "Config.hpp"
+#include "FFT.hpp"
+#include "Particle.hpp"
+#include "PerfCounters.hpp"
+#include "Trace.hpp"
+
+/*
+Particle-mesh gravity.
+
+Mass is assigned to a meshSize x meshSize grid over the window (cloud in
+cell or triangular shaped cloud), convolved with the force kernel and the
+resulting field is interpolated back to the particles with the same
+assignment weights, so a particle exerts no force on itself.
+
+The simulation's force law, G m M / (r^2 + softening) along the separation,
+is not the gradient of a 2D Poisson potential, so instead of solving for a
+potential the mesh uses the force law itself as the Green's function:
+
+    F(x) = sum_y rho(y) K(y - x)
+
+done as one zero padded FFT convolution of size 2 * meshSize (no periodic
+images). K's x and y components are packed into one complex kernel, so a
+step costs one forward and one inverse transform.
+
+For TreePM the kernel is split at r_s into a smooth long range part,
+K(r) * erf(r / 2r_s), which the mesh handles, and the short range remainder,
+K(r) * erfc(r / 2r_s), which the quadtree adds for neighbours within
+cutoffSplits * r_s (see Node::calculateForce).
+*/
+struct ParticleMesh {
+    enum class Assignment { CIC, TSC };
+
+    constexpr static float splitCells = 1.25f;     // r_s in mesh cells
+    constexpr static float cutoffSplits = 4.5f;    // erfc(2.25) ~ 0.0015
+
+    static Assignment assignment;
+
+    static int gridSize;
+    static float cellSize;
+    static FFT fft;
+
+    // Transformed kernel and the settings it was built for
+    static std::vector<FFT::Complex> kernel;
+    static float kernelGravitationalConstant;
+    static float kernelSoftening;
+    static float kernelSplitRadius;
+
+    static std::vector<FFT::Complex> work;              // (2 * gridSize)^2
+    static std::vector<std::vector<float>> densities;   // Per thread mass grids
+    static std::vector<sf::Vector2f> field;             // Force per unit mass
+
+    // First cell and weights along one axis for a coordinate in cell units.
+    struct Stencil {
+        int first;
+        int count;
+        float weights[3];
+    };
+
+    static Stencil stencil(float u) {
+        Stencil result;
+        if (assignment == Assignment::TSC) {
+            int nearest = static_cast<int>(std::floor(u));
+            float d = u - (nearest + 0.5f);
+            result.first = nearest - 1;
+            result.count = 3;
+            result.weights[0] = 0.5f * (0.5f - d) * (0.5f - d);
+            result.weights[1] = 0.75f - d * d;
+            result.weights[2] = 0.5f * (0.5f + d) * (0.5f + d);
+        } else {
+            float x = u - 0.5f;
+            int left = static_cast<int>(std::floor(x));
+            float f = x - left;
+            result.first = left;
+            result.count = 2;
+            result.weights[0] = 1.0f - f;
+            result.weights[1] = f;
+        }
+        return result;
+    }
+
+    static int clampCell(int cell) {
+        return std::clamp(cell, 0, gridSize - 1);
+    }
+
+    static float splitRadius() {
+        return splitCells * Config::windowWidth / config.meshSize;
+    }
+
+    static Assignment parseAssignment(const std::string& name) {
+        return name == "tsc" ? Assignment::TSC : Assignment::CIC;
+    }
+
+    template <typename Function>
+    static void parallelFor(size_t count, int numThreads, Function function) {
+        std::vector<std::thread> threads;
+        const size_t chunkSize = (count + numThreads - 1) / numThreads;
+
+        for (int t = 0; t < numThreads; t++) {
+            size_t start = t * chunkSize;
+            size_t end = std::min(start + chunkSize, count);
+            if (start >= end) break;
+
+            threads.emplace_back([&, t, start, end]() {
+                TRACE_ZONE("mesh worker");
+                PERF_ZONE(PerfPhase::Gravity);
+                function(t, start, end);
+            });
+        }
+
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    // Rebuilds the transformed kernel when the grid or the force law changed.
+    static void prepare(float split) {
+        if (gridSize == config.meshSize && kernelSplitRadius == split &&
+            kernelGravitationalConstant == config.gravitational_constant &&
+            kernelSoftening == config.gravitationalSoftening) {
+            return;
+        }
+        TRACE_ZONE("ParticleMesh::prepare");
+
+        gridSize = config.meshSize;
+        cellSize = static_cast<float>(std::max(Config::windowWidth, Config::windowHeight)) / gridSize;
+        kernelGravitationalConstant = config.gravitational_constant;
+        kernelSoftening = config.gravitationalSoftening;
+        kernelSplitRadius = split;
+
+        const int padded = gridSize * 2;
+        fft = FFT(padded);
+        kernel.assign(static_cast<size_t>(padded) * padded, {0.0f, 0.0f});
+        work.assign(kernel.size(), {0.0f, 0.0f});
+        field.assign(static_cast<size_t>(gridSize) * gridSize, {0.0f, 0.0f});
+
+        // Convolution kernel K(-d), offsets past gridSize wrap to negative.
+        for (int row = 0; row < padded; row++) {
+            for (int column = 0; column < padded; column++) {
+                float dx = (column < gridSize ? column : column - padded) * cellSize;
+                float dy = (row < gridSize ? row : row - padded) * cellSize;
+                float distance = std::sqrt(dx * dx + dy * dy);
+                if (distance < Config::particleSize) continue;
+
+                float force = kernelGravitationalConstant / (distance * distance + kernelSoftening);
+                if (split > 0.0f) force *= std::erf(distance / (2.0f * split));
+
+                kernel[static_cast<size_t>(row) * padded + column] =
+                    FFT::Complex(-force * dx / distance, -force * dy / distance);
+            }
+        }
+
+        fft.transform2D(kernel, false, config.threads());
+
+        // Undo the smoothing of assigning and interpolating with the same
+        // window, W(k)^2 per axis. Only the smooth long range kernel is
+        // corrected, the full kernel has too much power at the grid scale.
+        if (split > 0.0f) {
+            const int order = assignment == Assignment::TSC ? 3 : 2;
+            std::vector<float> window(padded);
+            for (int i = 0; i < padded; i++) {
+                int frequency = i < gridSize ? i : i - padded;
+                float x = static_cast<float>(M_PI) * frequency / padded;
+                float sinc = frequency == 0 ? 1.0f : std::sin(x) / x;
+                window[i] = std::pow(sinc, 2 * order);
+            }
+
+            for (int row = 0; row < padded; row++) {
+                for (int column = 0; column < padded; column++) {
+                    kernel[static_cast<size_t>(row) * padded + column] /= window[row] * window[column];
+                }
+            }
+        }
+    }
+
+    // Deterministic runs deposit into this many grids whatever the thread
+    // count, so every cell is summed in the same order.
+    constexpr static int deterministicChunks = 8;
+
+    static void deposit(const std::vector<Particle>& particles, int numThreads) {
+        TRACE_ZONE("ParticleMesh::deposit");
+        const size_t cells = static_cast<size_t>(gridSize) * gridSize;
+        const int chunks = config.deterministic ? deterministicChunks : numThreads;
+        const size_t chunkSize = (particles.size() + chunks - 1) / chunks;
+        densities.resize(chunks);
+        for (auto& density : densities) {
+            density.clear();    // Chunks without particles leave theirs empty
+        }
+
+        parallelFor(chunks, numThreads, [&](int, size_t firstChunk, size_t lastChunk) {
+            for (size_t chunk = firstChunk; chunk < lastChunk; chunk++) {
+                const size_t start = chunk * chunkSize;
+                const size_t end = std::min(start + chunkSize, particles.size());
+                if (start >= end) break;
+
+                std::vector<float>& density = densities[chunk];
+                density.assign(cells, 0.0f);
+
+                for (size_t i = start; i < end; i++) {
+                    const Particle& particle = particles[i];
+                    Stencil sx = stencil(particle.position.x / cellSize);
+                    Stencil sy = stencil(particle.position.y / cellSize);
+
+                    for (int y = 0; y < sy.count; y++) {
+                        size_t row = static_cast<size_t>(clampCell(sy.first + y)) * gridSize;
+                        for (int x = 0; x < sx.count; x++) {
+                            density[row + clampCell(sx.first + x)] += particle.mass * sx.weights[x] * sy.weights[y];
+                        }
+                    }
+                }
+            }
+        });
+
+        // Sum the per thread grids into the top left quarter of the padded grid.
+        const int padded = gridSize * 2;
+        std::fill(work.begin(), work.end(), FFT::Complex(0.0f, 0.0f));
+
+        parallelFor(gridSize, numThreads, [&](int, size_t start, size_t end) {
+            for (size_t row = start; row < end; row++) {
+                for (int column = 0; column < gridSize; column++) {
+                    float mass = 0.0f;
+                    for (const auto& density : densities) {
+                        if (!density.empty()) mass += density[row * gridSize + column];
+                    }
+                    work[row * padded + column] = FFT::Complex(mass, 0.0f);
+                }
+            }
+        });
+    }
+
+    static void solve(int numThreads) {
+        TRACE_ZONE("ParticleMesh::solve");
+        const int padded = gridSize * 2;
+        const float normalization = 1.0f / (static_cast<float>(padded) * padded);
+
+        fft.transform2D(work, false, numThreads);
+        for (size_t i = 0; i < work.size(); i++) {
+            work[i] *= kernel[i];
+        }
+        fft.transform2D(work, true, numThreads);
+
+        for (int row = 0; row < gridSize; row++) {
+            for (int column = 0; column < gridSize; column++) {
+                const FFT::Complex value = work[static_cast<size_t>(row) * padded + column];
+                field[static_cast<size_t>(row) * gridSize + column] =
+                    {value.real() * normalization, value.imag() * normalization};
+            }
+        }
+    }
+
+    static void interpolate(std::vector<Particle>& particles, int numThreads) {
+        TRACE_ZONE("ParticleMesh::interpolate");
+        parallelFor(particles.size(), numThreads, [&](int, size_t start, size_t end) {
+            for (size_t i = start; i < end; i++) {
+                Particle& particle = particles[i];
+                Stencil sx = stencil(particle.position.x / cellSize);
+                Stencil sy = stencil(particle.position.y / cellSize);
+
+                sf::Vector2f force = {0.0f, 0.0f};
+                for (int y = 0; y < sy.count; y++) {
+                    size_t row = static_cast<size_t>(clampCell(sy.first + y)) * gridSize;
+                    for (int x = 0; x < sx.count; x++) {
+                        force += field[row + clampCell(sx.first + x)] * (sx.weights[x] * sy.weights[y]);
+                    }
+                }
+
+                particle.force += force * particle.mass;
+            }
+        });
+    }
+
+    // Adds the mesh force to every particle. With split set only the long
+    // range part is added and the tree is expected to supply the rest.
+    static void update(std::vector<Particle>& particles, bool split) {
+        TRACE_ZONE("ParticleMesh::update");
+        if (config.gravitational_constant == 0.0f || particles.empty()) return;
+
+        const int numThreads = config.threads();
+        prepare(split ? splitRadius() : 0.0f);
+        deposit(particles, numThreads);
+        solve(numThreads);
+        interpolate(particles, numThreads);
+    }
+};
+
+ParticleMesh::Assignment ParticleMesh::assignment = ParticleMesh::Assignment::CIC;
+
+int ParticleMesh::gridSize = 0;
+float ParticleMesh::cellSize = 0.0f;
+FFT ParticleMesh::fft;
+
+std::vector<FFT::Complex> ParticleMesh::kernel;
+float ParticleMesh::kernelGravitationalConstant = 0.0f;
+float ParticleMesh::kernelSoftening = 0.0f;
+float ParticleMesh::kernelSplitRadius = -1.0f;
+
+std::vector<FFT::Complex> ParticleMesh::work;
+std::vector<std::vector<float>> ParticleMesh::densities;
+std::vector<sf::Vector2f> ParticleMesh::field;
@@ -0,0 +1,337 @@
+#pragma once
+
+#include <array>
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "Trace.hpp"
+
+/*
+Hardware performance counters per simulation phase.
+
+Every thread that enters a PERF_ZONE opens its own set of perf_event_open
+counters (user space only, counting from then on) and adds what they moved
+during the zone to its lane, for the zone's phase. Lanes are recycled like
+trace lanes, so the per-frame worker threads add up to a stable set of
+per-worker rows. At the end of each step endFrame() folds the lanes into
+per-phase totals for the HUD and optionally appends them, with the
+per-lane rows, as one JSON line to a file.
+
+    PERF_ZONE(PerfPhase::Collision);
+
+Events the kernel refuses (no PMU in a VM, perf_event_paranoid, ...) are
+reported as null. If none can be opened the counters switch themselves off
+with a message and zones cost a single branch.
+*/
+
+enum class PerfPhase { Gravity, Collision, Integration, Count };
+
+struct PerfCounts {
+    enum Event { Cycles, Instructions, CacheMisses, BranchMisses, LlcLoads, EventCount };
+
+    std::array<uint64_t, EventCount> values = {};
+
+    PerfCounts& operator+=(const PerfCounts& other) {
+        for (int i = 0; i < EventCount; i++) values[i] += other.values[i];
+        return *this;
+    }
+};
+
+struct PerfLane {
+    std::array<int, PerfCounts::EventCount> fds;
+    std::array<PerfCounts, static_cast<int>(PerfPhase::Count)> counts;
+    int lane = 0;
+};
+
+struct PerfCounters {
+    constexpr static int phaseCount = static_cast<int>(PerfPhase::Count);
+
+    static bool enabled;
+    static std::string outputPath;      // JSON lines, empty = HUD only
+    static FILE* output;
+
+    static std::array<bool, PerfCounts::EventCount> isAvailable;
+
+    static std::mutex registryMutex;
+    static std::vector<PerfLane*> lanes;
+    static std::vector<PerfLane*> freeLanes;
+
+    // Last finished step and everything since initialize()
+    static std::array<PerfCounts, phaseCount> lastFrame;
+    static std::array<PerfCounts, phaseCount> totals;
+
+    static const char* phaseName(int phase) {
+        static const char* names[phaseCount] = {"gravity", "collision", "integration"};
+        return names[phase];
+    }
+
+    static const char* eventName(int event) {
+        static const char* names[PerfCounts::EventCount] = {
+            "cycles", "instructions", "cacheMisses", "branchMisses", "llcLoads"};
+        return names[event];
+    }
+
+    static perf_event_attr attributes(int event) {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        switch (event) {
+            case PerfCounts::Cycles:
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.config = PERF_COUNT_HW_CPU_CYCLES;
+                break;
+            case PerfCounts::Instructions:
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+                break;
+            case PerfCounts::CacheMisses:
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.config = PERF_COUNT_HW_CACHE_MISSES;
+                break;
+            case PerfCounts::BranchMisses:
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+                break;
+            default:
+                attr.type = PERF_TYPE_HW_CACHE;
+                attr.config = PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                              (PERF_COUNT_HW_CACHE_RESULT_ACCESS << 16);
+                break;
+        }
+        return attr;
+    }
+
+    // Counts for the calling thread only.
+    static int open(int event) {
+        perf_event_attr attr = attributes(event);
+        return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC));
+    }
+
+    // Reads a counter, scaled up if the kernel had to multiplex it.
+    static uint64_t read(int fd) {
+        uint64_t data[3];   // value, time enabled, time running
+        if (::read(fd, data, sizeof(data)) != sizeof(data) || data[2] == 0) return 0;
+        if (data[2] >= data[1]) return data[0];
+        return static_cast<uint64_t>(static_cast<double>(data[0]) * data[1] / data[2]);
+    }
+
+    // Probes which events the kernel allows. Turns the counters off if
+    // none does.
+    static void initialize(bool enable, const std::string& path = "") {
+        enabled = false;
+        if (!enable) return;
+
+        int lastError = 0;
+        bool anyAvailable = false;
+        for (int event = 0; event < PerfCounts::EventCount; event++) {
+            int fd = open(event);
+            isAvailable[event] = fd >= 0;
+            if (fd >= 0) {
+                anyAvailable = true;
+                close(fd);
+            } else {
+                lastError = errno;
+            }
+        }
+
+        if (!anyAvailable) {
+            std::cerr << "Hardware counters unavailable (" << std::strerror(lastError)
+                      << "), check /proc/sys/kernel/perf_event_paranoid" << std::endl;
+            return;
+        }
+
+        if (!path.empty()) {
+            outputPath = path;
+            output = std::fopen(path.c_str(), "w");
+            if (!output) std::cerr << "Could not open " << path << ", counters go to the HUD only" << std::endl;
+        }
+        enabled = true;
+    }
+
+    static PerfLane* acquireLane() {
+        PerfLane* lane;
+        {
+            std::lock_guard<std::mutex> lock(registryMutex);
+            if (!freeLanes.empty()) {
+                lane = freeLanes.back();
+                freeLanes.pop_back();
+            } else {
+                lane = new PerfLane();
+                lane->lane = static_cast<int>(lanes.size());
+                lanes.push_back(lane);
+            }
+        }
+
+        for (int event = 0; event < PerfCounts::EventCount; event++) {
+            lane->fds[event] = isAvailable[event] ? open(event) : -1;
+        }
+        return lane;
+    }
+
+    static void releaseLane(PerfLane* lane) {
+        for (int& fd : lane->fds) {
+            if (fd >= 0) close(fd);
+            fd = -1;
+        }
+
+        std::lock_guard<std::mutex> lock(registryMutex);
+        freeLanes.push_back(lane);
+    }
+
+    // Returns the calling thread's lane, opening its counters on first use.
+    static PerfLane& local() {
+        struct Owner {
+            PerfLane* lane = acquireLane();
+            ~Owner() { releaseLane(lane); }
+        };
+        thread_local Owner owner;
+        return *owner.lane;
+    }
+
+    static void sample(const PerfLane& lane, PerfCounts& counts) {
+        for (int event = 0; event < PerfCounts::EventCount; event++) {
+            counts.values[event] = lane.fds[event] >= 0 ? read(lane.fds[event]) : 0;
+        }
+    }
+
+    static void writeCounts(const PerfCounts& counts) {
+        std::fprintf(output, "{");
+        for (int event = 0; event < PerfCounts::EventCount; event++) {
+            if (isAvailable[event]) {
+                std::fprintf(output, "\"%s\":%llu", eventName(event),
+                             static_cast<unsigned long long>(counts.values[event]));
+            } else {
+                std::fprintf(output, "\"%s\":null", eventName(event));
+            }
+            std::fprintf(output, event + 1 < PerfCounts::EventCount ? "," : "}");
+        }
+    }
+
+    // Called once per step, after every phase has joined.
+    static void endFrame(uint64_t step) {
+        if (!enabled) return;
+
+        std::array<PerfCounts, phaseCount> frame = {};
+        std::lock_guard<std::mutex> lock(registryMutex);
+
+        if (output) std::fprintf(output, "{\"step\":%llu,\"lanes\":[", static_cast<unsigned long long>(step));
+        for (size_t i = 0; i < lanes.size(); i++) {
+            PerfLane& lane = *lanes[i];
+            if (output) std::fprintf(output, "%s{\"lane\":%d", i ? "," : "", lane.lane);
+
+            for (int phase = 0; phase < phaseCount; phase++) {
+                frame[phase] += lane.counts[phase];
+                if (output) {
+                    std::fprintf(output, ",\"%s\":", phaseName(phase));
+                    writeCounts(lane.counts[phase]);
+                }
+                lane.counts[phase] = PerfCounts();
+            }
+            if (output) std::fprintf(output, "}");
+        }
+
+        if (output) std::fprintf(output, "],\"phases\":{");
+        for (int phase = 0; phase < phaseCount; phase++) {
+            totals[phase] += frame[phase];
+            if (output) {
+                std::fprintf(output, "%s\"%s\":", phase ? "," : "", phaseName(phase));
+                writeCounts(frame[phase]);
+            }
+        }
+        if (output) std::fprintf(output, "}}\n");
+
+        lastFrame = frame;
+    }
+
+    // One HUD / summary line, e.g. "Gravity: IPC 1.52, cache misses 3.1M, ..."
+    static std::string describe(int phase, const PerfCounts& counts) {
+        auto scaled = [](uint64_t value) {
+            char text[32];
+            if (value >= 1000000) std::snprintf(text, sizeof(text), "%.1fM", value / 1e6);
+            else if (value >= 1000) std::snprintf(text, sizeof(text), "%.1fk", value / 1e3);
+            else std::snprintf(text, sizeof(text), "%llu", static_cast<unsigned long long>(value));
+            return std::string(text);
+        };
+        auto field = [&](int event) {
+            return isAvailable[event] ? scaled(counts.values[event]) : std::string("-");
+        };
+
+        std::string text = phaseName(phase);
+        text[0] = static_cast<char>(std::toupper(static_cast<unsigned char>(text[0])));
+
+        char ipc[32] = "-";
+        uint64_t cycles = counts.values[PerfCounts::Cycles];
+        if (isAvailable[PerfCounts::Cycles] && isAvailable[PerfCounts::Instructions] && cycles > 0) {
+            std::snprintf(ipc, sizeof(ipc), "%.2f", static_cast<double>(counts.values[PerfCounts::Instructions]) / cycles);
+        }
+
+        return text + ": IPC " + ipc + ", cache misses " + field(PerfCounts::CacheMisses) +
+               ", LLC loads " + field(PerfCounts::LlcLoads) + ", branch misses " + field(PerfCounts::BranchMisses);
+    }
+
+    static void printSummary() {
+        if (!enabled) return;
+        std::cout << "Hardware counters since startup:" << std::endl;
+        for (int phase = 0; phase < phaseCount; phase++) {
+            std::cout << "  " << describe(phase, totals[phase]) << std::endl;
+        }
+    }
+
+    static void finish() {
+        if (output) std::fclose(output);
+        output = nullptr;
+    }
+};
+
+struct PerfZone {
+    PerfLane* lane = nullptr;
+    int phase;
+    PerfCounts start;
+
+    explicit PerfZone(PerfPhase phase) : phase(static_cast<int>(phase)) {
+        if (!PerfCounters::enabled) return;
+        lane = &PerfCounters::local();
+        PerfCounters::sample(*lane, start);
+    }
+
+    ~PerfZone() {
+        if (!lane) return;
+        PerfCounts end;
+        PerfCounters::sample(*lane, end);
+
+        PerfCounts& counts = lane->counts[phase];
+        for (int event = 0; event < PerfCounts::EventCount; event++) {
+            counts.values[event] += end.values[event] - start.values[event];
+        }
+    }
+};
+
+#define PERF_ZONE(phase) PerfZone TRACE_CONCAT(perfZone, __LINE__)(phase)
+
+bool PerfCounters::enabled = false;
+std::string PerfCounters::outputPath;
+FILE* PerfCounters::output = nullptr;
+
+std::array<bool, PerfCounts::EventCount> PerfCounters::isAvailable = {};
+
+std::mutex PerfCounters::registryMutex;
+std::vector<PerfLane*> PerfCounters::lanes;
+std::vector<PerfLane*> PerfCounters::freeLanes;
+
+std::array<PerfCounts, PerfCounters::phaseCount> PerfCounters::lastFrame = {};
+std::array<PerfCounts, PerfCounters::phaseCount> PerfCounters::totals = {};
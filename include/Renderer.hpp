@@ -1,9 +1,13 @@
 #pragma once
 
 #include <SFML/Graphics.hpp>
+#include "Camera.hpp"
 #include "Config.hpp"
+#include "FrameGovernor.hpp"
+#include "FrameSnapshot.hpp"
 #include "InputManger.hpp"
 #include "LiveText.hpp"
+#include "TextManager.hpp"
 
 struct Renderer {
     static sf::Clock frameTimer;
@@ -11,13 +15,23 @@ struct Renderer {
     static int frameCount;
     static int totalRenderTimeUs;
 
-    static void render() {
+    // Snapshot being drawn, also read by the HUD text.
+    static const FrameSnapshot* frame;
+
+    static void render(const FrameSnapshot& snapshot) {
+        TRACE_ZONE("Renderer::render");
         frameTimer.restart();
+        frame = &snapshot;
+
+        TextManager::update();
         window.clear(sf::Color::Black);
 
         // quadTree.render();
+        window.setView(Camera::view());
         InputManager::renderAll();
-        Particle::renderAll();
+        renderParticles(snapshot);
+
+        window.setView(window.getDefaultView());
         TextManager::render();
 
 
@@ -26,9 +40,29 @@ struct Renderer {
         handleTimer();
     }
 
+    static void renderParticles(const FrameSnapshot& snapshot) {
+        TRACE_ZONE("Renderer::renderParticles");
+        sf::VertexArray particlesArray(sf::Points, snapshot.positions.size());
+
+        for (size_t i = 0; i < snapshot.positions.size(); ++i) {
+            particlesArray[i].position = snapshot.positions[i];
+            particlesArray[i].color = sf::Color::Green;
+        }
+
+        // Aggregated tree nodes are tinted towards white by the mass they stand for.
+        for (size_t i = 0; i < snapshot.masses.size(); ++i) {
+            if (snapshot.masses[i] <= 1.0f) continue;
+            sf::Uint8 tint = static_cast<sf::Uint8>(std::min(255.0f, std::log2(snapshot.masses[i]) * 32.0f));
+            particlesArray[i].color = sf::Color(tint, 255, tint);
+        }
+
+        window.draw(particlesArray);
+    }
+
     static void handleTimer() {
         int currentFrameTime = frameTimer.getElapsedTime().asMicroseconds();
         totalRenderTimeUs += currentFrameTime;
+        FrameGovernor::renderTimeUs.store(currentFrameTime, std::memory_order_relaxed);
         frameCount++;
 
         // Update every N frames (e.g., every 60 frames)
@@ -43,4 +77,7 @@ struct Renderer {
 int Renderer::renderTimeUs = 0;
 int Renderer::frameCount = 0;
 int Renderer::totalRenderTimeUs = 0;
-sf::Clock Renderer::frameTimer;
\ No newline at end of file
+sf::Clock Renderer::frameTimer;
+
+FrameSnapshot emptyFrame;
+const FrameSnapshot* Renderer::frame = &emptyFrame;
\ No newline at end of file
@@ -0,0 +1,421 @@
+#pragma once
+
+#include <SFML/Graphics.hpp>
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Config.hpp"
+#include "FrameSnapshot.hpp"
+#include "Trace.hpp"
+#include "TrajectoryWriter.hpp"
+
+/*
+Read side of the trajectory format written by TrajectoryWriter. The index
+and the chunks are mapped, never read into memory, so the recording can be
+far larger than RAM: the kernel pages in what is decoded and drops it again
+under pressure. Chunks are mapped on first use.
+*/
+struct TrajectoryReader {
+    struct Mapping {
+        void* data = nullptr;
+        size_t length = 0;
+    };
+
+    std::string directory;
+    const TrajectoryIndexHeader* header = nullptr;
+    const TrajectoryIndexEntry* entries = nullptr;
+    uint32_t frameCount = 0;
+
+    Mapping index;
+    std::vector<Mapping> chunks;
+
+    TrajectoryReader() = default;
+    TrajectoryReader(const TrajectoryReader&) = delete;
+    TrajectoryReader& operator=(const TrajectoryReader&) = delete;
+
+    ~TrajectoryReader() {
+        close();
+    }
+
+    static Mapping map(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) throw std::runtime_error("Could not open " + path);
+
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size == 0) {
+            ::close(fd);
+            throw std::runtime_error("Empty trajectory file: " + path);
+        }
+
+        Mapping mapping;
+        mapping.length = static_cast<size_t>(info.st_size);
+        mapping.data = mmap(nullptr, mapping.length, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+
+        if (mapping.data == MAP_FAILED) throw std::runtime_error("Could not map " + path);
+        return mapping;
+    }
+
+    static void unmap(Mapping& mapping) {
+        if (mapping.data) munmap(mapping.data, mapping.length);
+        mapping = Mapping();
+    }
+
+    void open(const std::string& path) {
+        close();
+        directory = path;
+        index = map(path + "/frames.idx");
+
+        header = static_cast<const TrajectoryIndexHeader*>(index.data);
+        if (index.length < sizeof(TrajectoryIndexHeader) ||
+            std::memcmp(header->magic, TrajectoryWriter::magic, sizeof(TrajectoryWriter::magic)) != 0 ||
+            header->version != TrajectoryWriter::version) {
+            close();
+            throw std::runtime_error("Not a version " + std::to_string(TrajectoryWriter::version) + " trajectory: " + path);
+        }
+
+        entries = reinterpret_cast<const TrajectoryIndexEntry*>(static_cast<const char*>(index.data) + sizeof(TrajectoryIndexHeader));
+        frameCount = static_cast<uint32_t>((index.length - sizeof(TrajectoryIndexHeader)) / sizeof(TrajectoryIndexEntry));
+        if (frameCount == 0) {
+            close();
+            throw std::runtime_error("Trajectory has no frames: " + path);
+        }
+
+        chunks.assign(entries[frameCount - 1].chunk + 1, Mapping());
+    }
+
+    void close() {
+        for (Mapping& chunk : chunks) {
+            unmap(chunk);
+        }
+        chunks.clear();
+        unmap(index);
+        header = nullptr;
+        entries = nullptr;
+        frameCount = 0;
+    }
+
+    const Mapping& chunk(uint32_t number) {
+        if (number >= chunks.size()) throw std::runtime_error("Trajectory chunk " + std::to_string(number) + " is out of range");
+        Mapping& mapping = chunks[number];
+        if (!mapping.data) {
+            char name[32];
+            std::snprintf(name, sizeof(name), "/chunk_%05u.trj", number);
+            mapping = map(directory + name);
+            madvise(mapping.data, mapping.length, MADV_SEQUENTIAL);
+        }
+        return mapping;
+    }
+
+    // Start of the frame's encoded bytes, with their end in `end`. Valid
+    // until close().
+    const uint8_t* frameData(uint32_t frame, const uint8_t*& end) {
+        const TrajectoryIndexEntry& entry = entries[frame];
+        const Mapping& mapping = chunk(entry.chunk);
+        if (entry.offset > mapping.length || entry.bytes > mapping.length - entry.offset) {
+            throw std::runtime_error("Trajectory frame " + std::to_string(frame) + " lies past the end of its chunk");
+        }
+        const uint8_t* data = static_cast<const uint8_t*>(mapping.data) + entry.offset;
+        end = data + entry.bytes;
+        return data;
+    }
+
+    // Asks the kernel to start reading a chunk in the background.
+    void prefetch(uint32_t number) {
+        if (number >= chunks.size()) return;
+        const Mapping& mapping = chunk(number);
+        madvise(mapping.data, mapping.length, MADV_WILLNEED);
+    }
+};
+
+/*
+Plays a recorded trajectory (--replay <dir>) through the normal Renderer
+and HUD instead of simulating.
+
+The viewer only moves a playhead. A prefetch thread decodes the frames
+from the playhead up to prefetchFrames ahead into FrameSnapshots and drops
+the ones that fell out of that window, so playback never waits for the
+disk or the decoder unless it outruns them, in which case the newest
+decoded frame before the playhead is shown. Playing on from a decoded
+frame costs one delta frame; a seek costs decoding from the frame's
+keyframe, at most framesPerChunk frames. Only the position channels are
+decoded.
+
+    Space           play / pause
+    , / .           one frame back / forward
+    [ / ]           half / double speed (1x = the recorded run's real time)
+    0 - 9           jump to 0% - 90% of the recording, End to the last frame
+    scroll          scrub by 1% per notch (Ctrl + scroll still zooms)
+*/
+struct Replay {
+    constexpr static uint32_t prefetchFrames = 16;
+    constexpr static float maxSpeed = 256.0f;
+    constexpr static float minSpeed = 1.0f / 16.0f;
+
+    static TrajectoryReader reader;
+    static bool active;
+
+    // Viewer state, render thread only
+    static double playhead;
+    static float speed;
+    static bool isPlaying;
+    static sf::Clock clock;
+    static std::shared_ptr<FrameSnapshot> current;
+
+    // Shared with the prefetch thread
+    static std::mutex cacheMutex;
+    static std::condition_variable targetChanged;
+    static std::map<uint32_t, std::shared_ptr<FrameSnapshot>> cache;
+    static uint32_t target;
+    static bool isStopping;
+    static std::thread prefetcher;
+
+    // Decoder state, prefetch thread only
+    static std::vector<int32_t> positionX;
+    static std::vector<int32_t> positionY;
+    static int64_t decoded;     // Frame held in positionX/Y, -1 for none
+
+    static bool isActive() {
+        return active;
+    }
+
+    static void open(const std::string& directory) {
+        reader.open(directory);
+        playhead = 0.0;
+        target = 0;
+        decoded = -1;
+        isPlaying = true;
+        isStopping = false;
+        current = std::make_shared<FrameSnapshot>();
+        active = true;
+        prefetcher = std::thread(prefetch);
+        clock.restart();
+    }
+
+    static void close() {
+        if (!active) return;
+        {
+            std::lock_guard<std::mutex> lock(cacheMutex);
+            isStopping = true;
+        }
+        targetChanged.notify_one();
+        prefetcher.join();
+
+        cache.clear();
+        current.reset();
+        reader.close();
+        active = false;
+    }
+
+    // Recorded frames per second of real time at speed 1.
+    static double framesPerSecond() {
+        uint32_t last = reader.frameCount - 1;
+        if (last == 0) return Config::FPS;
+        double stepsPerFrame = static_cast<double>(reader.entries[last].step - reader.entries[0].step) / last;
+        return Config::FPS / std::max(1.0, stepsPerFrame);
+    }
+
+    static void seek(double frame) {
+        playhead = std::clamp(frame, 0.0, static_cast<double>(reader.frameCount - 1));
+    }
+
+    // Called once per displayed frame: moves the playhead and picks the
+    // frame to draw.
+    static void update() {
+        double elapsed = clock.restart().asSeconds();
+        if (isPlaying) {
+            seek(playhead + elapsed * framesPerSecond() * speed);
+            if (playhead >= reader.frameCount - 1) isPlaying = false;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(cacheMutex);
+            target = static_cast<uint32_t>(playhead);
+
+            auto found = cache.upper_bound(target);
+            if (found != cache.begin()) current = std::prev(found)->second;
+        }
+        targetChanged.notify_one();
+
+        current->isPaused = !isPlaying;
+    }
+
+    static const FrameSnapshot& frame() {
+        return *current;
+    }
+
+    // Keys from InputManager. Returns false for keys replay does not use.
+    static bool handleKey(sf::Keyboard::Key key) {
+        if (key >= sf::Keyboard::Num0 && key <= sf::Keyboard::Num9) {
+            seek((key - sf::Keyboard::Num0) * 0.1 * (reader.frameCount - 1));
+            return true;
+        }
+
+        switch (key) {
+            case sf::Keyboard::Space:
+                if (!isPlaying && playhead >= reader.frameCount - 1) seek(0.0);
+                isPlaying = !isPlaying;
+                return true;
+            case sf::Keyboard::Period:
+                isPlaying = false;
+                seek(std::floor(playhead) + 1.0);
+                return true;
+            case sf::Keyboard::Comma:
+                isPlaying = false;
+                seek(std::floor(playhead) - 1.0);
+                return true;
+            case sf::Keyboard::RBracket:
+                speed = std::min(maxSpeed, speed * 2.0f);
+                return true;
+            case sf::Keyboard::LBracket:
+                speed = std::max(minSpeed, speed / 2.0f);
+                return true;
+            case sf::Keyboard::End:
+                seek(reader.frameCount - 1);
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    static void scrub(float notches) {
+        seek(playhead + notches * std::max(1.0, reader.frameCount / 100.0));
+    }
+
+    static std::string describe() {
+        const FrameSnapshot& shown = *current;
+        char text[128];
+        std::snprintf(text, sizeof(text), "Replay: frame %u / %u, step %llu, %gx",
+                      static_cast<uint32_t>(playhead) + 1, reader.frameCount,
+                      static_cast<unsigned long long>(shown.step), speed);
+        return text;
+    }
+
+    // First frame of the window around the target that is not decoded yet,
+    // or -1. Called with cacheMutex held.
+    static int64_t nextMissing() {
+        uint32_t end = std::min(reader.frameCount, target + prefetchFrames);
+        for (uint32_t frame = target; frame < end; frame++) {
+            if (!cache.count(frame)) return frame;
+        }
+        return -1;
+    }
+
+    static bool isWanted(uint32_t frame) {
+        return frame >= target && frame < target + prefetchFrames;
+    }
+
+    static void prefetch() {
+        while (true) {
+            int64_t next;
+            {
+                std::unique_lock<std::mutex> lock(cacheMutex);
+                targetChanged.wait(lock, [] { return isStopping || nextMissing() >= 0; });
+                if (isStopping) return;
+                next = nextMissing();
+
+                // Keep the frame on screen until the next one is there.
+                for (auto it = cache.begin(); it != cache.end();) {
+                    if (!isWanted(it->first) && it->second != current) it = cache.erase(it);
+                    else ++it;
+                }
+            }
+
+            try {
+                decodeTo(static_cast<uint32_t>(next));
+            } catch (const std::exception& error) {
+                std::cerr << error.what() << std::endl;
+                std::lock_guard<std::mutex> lock(cacheMutex);
+                cache[static_cast<uint32_t>(next)] = std::make_shared<FrameSnapshot>();
+            }
+        }
+    }
+
+    // Decodes forward to `frame`, continuing from the last decoded frame when
+    // it is on the way and from the keyframe otherwise.
+    static void decodeTo(uint32_t frame) {
+        TRACE_ZONE("Replay::decodeTo");
+        const TrajectoryIndexEntry& entry = reader.entries[frame];
+        uint32_t start = entry.keyframe;
+        if (decoded >= static_cast<int64_t>(entry.keyframe) && decoded < frame) {
+            start = static_cast<uint32_t>(decoded + 1);
+        }
+
+        for (uint32_t f = start; f <= frame; f++) {
+            decodeFrame(f);
+
+            std::lock_guard<std::mutex> lock(cacheMutex);
+            if (isStopping) return;
+            if (isWanted(f) && !cache.count(f)) cache[f] = makeSnapshot(f);
+            if (!isWanted(frame)) return;   // Scrubbed away meanwhile
+        }
+    }
+
+    static void decodeFrame(uint32_t frame) {
+        const TrajectoryIndexEntry& entry = reader.entries[frame];
+        const bool isDelta = frame != entry.keyframe;
+        if (isDelta && decoded != static_cast<int64_t>(frame) - 1) {
+            throw std::runtime_error("Trajectory frame " + std::to_string(frame) + " decoded out of order");
+        }
+
+        // Read the next chunk ahead while this one is being decoded.
+        if (frame == 0 || reader.entries[frame - 1].chunk != entry.chunk) reader.prefetch(entry.chunk + 1);
+
+        const uint8_t* end = nullptr;
+        const uint8_t* in = reader.frameData(frame, end);
+        positionX.resize(entry.count);
+        positionY.resize(entry.count);
+        in = TrajectoryCodec::decodeChannel(in, end, positionX.data(), entry.count, isDelta);
+        TrajectoryCodec::decodeChannel(in, end, positionY.data(), entry.count, isDelta);
+        decoded = frame;
+    }
+
+    static std::shared_ptr<FrameSnapshot> makeSnapshot(uint32_t frame) {
+        auto snapshot = std::make_shared<FrameSnapshot>();
+        const float scale = 1.0f / reader.header->positionScale;
+        const size_t count = positionX.size();
+
+        snapshot->positions.resize(count);
+        for (size_t i = 0; i < count; i++) {
+            snapshot->positions[i] = sf::Vector2f(positionX[i] * scale, positionY[i] * scale);
+        }
+        snapshot->particleCount = count;
+        snapshot->step = reader.entries[frame].step;
+        return snapshot;
+    }
+};
+
+TrajectoryReader Replay::reader;
+bool Replay::active = false;
+
+double Replay::playhead = 0.0;
+float Replay::speed = 1.0f;
+bool Replay::isPlaying = true;
+sf::Clock Replay::clock;
+std::shared_ptr<FrameSnapshot> Replay::current;
+
+std::mutex Replay::cacheMutex;
+std::condition_variable Replay::targetChanged;
+std::map<uint32_t, std::shared_ptr<FrameSnapshot>> Replay::cache;
+uint32_t Replay::target = 0;
+bool Replay::isStopping = false;
+std::thread Replay::prefetcher;
+
+std::vector<int32_t> Replay::positionX;
+std::vector<int32_t> Replay::positionY;
+int64_t Replay::decoded = -1;
@@ -0,0 +1,411 @@
+#pragma once
+
+#include <SFML/Graphics.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "Config.hpp"
+#include "Particle.hpp"
+#include "Trace.hpp"
+
+// Particles moving as one: a center of mass, a mass, a moment of inertia and
+// an orientation. Member positions are kept in the body's frame.
+struct RigidBody {
+    sf::Vector2f position;              // Center of mass
+    sf::Vector2f velocity;              // Per step, like Particle::velocity
+    sf::Vector2f force;                 // From the last gravity evaluation
+    int rung = 0;                       // See BlockTimesteps
+
+    float angle = 0.0f;                 // Radians
+    float angularVelocity = 0.0f;       // Radians per step
+    float mass = 0.0f;
+    float inertia = 0.0f;
+    float radius = 0.0f;                // Farthest member from the center of mass
+
+    std::vector<Particle> members;      // Positions relative to the center of mass at angle 0
+    std::vector<uint32_t> surface;      // Members that can touch anything outside the body
+
+    // Turns a member's offset into the world frame, given the cosine and
+    // sine of `angle`.
+    static sf::Vector2f rotate(sf::Vector2f offset, float c, float s) {
+        return {c * offset.x - s * offset.y, s * offset.x + c * offset.y};
+    }
+
+    // Velocity of the point `arm` away from the center of mass.
+    static sf::Vector2f pointVelocity(sf::Vector2f velocity, float angularVelocity, sf::Vector2f arm) {
+        return velocity + sf::Vector2f(-arm.y, arm.x) * angularVelocity;
+    }
+};
+
+/*
+Rigid bodies made of many particles. Their members are not in
+Particle::particles, so pairs inside a body are never looked at and
+everything else sees a body through stand-in particles that only exist
+during a step:
+
+    beginStep           one particle per body, at its center of mass with its
+                        total mass, goes to the end of Particle::particles.
+                        Gravity treats it like any other particle, so a body
+                        costs one force evaluation whichever solver runs, and
+                        the integrator moves it.
+    attachSurfaces      for the collision phase, one particle per surface
+                        member is added behind those, moving with the body at
+                        that point.
+    detachSurfaces      the velocity change the grid (and SweptCollisions)
+                        gave each surface particle becomes an impulse on the
+                        body, which changes its velocity and spin.
+    endStep             the bodies read their new position and velocity back
+                        from their particles, turn, and the particles go.
+
+Collisions skip pairs of one body and do not see the center particles. A
+surface particle carries the body's effective mass at that point, 1 / (1/M
++ r^2/I), so a light particle bounces off a heavy body and not off a single
+member. Torque from gravity (tides) is left out. Bodies whose center leaves
+the window are removed with it.
+
+Rigid bodies keep the phase by phase path with the plain grid and pause
+merging, since those reorder or index the particles across a step.
+Snapshots and trajectories record the members as free particles, and
+distributed runs (--ranks) free them before partitioning.
+*/
+struct RigidBodies {
+    static std::vector<RigidBody> bodies;
+
+    // During a step: [firstBody, firstSurface) are the centers of the bodies,
+    // [firstSurface, end) their surface members in the collision phase.
+    static size_t firstBody;
+    static size_t firstSurface;
+    static std::vector<uint32_t> owners;            // Body of each particle from firstBody on
+    static std::vector<sf::Vector2f> arms;          // Per surface particle
+    static std::vector<sf::Vector2f> attachedVelocities;
+    static std::vector<uint8_t> isLeaving;          // Per body, out of bounds before integration
+
+    static bool isActive() {
+        return !bodies.empty();
+    }
+
+    static size_t memberCount() {
+        size_t count = 0;
+        for (const RigidBody& body : bodies) {
+            count += body.members.size();
+        }
+        return count;
+    }
+
+    static void clear() {
+        bodies.clear();
+        owners.clear();
+        firstBody = firstSurface = 0;
+    }
+
+    // True for the center particles, which stay out of the collision grid.
+    static bool isCenter(size_t index) {
+        return index >= firstBody && index < firstSurface;
+    }
+
+    // True if both particles stand in for the same body.
+    static bool isSameBody(const Particle* base, const Particle* a, const Particle* b) {
+        if (owners.empty()) return false;
+        size_t i = static_cast<size_t>(a - base);
+        size_t j = static_cast<size_t>(b - base);
+        if (i < firstBody || j < firstBody) return false;
+        return owners[i - firstBody] == owners[j - firstBody];
+    }
+
+    /*
+    Makes a body of `members`, given with world positions and velocities,
+    plus `velocity` for all of them. The body keeps their momentum and
+    angular momentum.
+    */
+    static void create(std::vector<Particle> members, sf::Vector2f velocity = {0.0f, 0.0f}) {
+        if (members.empty()) return;
+
+        RigidBody body;
+        sf::Vector2f momentum;
+        for (Particle& member : members) {
+            member.velocity += velocity;
+            body.mass += member.mass;
+            body.position += member.position * member.mass;
+            momentum += member.velocity * member.mass;
+        }
+        body.position /= body.mass;
+        body.velocity = momentum / body.mass;
+
+        float angularMomentum = 0.0f;
+        for (Particle& member : members) {
+            sf::Vector2f arm = member.position - body.position;
+            sf::Vector2f relative = member.velocity - body.velocity;
+            body.inertia += member.mass * (arm.x * arm.x + arm.y * arm.y + 0.5f * member.radius * member.radius);
+            angularMomentum += member.mass * (arm.x * relative.y - arm.y * relative.x);
+            body.radius = std::max(body.radius, std::sqrt(arm.x * arm.x + arm.y * arm.y) + member.radius);
+
+            member.position = arm;
+            member.velocity = {0.0f, 0.0f};
+            member.force = {0.0f, 0.0f};
+        }
+        body.inertia = std::max(body.inertia, Config::epsilon);
+        body.angularVelocity = angularMomentum / body.inertia;
+
+        body.members = std::move(members);
+        body.surface = findSurface(body.members);
+        bodies.push_back(std::move(body));
+    }
+
+    // A member is inside if other members surround it: within twice the
+    // typical spacing there is one in each of eight directions.
+    static std::vector<uint32_t> findSurface(const std::vector<Particle>& members) {
+        const size_t n = members.size();
+        std::vector<uint32_t> surface;
+        if (n <= 8) {
+            for (uint32_t i = 0; i < n; i++) {
+                surface.push_back(i);
+            }
+            return surface;
+        }
+
+        sf::Vector2f low = members[0].position;
+        sf::Vector2f high = low;
+        for (const Particle& member : members) {
+            low.x = std::min(low.x, member.position.x);
+            low.y = std::min(low.y, member.position.y);
+            high.x = std::max(high.x, member.position.x);
+            high.y = std::max(high.y, member.position.y);
+        }
+
+        // Members in buckets about one spacing wide
+        const float cell = std::max({Config::epsilon, std::sqrt((high.x - low.x) * (high.y - low.y) / n),
+                                     std::max(high.x - low.x, high.y - low.y) / n});
+        const int columns = static_cast<int>((high.x - low.x) / cell) + 1;
+        const int rows = static_cast<int>((high.y - low.y) / cell) + 1;
+        std::vector<std::vector<uint32_t>> buckets(static_cast<size_t>(columns) * rows);
+        auto bucketOf = [&](sf::Vector2f position, int& column, int& row) {
+            column = std::min(columns - 1, static_cast<int>((position.x - low.x) / cell));
+            row = std::min(rows - 1, static_cast<int>((position.y - low.y) / cell));
+        };
+        for (uint32_t i = 0; i < n; i++) {
+            int column, row;
+            bucketOf(members[i].position, column, row);
+            buckets[static_cast<size_t>(row) * columns + column].push_back(i);
+        }
+
+        auto forNeighbours = [&](uint32_t i, float range, auto visit) {
+            int column, row;
+            bucketOf(members[i].position, column, row);
+            const int reach = static_cast<int>(std::ceil(range / cell));
+            for (int r = std::max(0, row - reach); r <= std::min(rows - 1, row + reach); r++) {
+                for (int c = std::max(0, column - reach); c <= std::min(columns - 1, column + reach); c++) {
+                    for (uint32_t j : buckets[static_cast<size_t>(r) * columns + c]) {
+                        if (j == i) continue;
+                        sf::Vector2f offset = members[j].position - members[i].position;
+                        float distanceSquared = offset.x * offset.x + offset.y * offset.y;
+                        if (distanceSquared <= range * range) visit(offset, distanceSquared);
+                    }
+                }
+            }
+        };
+
+        // Typical spacing: the median distance to the nearest member
+        std::vector<float> nearest(n, 2.0f * cell);
+        for (uint32_t i = 0; i < n; i++) {
+            forNeighbours(i, 2.0f * cell, [&](sf::Vector2f, float distanceSquared) {
+                nearest[i] = std::min(nearest[i], std::sqrt(distanceSquared));
+            });
+        }
+        std::nth_element(nearest.begin(), nearest.begin() + n / 2, nearest.end());
+        const float range = 2.0f * nearest[n / 2];
+
+        for (uint32_t i = 0; i < n; i++) {
+            uint32_t directions = 0;
+            forNeighbours(i, range, [&](sf::Vector2f offset, float) {
+                float angle = std::atan2(offset.y, offset.x) + static_cast<float>(M_PI);
+                int sector = static_cast<int>(angle * (4.0f / static_cast<float>(M_PI))) & 7;
+                directions |= 1u << sector;
+            });
+            if (directions != 0xff) surface.push_back(i);
+        }
+        return surface;
+    }
+
+    // Adds a center particle per body to the end of `particles`. Room for
+    // the surface particles and the recorded members is reserved up front,
+    // so nothing built on the particles this step (the tree) sees them move.
+    static void beginStep(std::vector<Particle>& particles) {
+        owners.clear();
+        firstBody = firstSurface = particles.size();
+        if (bodies.empty()) return;
+        isLeaving.assign(bodies.size(), 0);
+
+        size_t surfaceCount = 0;
+        for (const RigidBody& body : bodies) {
+            surfaceCount += body.surface.size();
+        }
+        particles.reserve(particles.size() + bodies.size() + std::max(surfaceCount, memberCount()));
+
+        for (uint32_t b = 0; b < bodies.size(); b++) {
+            const RigidBody& body = bodies[b];
+            Particle center;
+            center.position = body.position;
+            center.velocity = body.velocity;
+            center.force = body.force;
+            center.mass = body.mass;
+            center.radius = body.radius;
+            center.rung = body.rung;
+            particles.push_back(center);
+            owners.push_back(b);
+        }
+        firstSurface = particles.size();
+    }
+
+    static void attachSurfaces(std::vector<Particle>& particles) {
+        if (bodies.empty()) return;
+        TRACE_ZONE("RigidBodies::attachSurfaces");
+        firstSurface = particles.size();
+        arms.clear();
+        attachedVelocities.clear();
+
+        for (uint32_t b = 0; b < bodies.size(); b++) {
+            const RigidBody& body = bodies[b];
+            const Particle& center = particles[firstBody + b];
+            const float c = std::cos(body.angle);
+            const float s = std::sin(body.angle);
+
+            for (uint32_t index : body.surface) {
+                const Particle& member = body.members[index];
+                sf::Vector2f arm = RigidBody::rotate(member.position, c, s);
+                float armSquared = arm.x * arm.x + arm.y * arm.y;
+
+                Particle particle;
+                particle.position = center.position + arm;
+                particle.velocity = RigidBody::pointVelocity(center.velocity, body.angularVelocity, arm);
+                particle.mass = 1.0f / (1.0f / body.mass + armSquared / body.inertia);
+                particle.radius = member.radius;
+                particles.push_back(particle);
+
+                owners.push_back(b);
+                arms.push_back(arm);
+                attachedVelocities.push_back(particle.velocity);
+            }
+        }
+    }
+
+    // Turns what the collision phase did to the surface particles into
+    // impulses on the bodies, and removes the surface particles.
+    static void detachSurfaces(std::vector<Particle>& particles) {
+        if (bodies.empty()) return;
+        TRACE_ZONE("RigidBodies::detachSurfaces");
+
+        std::vector<sf::Vector2f> impulses(bodies.size());
+        std::vector<float> angularImpulses(bodies.size(), 0.0f);
+        std::vector<uint8_t> isTouched(bodies.size(), 0);
+        for (size_t k = 0; k < arms.size(); k++) {
+            const Particle& particle = particles[firstSurface + k];
+            if (particle.velocity == attachedVelocities[k]) continue;
+
+            uint32_t b = owners[firstSurface - firstBody + k];
+            sf::Vector2f impulse = (particle.velocity - attachedVelocities[k]) * particle.mass;
+            impulses[b] += impulse;
+            angularImpulses[b] += arms[k].x * impulse.y - arms[k].y * impulse.x;
+            isTouched[b] = 1;
+        }
+
+        particles.resize(firstSurface);
+        owners.resize(firstSurface - firstBody);
+
+        for (size_t b = 0; b < bodies.size(); b++) {
+            Particle& center = particles[firstBody + b];
+            center.velocity += impulses[b] / bodies[b].mass;
+            bodies[b].angularVelocity += angularImpulses[b] / bodies[b].inertia;
+
+            // Forces add up from step to step; a contact damps them as
+            // Solver::resolve_collision does for a particle.
+            if (isTouched[b] && !config.blockTimesteps) center.force = -center.force * 0.5f;
+            isLeaving[b] = Particle::isOutOfBounds(center);
+        }
+    }
+
+    // After integration: the integrator kept the centers in order at the end
+    // of `particles` and removed those of the leaving bodies.
+    static void endStep(std::vector<Particle>& particles) {
+        if (bodies.empty()) return;
+
+        size_t kept = 0;
+        size_t remaining = static_cast<size_t>(std::count(isLeaving.begin(), isLeaving.end(), 0));
+        size_t first = particles.size() - remaining;
+        for (size_t b = 0; b < bodies.size(); b++) {
+            if (isLeaving[b]) continue;
+
+            RigidBody& body = bodies[b];
+            const Particle& center = particles[first + kept];
+            body.position = center.position;
+            body.velocity = center.velocity;
+            body.force = center.force;
+            body.rung = center.rung;
+            body.angle = std::remainder(body.angle + body.angularVelocity, 2.0f * static_cast<float>(M_PI));
+            if (kept != b) bodies[kept] = std::move(body);
+            kept++;
+        }
+        bodies.resize(kept);
+
+        particles.resize(first);
+        owners.clear();
+        firstBody = firstSurface = particles.size();
+    }
+
+    // Appends every member as a free particle, for output that expects
+    // plain particles.
+    static void appendMembers(std::vector<Particle>& particles) {
+        for (const RigidBody& body : bodies) {
+            const float c = std::cos(body.angle);
+            const float s = std::sin(body.angle);
+            for (const Particle& member : body.members) {
+                sf::Vector2f arm = RigidBody::rotate(member.position, c, s);
+                Particle particle = member;
+                particle.position = body.position + arm;
+                particle.velocity = RigidBody::pointVelocity(body.velocity, body.angularVelocity, arm);
+                particles.push_back(particle);
+            }
+        }
+    }
+
+    // Turns every body back into free particles.
+    static void release(std::vector<Particle>& particles) {
+        appendMembers(particles);
+        clear();
+    }
+
+    // Runs `output` with the members appended to Particle::particles.
+    template <typename Function>
+    static void withMembers(Function output) {
+        if (bodies.empty()) {
+            output();
+            return;
+        }
+
+        std::vector<Particle>& particles = Particle::particles;
+        const size_t count = particles.size();
+        appendMembers(particles);
+        output();
+        particles.resize(count);
+    }
+
+    static void appendPositions(std::vector<sf::Vector2f>& positions, std::vector<float>* masses) {
+        for (const RigidBody& body : bodies) {
+            const float c = std::cos(body.angle);
+            const float s = std::sin(body.angle);
+            for (const Particle& member : body.members) {
+                positions.push_back(body.position + RigidBody::rotate(member.position, c, s));
+                if (masses) masses->push_back(member.mass);
+            }
+        }
+    }
+};
+
+std::vector<RigidBody> RigidBodies::bodies;
+size_t RigidBodies::firstBody = 0;
+size_t RigidBodies::firstSurface = 0;
+std::vector<uint32_t> RigidBodies::owners;
+std::vector<sf::Vector2f> RigidBodies::arms;
+std::vector<sf::Vector2f> RigidBodies::attachedVelocities;
+std::vector<uint8_t> RigidBodies::isLeaving;
@@ -0,0 +1,291 @@
+#pragma once
+
+#include <SFML/Graphics.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Config.hpp"
+#include "Particle.hpp"
+#include "RigidBodies.hpp"
+#include "Trace.hpp"
+
+// Counter based random numbers. Every particle draws from its own stream
+// (seed, particle index), so the output does not depend on which thread
+// generated it or how the work was split.
+struct CounterRng {
+    uint64_t key;
+    uint32_t counter = 0;
+
+    CounterRng(uint64_t seed, uint64_t stream) : key(mix(seed ^ mix(stream + 0x9e3779b97f4a7c15ull))) {}
+
+    // SplitMix64 finalizer
+    static uint64_t mix(uint64_t x) {
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+        return x ^ (x >> 31);
+    }
+
+    // Uniform in [0, 1)
+    float uniform() {
+        uint64_t bits = mix(key + 0x9e3779b97f4a7c15ull * ++counter);
+        return static_cast<float>(bits >> 40) * (1.0f / 16777216.0f);
+    }
+
+    float uniform(float min, float max) {
+        return min + uniform() * (max - min);
+    }
+
+    float angle() {
+        return uniform() * 2.0f * static_cast<float>(M_PI);
+    }
+};
+
+/*
+Initial conditions for large runs.
+
+Generators resize Particle::particles once and then fill disjoint index
+ranges on every core, writing each particle in place. Particle i is always
+produced by the same random stream, so the result is identical for any
+thread count.
+*/
+struct Scenarios {
+    constexpr static float particleMass = 1.0f;
+
+    // Runs generate(index, rng) -> Particle for `count` particles starting at
+    // `first`, which must already be allocated.
+    template <typename Generator>
+    static void parallelFill(size_t first, size_t count, uint64_t seed, Generator generate) {
+        std::vector<Particle>& particles = Particle::particles;
+        const size_t numThreads = std::max<size_t>(1, std::min<size_t>(config.threads(), count / 1024 + 1));
+        const size_t chunkSize = (count + numThreads - 1) / numThreads;
+
+        auto fillChunk = [&](size_t start, size_t end) {
+            TRACE_ZONE("scenario worker");
+            for (size_t i = start; i < end; i++) {
+                CounterRng rng(seed, i);
+                particles[first + i] = generate(i, rng);
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < numThreads; t++) {
+            size_t start = t * chunkSize;
+            size_t end = std::min(start + chunkSize, count);
+            if (start < end) {
+                threads.emplace_back(fillChunk, start, end);
+            }
+        }
+
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    static size_t allocate(size_t count) {
+        size_t first = Particle::particles.size();
+        Particle::particles.resize(first + count);
+        return first;
+    }
+
+    static Particle makeParticle(sf::Vector2f position, sf::Vector2f velocity, float mass = particleMass) {
+        Particle particle;
+        particle.position = position;
+        particle.velocity = velocity;
+        particle.mass = mass;
+        particle.radius = std::cbrt(mass);
+        return particle;
+    }
+
+    static float fitRadius(size_t n) {
+        return std::min(std::sqrt(static_cast<float>(n)) * 10.0f,
+                        0.45f * std::min(Config::windowWidth, Config::windowHeight));
+    }
+
+    // Rotating disc around a light central body.
+    static void disc(size_t n, sf::Vector2f center, float outerRadius,
+                     sf::Vector2f bulkVelocity = {0.0f, 0.0f}, uint64_t seed = 0) {
+        if (n == 0) return;
+
+        const float innerRadius = 5.0f;
+        const float centralMass = 5.0f;
+        size_t first = allocate(n);
+
+        Particle::particles[first] = makeParticle(center, bulkVelocity, centralMass);
+        Particle::particles[first].radius = innerRadius;
+
+        parallelFill(first + 1, n - 1, seed, [=](size_t, CounterRng& rng) {
+            float angle = rng.angle();
+            float radius = rng.uniform(innerRadius, outerRadius);
+
+            sf::Vector2f position = center + sf::Vector2f(std::cos(angle), std::sin(angle)) * radius;
+
+            // Orbital velocity, perpendicular to the radial vector
+            float v = std::sqrt((config.gravitational_constant * centralMass) / radius);
+            sf::Vector2f velocity = sf::Vector2f(std::sin(angle), -std::cos(angle)) * (v + 0.80f);
+
+            return makeParticle(position, velocity + bulkVelocity);
+        });
+    }
+
+    // Plummer sphere projected onto the plane, velocities drawn with
+    // Aarseth's rejection method scaled to the local escape speed. Velocities
+    // are per frame like everywhere else, hence the extra dt, and the escape
+    // speed includes the gravitational softening.
+    static void plummer(size_t n, sf::Vector2f center, float scaleRadius, uint64_t seed = 0) {
+        const float totalMass = n * particleMass;
+        const float maxRadius = 0.45f * std::min(Config::windowWidth, Config::windowHeight);
+        size_t first = allocate(n);
+
+        parallelFill(first, n, seed, [=](size_t, CounterRng& rng) {
+            float radius;
+            do {
+                float u = rng.uniform(1e-4f, 1.0f);
+                radius = scaleRadius / std::sqrt(std::pow(u, -2.0f / 3.0f) - 1.0f);
+            } while (radius > maxRadius);
+
+            // Projection of a random point on the sphere of that radius
+            float cosTheta = rng.uniform(-1.0f, 1.0f);
+            float projected = radius * std::sqrt(1.0f - cosTheta * cosTheta);
+            float angle = rng.angle();
+            sf::Vector2f position = center + sf::Vector2f(std::cos(angle), std::sin(angle)) * projected;
+
+            float q, g;
+            do {
+                q = rng.uniform();
+                g = rng.uniform(0.0f, 0.1f);
+            } while (g > q * q * std::pow(1.0f - q * q, 3.5f));
+
+            float escapeSpeed = std::sqrt(2.0f * config.gravitational_constant * totalMass * Config::dt /
+                                          std::sqrt(radius * radius + scaleRadius * scaleRadius +
+                                                    config.gravitationalSoftening));
+            float speedAngle = rng.angle();
+            sf::Vector2f velocity = sf::Vector2f(std::cos(speedAngle), std::sin(speedAngle)) * (q * escapeSpeed);
+
+            return makeParticle(position, velocity);
+        });
+    }
+
+    // Two discs on a collision course.
+    static void collidingGalaxies(size_t n, uint64_t seed = 0) {
+        const float width = Config::windowWidth;
+        const float height = Config::windowHeight;
+        const float radius = std::min(fitRadius(n / 2), 0.2f * std::min(width, height));
+        const float speed = 0.5f;
+
+        disc(n / 2, {0.3f * width, 0.4f * height}, radius, {speed, 0.1f * speed}, seed);
+        disc(n - n / 2, {0.7f * width, 0.6f * height}, radius, {-speed, -0.1f * speed}, seed + 1);
+    }
+
+    // Particles spread evenly over the window with small random velocities.
+    static void uniformGas(size_t n, float temperature = 0.05f, uint64_t seed = 0) {
+        const float margin = 10.0f;
+        const float width = Config::windowWidth;
+        const float height = Config::windowHeight;
+        size_t first = allocate(n);
+
+        parallelFill(first, n, seed, [=](size_t, CounterRng& rng) {
+            sf::Vector2f position(rng.uniform(margin, width - margin), rng.uniform(margin, height - margin));
+            sf::Vector2f velocity(rng.uniform(-temperature, temperature), rng.uniform(-temperature, temperature));
+            return makeParticle(position, velocity);
+        });
+    }
+
+    // Round rigid bodies of about particlesPerBody members on a lattice over
+    // the window, each drifting and turning slowly.
+    static void rigidBodies(size_t n, uint64_t seed = 0) {
+        constexpr size_t particlesPerBody = 1000;
+        const size_t bodyCount = std::max<size_t>(1, (n + particlesPerBody / 2) / particlesPerBody);
+        const int columns = static_cast<int>(std::ceil(std::sqrt(static_cast<float>(bodyCount))));
+        const float cell = std::min(Config::windowWidth, Config::windowHeight) / static_cast<float>(columns);
+        const float radius = 0.4f * cell;
+
+        for (size_t b = 0; b < bodyCount; b++) {
+            const size_t members = n / bodyCount + (b < n % bodyCount ? 1 : 0);
+            if (members == 0) continue;
+
+            // Hexagonal packing that fills the disc with `members` points
+            const float spacing = std::max(2.0f * std::cbrt(particleMass),
+                                           radius * std::sqrt(2.0f * static_cast<float>(M_PI) / (std::sqrt(3.0f) * members)));
+            const sf::Vector2f center((b % columns + 0.5f) * cell, (b / columns + 0.5f) * cell);
+
+            CounterRng rng(seed, b);
+            const float angle = rng.angle();
+            const sf::Vector2f velocity = sf::Vector2f(std::cos(angle), std::sin(angle)) * rng.uniform(0.0f, 0.3f);
+            const float spin = rng.uniform(-0.01f, 0.01f);
+
+            std::vector<Particle> body;
+            const int reach = static_cast<int>(radius / spacing) + 1;
+            for (int row = -reach; row <= reach && body.size() < members; row++) {
+                for (int column = -reach; column <= reach && body.size() < members; column++) {
+                    sf::Vector2f offset((column + 0.5f * (row & 1)) * spacing, row * spacing * std::sqrt(3.0f) / 2.0f);
+                    if (offset.x * offset.x + offset.y * offset.y > radius * radius) continue;
+                    body.push_back(makeParticle(center + offset, velocity + sf::Vector2f(-offset.y, offset.x) * spin));
+                }
+            }
+            RigidBodies::create(std::move(body));
+        }
+    }
+
+    // Builds a named scenario: disc, plummer, galaxies, gas or bodies.
+    static void generate(const std::string& name, size_t n, uint64_t seed = 0) {
+        sf::Vector2f center(Config::windowWidth / 2.0f, Config::windowHeight / 2.0f);
+
+        if (name == "disc") {
+            disc(n, center, fitRadius(n), {0.0f, 0.0f}, seed);
+        } else if (name == "plummer") {
+            plummer(n, center, 0.1f * std::min(Config::windowWidth, Config::windowHeight), seed);
+        } else if (name == "galaxies") {
+            collidingGalaxies(n, seed);
+        } else if (name == "gas") {
+            uniformGas(n, 0.05f, seed);
+        } else if (name == "bodies") {
+            rigidBodies(n, seed);
+        } else {
+            throw std::invalid_argument("Unknown scenario: " + name);
+        }
+    }
+
+    struct Spec {
+        std::string name;
+        size_t count = 1000;
+        uint64_t seed = 0;
+    };
+
+    static bool isScenario(const std::string& name) {
+        return name == "disc" || name == "plummer" || name == "galaxies" || name == "gas" || name == "bodies";
+    }
+
+    // Parses a name[:count[:seed]] spec, as given to --scenario. Throws
+    // std::invalid_argument saying what is expected.
+    static Spec parseSpec(const std::string& spec) {
+        const std::string usage = "Expected a scenario as name:count[:seed] with name one of disc, plummer, "
+                                  "galaxies, gas or bodies, got " + spec;
+        auto number = [&usage](const std::string& text) {
+            if (text.empty() || text.size() > 19 || text.find_first_not_of("0123456789") != std::string::npos) {
+                throw std::invalid_argument(usage);
+            }
+            return std::stoull(text);
+        };
+
+        Spec parsed;
+        size_t nameEnd = spec.find(':');
+        parsed.name = spec.substr(0, nameEnd);
+        if (!isScenario(parsed.name)) throw std::invalid_argument(usage);
+        if (nameEnd == std::string::npos) return parsed;
+
+        size_t countEnd = spec.find(':', nameEnd + 1);
+        parsed.count = number(spec.substr(nameEnd + 1, countEnd - nameEnd - 1));
+        if (countEnd != std::string::npos) parsed.seed = number(spec.substr(countEnd + 1));
+        return parsed;
+    }
+
+    // Builds a scenario from a name[:count[:seed]] spec.
+    static void generateFromSpec(const std::string& spec) {
+        Spec parsed = parseSpec(spec);
+        generate(parsed.name, parsed.count, parsed.seed);
+    }
+};
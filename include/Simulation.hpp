@@ -3,8 +3,23 @@
 #include <SFML/Graphics.hpp>
 #include "Solver.hpp" 
 #include "CollisionGrid.hpp"
-#include "TextManager.hpp"
+#include "FrameSnapshot.hpp"
 #include "BarnesHut.hpp"
+#include "Snapshot.hpp"
+#include "TrajectoryWriter.hpp"
+#include "LiveConfig.hpp"
+#include "FrameGovernor.hpp"
+#include "BlockTimesteps.hpp"
+#include "TaskGraph.hpp"
+#include "NeighbourList.hpp"
+#include "SweptCollisions.hpp"
+#include "RigidBodies.hpp"
+#include "Analysis.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <vector>
 
 struct Simulation {
     static bool isPaused;
@@ -16,38 +31,404 @@ struct Simulation {
     
     static sf::Clock collisionTimer;
     static int collisionTime;
+    static int totalCollisionTimeUs;
 
     static sf::Clock gravityTimer;
     static int gravityTime;
+    static int totalGravityTimeUs;
 
     static int simulationTimeUs;
     static int frameCount;
     static int totalSimulationTimeUs;
 
+    // Number of steps simulated since startup or the restored snapshot.
+    static uint64_t step;
 
     static void update(float dt) {
+        TRACE_ZONE("Simulation::update");
         frameTimer.restart();
+        LiveConfig::poll();
         
 
-        if (isPaused) {
-            TextManager::update();
+        if (isPaused) return;
+
+        // Block timesteps integrate inside the gravity phase, so only the
+        // out of bounds removal is left for the end of the step.
+        const bool blockTimesteps = config.blockTimesteps;
+        if (!blockTimesteps) BlockTimesteps::isPrimed = false;
+
+        Numa::placeParticles(Particle::particles, config.threads());
+
+        if (canOverlap()) {
+            int stepGravityUs = 0;
+            int stepCollisionUs = 0;
+            updateOverlapped(dt, FrameGovernor::collisionSubsteps(), stepGravityUs, stepCollisionUs);
+            totalGravityTimeUs += stepGravityUs;
+            totalCollisionTimeUs += stepCollisionUs;
+            finishStep(stepGravityUs, stepCollisionUs);
             return;
         }
 
+        RigidBodies::beginStep(Particle::particles);
+
         gravityTimer.restart();
-        quadTree.update();
-        if (frameCount == 1) gravityTime = gravityTimer.getElapsedTime().asMicroseconds();
+        {
+            PERF_ZONE(PerfPhase::Gravity);
+            if (blockTimesteps) BlockTimesteps::advance(Particle::particles);
+            else updateGravity();
+        }
+        int stepGravityUs = gravityTimer.getElapsedTime().asMicroseconds();
+        totalGravityTimeUs += stepGravityUs;
 
         collisionTimer.restart();
-        CollisionGrid::update(Particle::particles);
-        if (frameCount == 1) collisionTime = collisionTimer.getElapsedTime().asMicroseconds();
+        {
+            PERF_ZONE(PerfPhase::Collision);
+            RigidBodies::attachSurfaces(Particle::particles);
+            if (useNeighbourLists()) NeighbourList::update(Particle::particles, FrameGovernor::collisionSubsteps());
+            else CollisionGrid::update(Particle::particles, FrameGovernor::collisionSubsteps(), useMerging());
 
-        Particle::updateAll(dt);
-        TextManager::update();
+            // Neighbour lists leave the grid stale and merging moves particles.
+            SweptCollisions::apply(Particle::particles, dt, useNeighbourLists() || useMerging());
+            RigidBodies::detachSurfaces(Particle::particles);
+        }
+        int stepCollisionUs = collisionTimer.getElapsedTime().asMicroseconds();
+        totalCollisionTimeUs += stepCollisionUs;
 
+        {
+            PERF_ZONE(PerfPhase::Integration);
+            if (blockTimesteps) Particle::removeOutOfBounds();
+            else Particle::updateAll(dt);
+        }
+        RigidBodies::endStep(Particle::particles);
+        finishStep(stepGravityUs, stepCollisionUs);
+    }
+
+    static void finishStep(int stepGravityUs, int stepCollisionUs) {
+        step++;
+        PerfCounters::endFrame(step);
+
+        // Recordings and analysis see rigid body members as free particles.
+        RigidBodies::withMembers([]() {
+            Snapshot::checkpoint(step);
+            TrajectoryWriter::capture(step);
+            Analysis::observe(step);
+        });
+
+        FrameGovernor::observe(stepGravityUs, stepCollisionUs, frameTimer.getElapsedTime().asMicroseconds());
         handleTimer();
     }
 
+    // The task graph covers the plain tree step. Block timesteps, the mesh
+    // solvers, merging and rigid bodies keep the phase by phase path.
+    static bool canOverlap() {
+        return config.taskGraph && !config.blockTimesteps && !config.mergeOnContact && !RigidBodies::isActive() &&
+               config.gravitySolver == Config::GravitySolver::Tree &&
+               config.gravitational_constant != 0.0f && !CollisionGrid::cells.empty();
+    }
+
+    // Merging reorders the particles every step, which would defeat the lists,
+    // and rigid bodies add and remove particles every step.
+    static bool useNeighbourLists() {
+        return config.neighbourLists && !config.mergeOnContact && !RigidBodies::isActive();
+    }
+
+    // Merging would mix rigid body stand-ins into free particles.
+    static bool useMerging() {
+        return config.mergeOnContact && !RigidBodies::isActive();
+    }
+
+    constexpr static int bandsPerThread = 4;
+
+    static std::vector<std::vector<uint32_t>> bands;    // Particle indices per band of grid rows
+    static std::vector<uint8_t> isOutside;              // Out of bounds at the start of the step
+
+    /*
+    One step of gravity, collisions and integration as a task graph over
+    horizontal bands of collision grid rows:
+
+        tree reset -> tree insert (chunks) -> mass distribution --+
+        grid assignment and banding ------------------------------+-> forces[b]
+        forces[b-1..b+1] -> collisions[b]   (substep 0)
+        collisions[b-1..b+1] of the previous substep -> collisions[b]
+        last collisions[b-1..b+1] -> integrate[b]
+
+    When a particle may be fast enough for SweptCollisions, one swept task
+    waits for every band's last collisions and every integrate waits for it.
+
+    The grid is built while the tree is, a band's contacts are resolved as
+    soon as the forces they overwrite are done, and a band moves once no
+    contact that can read or write its particles is left, so there is no
+    join between the phases. The result matches the phase by phase path up
+    to the order contacts on band edges are resolved in.
+
+    With neighbour lists particles are banded by the row they were in when
+    the lists were built, and bands are made at least as tall as the lists
+    reach, so a band's contacts still only touch the bands next to it.
+
+    In deterministic mode the bands are CollisionGrid::sweepBands' fixed
+    bands and every collision layer is split in two: even bands first, then
+    odd bands, each waiting for its neighbours of the other colour. The tree
+    is filled one ordered subtree per task.
+    */
+    static void updateOverlapped(float dt, int substeps, int& gravityUs, int& collisionUs) {
+        TRACE_ZONE("Simulation::updateOverlapped");
+        std::vector<Particle>& particles = Particle::particles;
+        const size_t count = particles.size();
+        const int numThreads = config.threads();
+        const int nRows = CollisionGrid::nRows;
+        const bool neighbourLists = useNeighbourLists();
+        const bool deterministic = config.deterministic;
+        int rowsPerBand = std::max(1, (nRows + numThreads * bandsPerThread - 1) / (numThreads * bandsPerThread));
+        if (neighbourLists) rowsPerBand = std::max(rowsPerBand, NeighbourList::reachRows());
+        if (deterministic) rowsPerBand = CollisionGrid::sweepBandRows(neighbourLists ? NeighbourList::reachRows() : 1);
+        const int bandCount = (nRows + rowsPerBand - 1) / rowsPerBand;
+        const Node::ForceParams params = Node::ForceParams::fromConfig();
+        const bool swept = SweptCollisions::mayBeNeeded(particles);
+
+        bands.resize(bandCount);
+        isOutside.assign(count, 0);
+
+        // Busy time per phase, summed over the workers
+        std::atomic<int64_t> gravityBusyUs(0);
+        std::atomic<int64_t> collisionBusyUs(0);
+        auto timed = [](std::atomic<int64_t>& total, PerfPhase phase, auto work) {
+            return [&total, phase, work]() {
+                PERF_ZONE(phase);
+                auto start = std::chrono::steady_clock::now();
+                work();
+                total += std::chrono::duration_cast<std::chrono::microseconds>(
+                             std::chrono::steady_clock::now() - start).count();
+            };
+        };
+
+        TaskGraph graph;
+
+        int reset = graph.add("tree reset", timed(gravityBusyUs, PerfPhase::Gravity, [&particles, deterministic]() {
+            quadTree.reset();
+            if (deterministic) quadTree.prepareOrderedInsert(particles);
+        }));
+
+        std::vector<int> inserts;
+        if (deterministic) {
+            for (size_t subtree = 0; subtree < QuadTree::orderedSubtrees; subtree++) {
+                inserts.push_back(graph.add("tree insert", timed(gravityBusyUs, PerfPhase::Gravity, [&particles, subtree]() {
+                    quadTree.insertSubtree(subtree, particles);
+                }), {reset}));
+            }
+        } else {
+            const size_t insertChunk = (count + numThreads - 1) / numThreads;
+            for (size_t start = 0; start < count; start += insertChunk) {
+                size_t end = std::min(count, start + insertChunk);
+                inserts.push_back(graph.add("tree insert", timed(gravityBusyUs, PerfPhase::Gravity, [&particles, start, end]() {
+                    for (size_t i = start; i < end; i++) {
+                        quadTree.root->insert(particles[i]);
+                    }
+                }), {reset}));
+            }
+        }
+        int mass = graph.add("tree mass", timed(gravityBusyUs, PerfPhase::Gravity, []() {
+            quadTree.computeMassDistribution();
+        }), inserts);
+
+        int assign = graph.add("grid assign", timed(collisionBusyUs, PerfPhase::Collision, [&]() {
+            if (neighbourLists) NeighbourList::refresh(particles);
+            else CollisionGrid::assignParticlesToGrid(particles);
+
+            for (auto& band : bands) {
+                band.clear();
+            }
+            for (size_t i = 0; i < count; i++) {
+                if (Particle::isOutOfBounds(particles[i])) {
+                    isOutside[i] = 1;
+                    continue;
+                }
+                int row = neighbourLists ? NeighbourList::rows[i] : -1;
+                if (row < 0) row = static_cast<int>(particles[i].position.y / CollisionGrid::cellSize);
+                row = std::clamp(row, 0, nRows - 1);
+                bands[row / rowsPerBand].push_back(static_cast<uint32_t>(i));
+            }
+        }));
+
+        auto neighbours = [bandCount](const std::vector<int>& ids, int band) {
+            std::vector<int> result;
+            for (int b = std::max(0, band - 1); b <= std::min(bandCount - 1, band + 1); b++) {
+                result.push_back(ids[b]);
+            }
+            return result;
+        };
+
+        std::vector<int> forces(bandCount);
+        for (int b = 0; b < bandCount; b++) {
+            forces[b] = graph.add("force band", timed(gravityBusyUs, PerfPhase::Gravity, [&particles, &params, b]() {
+                const std::vector<uint32_t>& band = bands[b];
+                quadTree.calculateForceRange(particles, &band, 0, band.size(), params);
+            }), {mass, assign});
+        }
+
+        std::vector<int> previous = forces;
+        const int layersPerSubstep = deterministic ? 2 : 1;
+        for (int layer = 0; layer < std::max(1, substeps) * layersPerSubstep; layer++) {
+            // A band that sits out a layer passes its last task on.
+            std::vector<int> collisions = previous;
+            for (int b = 0; b < bandCount; b++) {
+                if (deterministic && b % 2 != layer % 2) continue;
+
+                int rowStart = b * rowsPerBand;
+                int rowEnd = std::min(nRows, rowStart + rowsPerBand);
+                collisions[b] = graph.add("collision band", timed(collisionBusyUs, PerfPhase::Collision, [&particles, neighbourLists, rowStart, rowEnd]() {
+                    if (neighbourLists) NeighbourList::resolveRows(particles, rowStart, rowEnd);
+                    else CollisionGrid::checkCollisionsInRows(particles, rowStart, rowEnd);
+                }), neighbours(previous, b));
+            }
+            previous = collisions;
+        }
+
+        if (swept) {
+            int sweep = graph.add("swept collisions", timed(collisionBusyUs, PerfPhase::Collision, [&particles, dt, neighbourLists]() {
+                SweptCollisions::apply(particles, dt, neighbourLists);
+            }), previous);
+            previous.assign(bandCount, sweep);
+        }
+
+        for (int b = 0; b < bandCount; b++) {
+            graph.add("integrate band", [&particles, dt, b]() {
+                PERF_ZONE(PerfPhase::Integration);
+                for (uint32_t i : bands[b]) {
+                    particles[i].update(dt);
+                }
+            }, neighbours(previous, b));
+        }
+
+        graph.run();
+
+        // Same removal as updateAll: what was outside before moving goes.
+        size_t kept = 0;
+        for (size_t i = 0; i < count; i++) {
+            if (!isOutside[i]) {
+                if (kept != i) particles[kept] = particles[i];
+                kept++;
+            }
+        }
+        particles.resize(kept);
+
+        gravityUs = static_cast<int>(gravityBusyUs.load() / numThreads);
+        collisionUs = static_cast<int>(collisionBusyUs.load() / numThreads);
+    }
+
+    /*
+    Self check for deterministic mode (--verify-determinism): runs the scene
+    made by `generate` for `steps` steps once per thread count, starting
+    over each time, and compares hashes of the final particle state. Returns
+    false if any run differs from the first or the scene is empty. The
+    runtime config is not reloaded in between, so every run sees the same
+    settings.
+    */
+    static bool verifyDeterminism(const std::function<void()>& generate, uint64_t steps,
+                                  const std::vector<int>& threadCounts) {
+        const Config saved = config;
+        const int savedPollInterval = LiveConfig::pollInterval;
+        config.deterministic = true;
+        LiveConfig::pollInterval = 0;
+
+        bool isIdentical = true;
+        uint64_t expected = 0;
+        for (size_t run = 0; run < threadCounts.size(); run++) {
+            config.threadCount = threadCounts[run];
+            Particle::particles.clear();
+            RigidBodies::clear();
+            step = 0;
+            BlockTimesteps::isPrimed = false;
+            NeighbourList::invalidate();
+            FrameGovernor::reset();
+            generate();
+            if (Particle::particles.empty() && !RigidBodies::isActive()) {
+                config = saved;
+                LiveConfig::pollInterval = savedPollInterval;
+                std::printf("Nothing to compare: the starting scene is empty\n");
+                return false;
+            }
+
+            auto start = std::chrono::steady_clock::now();
+            for (uint64_t i = 0; i < steps; i++) {
+                update(Config::dt);
+            }
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            uint64_t hash = 0;
+            size_t count = 0;
+            RigidBodies::withMembers([&hash, &count]() {
+                hash = Particle::hash(Particle::particles);
+                count = Particle::particles.size();
+            });
+            if (run == 0) expected = hash;
+            isIdentical = isIdentical && hash == expected;
+
+            std::printf("%3d threads: %zu particles, hash %016llx, %.2f s%s\n", threadCounts[run],
+                        count, static_cast<unsigned long long>(hash), seconds,
+                        hash == expected ? "" : "  MISMATCH");
+        }
+
+        config = saved;
+        LiveConfig::pollInterval = savedPollInterval;
+        std::printf(isIdentical ? "Deterministic: all runs match\n" : "Not deterministic: final states differ\n");
+        return isIdentical;
+    }
+
+    // The tree is built in every mode since level of detail rendering draws
+    // from it.
+    static void updateGravity() {
+        switch (config.gravitySolver) {
+            case Config::GravitySolver::Tree:
+                quadTree.update();
+                break;
+            case Config::GravitySolver::ParticleMesh:
+                quadTree.build();
+                ParticleMesh::update(Particle::particles, false);
+                break;
+            case Config::GravitySolver::TreePM:
+                quadTree.build();
+                ParticleMesh::update(Particle::particles, true);
+                quadTree.calculateForces(Particle::particles);
+                break;
+        }
+    }
+
+    // Copies what the renderer needs out of the simulation state.
+    static void publish(FrameSnapshot& frame, CameraState camera) {
+        TRACE_ZONE("Simulation::publish");
+        const std::vector<Particle>& particles = Particle::particles;
+
+        frame.masses.clear();
+        if (camera.levelOfDetail) {
+            camera.lodPixels *= FrameGovernor::lodScale;
+            frame.positions.clear();
+            quadTree.collectLevelOfDetail(camera, frame.positions, frame.masses);
+        } else {
+            frame.positions.resize(particles.size());
+            for (size_t i = 0; i < particles.size(); i++) {
+                frame.positions[i] = particles[i].position;
+            }
+        }
+        RigidBodies::appendPositions(frame.positions, camera.levelOfDetail ? &frame.masses : nullptr);
+
+        frame.particleCount = particles.size() + RigidBodies::memberCount();
+        frame.step = step;
+        frame.isPaused = isPaused;
+        frame.simulationTimeUs = simulationTimeUs;
+        frame.gravityTime = gravityTime;
+        frame.collisionTime = collisionTime;
+        frame.theta = FrameGovernor::theta();
+        frame.frameLoad = FrameGovernor::load;
+        frame.forceEvaluations = config.blockTimesteps ? BlockTimesteps::frameEvaluations : 0;
+
+        frame.hasCounters = PerfCounters::enabled;
+        if (frame.hasCounters) {
+            for (int phase = 0; phase < PerfCounters::phaseCount; phase++) {
+                frame.counters[phase] = PerfCounters::describe(phase, PerfCounters::lastFrame[phase]);
+            }
+        }
+    }
+
     static void handleTimer() {
         int currentFrameTime = frameTimer.getElapsedTime().asMicroseconds();
         totalSimulationTimeUs += currentFrameTime;
@@ -56,13 +437,20 @@ struct Simulation {
         // Update every N frames (e.g., every 60 frames)
         if (frameCount == 60) {
             simulationTimeUs = totalSimulationTimeUs / frameCount;
+            gravityTime = totalGravityTimeUs / frameCount;
+            collisionTime = totalCollisionTimeUs / frameCount;
             totalSimulationTimeUs = 0; // Reset for next period
+            totalGravityTimeUs = 0;
+            totalCollisionTimeUs = 0;
             frameCount = 0;
         }
     } 
 
 };
 
+std::vector<std::vector<uint32_t>> Simulation::bands;
+std::vector<uint8_t> Simulation::isOutside;
+
 int Simulation::fps = 60;
 bool Simulation::isPaused = false;
 
@@ -70,9 +458,12 @@ sf::Clock Simulation::frameTimer;
 int Simulation::simulationTimeUs = 0;
 int Simulation::frameCount = 0;
 int Simulation::totalSimulationTimeUs = 0;
+uint64_t Simulation::step = 0;
 
 sf::Clock Simulation::collisionTimer;
 int Simulation::collisionTime = 0;
+int Simulation::totalCollisionTimeUs = 0;
 
 sf::Clock Simulation::gravityTimer;
 int Simulation::gravityTime = 0;
+int Simulation::totalGravityTimeUs = 0;
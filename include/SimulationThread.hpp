@@ -0,0 +1,125 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "Camera.hpp"
+#include "Config.hpp"
+#include "FixedStep.hpp"
+#include "FrameSnapshot.hpp"
+#include "Particle.hpp"
+#include "Simulation.hpp"
+#include "SpscQueue.hpp"
+#include "Trace.hpp"
+#include "TripleBuffer.hpp"
+
+// Requests from the input handler. Only the simulation thread touches
+// Particle::particles, so input is applied between steps through these.
+struct SimulationCommand {
+    enum Type { Clear, TogglePause, AddParticles, AddBody };
+
+    Type type = Clear;
+    std::vector<Particle> particles;
+    sf::Vector2f velocity = {0.0f, 0.0f};
+};
+
+/*
+Runs Simulation::update on its own thread, paced by FixedStep, and
+publishes a FrameSnapshot after every batch of steps. The render thread draws the
+latest snapshot while the next step is being computed, so a frame costs the
+slower of the two phases rather than their sum.
+
+With pipelined = false (--sequential) the main loop calls step() itself and
+everything runs on one thread as before.
+*/
+struct SimulationThread {
+    static bool pipelined;
+
+    static TripleBuffer<FrameSnapshot> frames;
+    static TripleBuffer<CameraState> cameras;   // Render thread -> simulation thread
+    static CameraState camera;
+    static SpscQueue<SimulationCommand, 256> commands;
+    static std::thread thread;
+    static std::atomic<bool> isRunning;
+
+    // Called from the input thread.
+    static void send(SimulationCommand command) {
+        if (!commands.push(std::move(command))) {
+            std::cerr << "Simulation command queue full, dropping input" << std::endl;
+        }
+    }
+
+    static void applyCommands() {
+        SimulationCommand command;
+        while (commands.pop(command)) {
+            switch (command.type) {
+                case SimulationCommand::Clear:
+                    Particle::particles.clear();
+                    RigidBodies::clear();
+                    quadTree.reset();
+                    break;
+                case SimulationCommand::TogglePause:
+                    Simulation::isPaused = !Simulation::isPaused;
+                    break;
+                case SimulationCommand::AddParticles:
+                    Particle::add(command.particles, command.velocity);
+                    break;
+                case SimulationCommand::AddBody:
+                    RigidBodies::create(command.particles, command.velocity);
+                    break;
+            }
+        }
+    }
+
+    // Takes the given number of steps and publishes one snapshot of the result.
+    static void advance(int steps) {
+        applyCommands();
+        for (int i = 0; i < steps; i++) {
+            Simulation::update(config.dt);
+        }
+
+        if (cameras.acquire()) camera = cameras.readBuffer();
+        Simulation::publish(frames.writeBuffer(), camera);
+        frames.publish();
+    }
+
+    static void run() {
+        while (isRunning.load(std::memory_order_relaxed)) {
+            int steps = FixedStep::due();
+            if (steps == 0) {
+                TRACE_ZONE("SimulationThread::sleep");
+                std::this_thread::sleep_for(FixedStep::untilNextStep());
+                continue;
+            }
+
+            advance(steps);
+        }
+    }
+
+    static void start() {
+        if (!pipelined || isRunning) return;
+
+        isRunning = true;
+        FixedStep::reset();
+        thread = std::thread(run);
+    }
+
+    static void stop() {
+        if (!isRunning) return;
+
+        isRunning = false;
+        thread.join();
+    }
+};
+
+bool SimulationThread::pipelined = true;
+
+TripleBuffer<FrameSnapshot> SimulationThread::frames;
+TripleBuffer<CameraState> SimulationThread::cameras;
+CameraState SimulationThread::camera;
+SpscQueue<SimulationCommand, 256> SimulationThread::commands;
+std::thread SimulationThread::thread;
+std::atomic<bool> SimulationThread::isRunning(false);
@@ -0,0 +1,284 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Particle.hpp"
+#include "Trace.hpp"
+
+/*
+Snapshot file layout (native little endian):
+
+    SnapshotHeader                      padded to 64 bytes
+    float positionX[count]              every array starts on a 64 byte boundary,
+    float positionY[count]              arrays are `arrayStride` bytes apart
+    float velocityX[count]
+    float velocityY[count]
+    float forceX[count]
+    float forceY[count]
+    float mass[count]
+    float radius[count]
+
+The arrays can be read in place from a mapped file (SnapshotView) without
+any parsing. The engine itself keeps particles as an array of Particle
+structs, so load() copies them over in one pass. The checksum covers
+everything after the header.
+*/
+
+enum SnapshotField {
+    PositionX, PositionY,
+    VelocityX, VelocityY,
+    ForceX, ForceY,
+    Mass, Radius,
+    FieldCount
+};
+
+struct SnapshotHeader {
+    char magic[8];          // "MAGSNAP"
+    uint32_t version;
+    uint32_t headerSize;    // Offset of the first array
+    uint64_t count;         // Number of particles
+    uint64_t step;          // Simulation step the snapshot was taken at
+    uint64_t arrayStride;   // Bytes between the start of consecutive arrays
+    uint64_t checksum;      // Hash of the payload
+};
+
+struct SnapshotView {
+    const SnapshotHeader* header = nullptr;
+    void* data = nullptr;
+    size_t length = 0;
+
+    SnapshotView() = default;
+    SnapshotView(const SnapshotView&) = delete;
+    SnapshotView& operator=(const SnapshotView&) = delete;
+
+    ~SnapshotView() {
+        close();
+    }
+
+    // Maps a snapshot read only and validates its header and checksum.
+    void open(const std::string& path);
+
+    void close() {
+        if (data) munmap(data, length);
+        data = nullptr;
+        header = nullptr;
+        length = 0;
+    }
+
+    const float* array(SnapshotField field) const {
+        const char* base = static_cast<const char*>(data) + header->headerSize;
+        return reinterpret_cast<const float*>(base + field * header->arrayStride);
+    }
+};
+
+struct Snapshot {
+    constexpr static char magic[8] = "MAGSNAP";
+    constexpr static uint32_t version = 1;
+    constexpr static size_t alignment = 64;
+
+    // Periodic checkpointing, disabled while checkpointInterval is 0.
+    static std::string checkpointPath;
+    static int checkpointInterval;
+
+    static std::vector<char> stagingBuffer;
+    static std::thread writer;
+    static std::atomic<bool> isWriting;
+
+    static size_t align(size_t bytes) {
+        return (bytes + alignment - 1) / alignment * alignment;
+    }
+
+    // 64 bit word-at-a-time hash, fast enough to verify multi-million body
+    // files in a few milliseconds.
+    static uint64_t checksum(const char* bytes, size_t length) {
+        uint64_t hash = 0xcbf29ce484222325ull;
+        size_t i = 0;
+
+        for (; i + 8 <= length; i += 8) {
+            uint64_t word;
+            std::memcpy(&word, bytes + i, 8);
+            hash = (hash ^ word) * 0x100000001b3ull;
+            hash ^= hash >> 29;
+        }
+
+        for (; i < length; i++) {
+            hash = (hash ^ static_cast<unsigned char>(bytes[i])) * 0x100000001b3ull;
+        }
+
+        return hash;
+    }
+
+    // Copies the particle state into the staging buffer and writes it on a
+    // background thread. Returns false if the previous write is still running.
+    static bool saveAsync(const std::string& path, uint64_t step) {
+        if (isWriting.load()) return false;
+        TRACE_ZONE("Snapshot::saveAsync");
+        if (writer.joinable()) writer.join();
+
+        const std::vector<Particle>& particles = Particle::particles;
+        const size_t count = particles.size();
+        const size_t headerSize = align(sizeof(SnapshotHeader));
+        const size_t stride = align(count * sizeof(float));
+
+        stagingBuffer.resize(headerSize + stride * FieldCount);
+
+        SnapshotHeader header = {};
+        std::memcpy(header.magic, magic, sizeof(magic));
+        header.version = version;
+        header.headerSize = static_cast<uint32_t>(headerSize);
+        header.count = count;
+        header.step = step;
+        header.arrayStride = stride;
+        std::memcpy(stagingBuffer.data(), &header, sizeof(header));
+
+        float* arrays[FieldCount];
+        for (int field = 0; field < FieldCount; field++) {
+            arrays[field] = reinterpret_cast<float*>(stagingBuffer.data() + headerSize + field * stride);
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            const Particle& particle = particles[i];
+            arrays[PositionX][i] = particle.position.x;
+            arrays[PositionY][i] = particle.position.y;
+            arrays[VelocityX][i] = particle.velocity.x;
+            arrays[VelocityY][i] = particle.velocity.y;
+            arrays[ForceX][i] = particle.force.x;
+            arrays[ForceY][i] = particle.force.y;
+            arrays[Mass][i] = particle.mass;
+            arrays[Radius][i] = particle.radius;
+        }
+
+        isWriting = true;
+        writer = std::thread(writeStagingBuffer, path);
+        return true;
+    }
+
+    static void writeStagingBuffer(std::string path) {
+        TRACE_ZONE("Snapshot::writeStagingBuffer");
+        SnapshotHeader* header = reinterpret_cast<SnapshotHeader*>(stagingBuffer.data());
+        header->checksum = checksum(stagingBuffer.data() + header->headerSize,
+                                    stagingBuffer.size() - header->headerSize);
+
+        // Write to a temporary file first so a crash mid-write never leaves
+        // a truncated checkpoint behind.
+        std::string tempPath = path + ".tmp";
+        FILE* file = std::fopen(tempPath.c_str(), "wb");
+        bool ok = file && std::fwrite(stagingBuffer.data(), 1, stagingBuffer.size(), file) == stagingBuffer.size();
+        if (file) ok = (std::fclose(file) == 0) && ok;
+        if (ok) ok = std::rename(tempPath.c_str(), path.c_str()) == 0;
+
+        if (!ok) {
+            std::cerr << "Failed to write snapshot " << path << std::endl;
+        }
+
+        isWriting = false;
+    }
+
+    // Called once per simulation step.
+    static void checkpoint(uint64_t step) {
+        if (checkpointInterval <= 0 || step % checkpointInterval != 0) return;
+
+        if (!saveAsync(checkpointPath, step)) {
+            std::cerr << "Skipping checkpoint at step " << step << ", previous write still running" << std::endl;
+        }
+    }
+
+    // Replaces Particle::particles with the contents of a snapshot and returns
+    // the step it was taken at. Throws std::runtime_error for a missing or
+    // invalid file.
+    static uint64_t load(const std::string& path) {
+        SnapshotView view;
+        view.open(path);
+
+        const size_t count = view.header->count;
+        const float* arrays[FieldCount];
+        for (int field = 0; field < FieldCount; field++) {
+            arrays[field] = view.array(static_cast<SnapshotField>(field));
+        }
+
+        std::vector<Particle>& particles = Particle::particles;
+        particles.clear();
+        particles.reserve(count);
+
+        for (size_t i = 0; i < count; i++) {
+            Particle particle({arrays[PositionX][i], arrays[PositionY][i]}, arrays[Radius][i],
+                              {arrays[VelocityX][i], arrays[VelocityY][i]});
+            particle.force = {arrays[ForceX][i], arrays[ForceY][i]};
+            particle.mass = arrays[Mass][i];
+            particles.push_back(particle);
+        }
+
+        return view.header->step;
+    }
+
+    // Blocks until any pending write has finished.
+    static void wait() {
+        if (writer.joinable()) writer.join();
+    }
+};
+
+void SnapshotView::open(const std::string& path) {
+    close();
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Could not open snapshot " + path);
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(SnapshotHeader)) {
+        ::close(fd);
+        throw std::runtime_error("Snapshot too small: " + path);
+    }
+
+    length = static_cast<size_t>(info.st_size);
+    data = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+
+    if (data == MAP_FAILED) {
+        data = nullptr;
+        throw std::runtime_error("Could not map snapshot " + path);
+    }
+
+    header = static_cast<const SnapshotHeader*>(data);
+
+    if (std::memcmp(header->magic, Snapshot::magic, sizeof(Snapshot::magic)) != 0 ||
+        header->version != Snapshot::version) {
+        close();
+        throw std::runtime_error("Not a version " + std::to_string(Snapshot::version) + " snapshot: " + path);
+    }
+
+    if (header->headerSize + header->arrayStride * FieldCount != length ||
+        header->arrayStride < header->count * sizeof(float)) {
+        close();
+        throw std::runtime_error("Snapshot size does not match its header: " + path);
+    }
+
+    const char* payload = static_cast<const char*>(data) + header->headerSize;
+    if (Snapshot::checksum(payload, length - header->headerSize) != header->checksum) {
+        close();
+        throw std::runtime_error("Snapshot checksum mismatch: " + path);
+    }
+
+    madvise(data, length, MADV_SEQUENTIAL);
+}
+
+std::string Snapshot::checkpointPath = "checkpoint.snap";
+int Snapshot::checkpointInterval = 0;
+
+std::vector<char> Snapshot::stagingBuffer;
+std::thread Snapshot::writer;
+std::atomic<bool> Snapshot::isWriting(false);
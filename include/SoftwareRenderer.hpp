@@ -0,0 +1,250 @@
+#pragma once
+
+#include <SFML/Graphics.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Config.hpp"
+#include "Particle.hpp"
+#include "Trace.hpp"
+
+/*
+Window-free particle renderer for batch runs.
+
+Particles are splatted bilinearly into a float accumulation image (density
+plus a density weighted color) and then tone mapped to RGBA8. The image is
+split into square tiles. Each thread first bins its share of the particles
+by the tiles their footprint touches, then every thread owns whole tiles
+and splats the particles from all bins for them, so no two threads ever
+write the same pixel and nothing needs to be merged afterwards.
+*/
+struct SoftwareRenderer {
+    enum class ToneMap { Linear, Log, Reinhard };
+    enum class ColorMode { Density, Velocity, Mass };
+
+    constexpr static int tileSize = 64;
+
+    int width = Config::windowWidth;
+    int height = Config::windowHeight;
+
+    // World rectangle that is mapped onto the image
+    sf::FloatRect view = {0.0f, 0.0f, static_cast<float>(Config::windowWidth),
+                          static_cast<float>(Config::windowHeight)};
+
+    ToneMap toneMap = ToneMap::Log;
+    ColorMode colorMode = ColorMode::Velocity;
+    float exposure = 1.0f;          // Density mapped to full brightness is 1 / exposure (Linear)
+    float colorRange = 2.0f;        // Speed or mass mapped to the top of the palette
+
+    // r, g, b, density per pixel
+    std::vector<float> accumulation;
+    std::vector<uint8_t> pixels;
+
+    int tilesX = 0;
+    int tilesY = 0;
+    std::vector<std::vector<std::vector<uint32_t>>> bins;   // [thread][tile]
+
+    void resize(int newWidth, int newHeight) {
+        width = newWidth;
+        height = newHeight;
+        tilesX = (width + tileSize - 1) / tileSize;
+        tilesY = (height + tileSize - 1) / tileSize;
+
+        accumulation.assign(static_cast<size_t>(width) * height * 4, 0.0f);
+        pixels.assign(static_cast<size_t>(width) * height * 4, 0);
+        bins.clear();
+    }
+
+    // Blue -> magenta -> orange -> white
+    static sf::Vector3f palette(float t) {
+        static const sf::Vector3f stops[4] = {
+            {0.15f, 0.25f, 1.0f}, {0.85f, 0.2f, 0.8f}, {1.0f, 0.6f, 0.1f}, {1.0f, 1.0f, 1.0f}};
+
+        t = std::clamp(t, 0.0f, 1.0f) * 3.0f;
+        int i = std::min(static_cast<int>(t), 2);
+        float f = t - i;
+        return stops[i] + (stops[i + 1] - stops[i]) * f;
+    }
+
+    sf::Vector3f colorOf(const Particle& particle) const {
+        switch (colorMode) {
+            case ColorMode::Velocity: {
+                float speed = std::sqrt(particle.velocity.x * particle.velocity.x +
+                                        particle.velocity.y * particle.velocity.y);
+                return palette(speed / colorRange);
+            }
+            case ColorMode::Mass:
+                return palette(std::log2(1.0f + particle.mass) / colorRange);
+            default:
+                return {0.0f, 1.0f, 0.0f};
+        }
+    }
+
+    float tone(float density) const {
+        float value = density * exposure;
+        switch (toneMap) {
+            case ToneMap::Linear:
+                return std::min(value, 1.0f);
+            case ToneMap::Reinhard:
+                return value / (1.0f + value);
+            default:
+                return std::min(std::log1p(value) / std::log1p(64.0f), 1.0f);
+        }
+    }
+
+    template <typename Function>
+    void parallelFor(int count, int numThreads, Function function) const {
+        std::vector<std::thread> threads;
+
+        for (int t = 0; t < numThreads; t++) {
+            threads.emplace_back([&, t]() {
+                TRACE_ZONE("raster worker");
+                for (int i = t; i < count; i += numThreads) {
+                    function(i);
+                }
+            });
+        }
+
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    // Adds one particle's bilinear footprint, clipped to the given tile.
+    void splat(const Particle& particle, float scaleX, float scaleY,
+               int left, int top, int right, int bottom) {
+        float x = (particle.position.x - view.left) * scaleX - 0.5f;
+        float y = (particle.position.y - view.top) * scaleY - 0.5f;
+        int x0 = static_cast<int>(std::floor(x));
+        int y0 = static_cast<int>(std::floor(y));
+        float fx = x - x0;
+        float fy = y - y0;
+        sf::Vector3f color = colorOf(particle);
+
+        const float weights[4] = {(1 - fx) * (1 - fy), fx * (1 - fy), (1 - fx) * fy, fx * fy};
+        for (int corner = 0; corner < 4; corner++) {
+            int px = x0 + (corner & 1);
+            int py = y0 + (corner >> 1);
+            if (px < left || px >= right || py < top || py >= bottom) continue;
+
+            float* pixel = &accumulation[(static_cast<size_t>(py) * width + px) * 4];
+            float weight = weights[corner];
+            pixel[0] += color.x * weight;
+            pixel[1] += color.y * weight;
+            pixel[2] += color.z * weight;
+            pixel[3] += weight;
+        }
+    }
+
+    void render(const std::vector<Particle>& particles) {
+        TRACE_ZONE("SoftwareRenderer::render");
+        if (accumulation.size() != static_cast<size_t>(width) * height * 4) {
+            resize(width, height);
+        }
+
+        const int tileCount = tilesX * tilesY;
+        const int numThreads = std::max(1, std::min(config.threads(), tileCount));
+        const float scaleX = width / view.width;
+        const float scaleY = height / view.height;
+
+        bins.resize(numThreads);
+        for (auto& threadBins : bins) {
+            threadBins.resize(tileCount);
+        }
+
+        // Bin every particle into the tiles its 2x2 footprint touches.
+        const size_t chunkSize = (particles.size() + numThreads - 1) / numThreads;
+        parallelFor(numThreads, numThreads, [&](int thread) {
+            std::vector<std::vector<uint32_t>>& threadBins = bins[thread];
+            for (auto& bin : threadBins) {
+                bin.clear();
+            }
+
+            size_t end = std::min(particles.size(), (thread + 1) * chunkSize);
+            for (size_t i = thread * chunkSize; i < end; i++) {
+                float x = (particles[i].position.x - view.left) * scaleX - 0.5f;
+                float y = (particles[i].position.y - view.top) * scaleY - 0.5f;
+                if (x <= -1.0f || y <= -1.0f || x >= width || y >= height) continue;
+
+                int x0 = static_cast<int>(std::floor(x));
+                int y0 = static_cast<int>(std::floor(y));
+                int tx0 = std::max(x0, 0) / tileSize;
+                int ty0 = std::max(y0, 0) / tileSize;
+                int tx1 = std::min(x0 + 1, width - 1) / tileSize;
+                int ty1 = std::min(y0 + 1, height - 1) / tileSize;
+
+                for (int ty = ty0; ty <= ty1; ty++) {
+                    for (int tx = tx0; tx <= tx1; tx++) {
+                        threadBins[ty * tilesX + tx].push_back(static_cast<uint32_t>(i));
+                    }
+                }
+            }
+        });
+
+        parallelFor(tileCount, numThreads, [&](int tile) {
+            const int left = (tile % tilesX) * tileSize;
+            const int top = (tile / tilesX) * tileSize;
+            const int right = std::min(left + tileSize, width);
+            const int bottom = std::min(top + tileSize, height);
+
+            float* data = accumulation.data();
+            for (int y = top; y < bottom; y++) {
+                std::fill(data + (static_cast<size_t>(y) * width + left) * 4,
+                          data + (static_cast<size_t>(y) * width + right) * 4, 0.0f);
+            }
+
+            for (const auto& threadBins : bins) {
+                for (uint32_t index : threadBins[tile]) {
+                    splat(particles[index], scaleX, scaleY, left, top, right, bottom);
+                }
+            }
+
+            for (int y = top; y < bottom; y++) {
+                for (int x = left; x < right; x++) {
+                    size_t offset = (static_cast<size_t>(y) * width + x) * 4;
+                    const float* pixel = &accumulation[offset];
+                    float density = pixel[3];
+                    float scale = density > 0.0f ? tone(density) / density : 0.0f;
+
+                    pixels[offset + 0] = static_cast<uint8_t>(std::min(pixel[0] * scale, 1.0f) * 255.0f);
+                    pixels[offset + 1] = static_cast<uint8_t>(std::min(pixel[1] * scale, 1.0f) * 255.0f);
+                    pixels[offset + 2] = static_cast<uint8_t>(std::min(pixel[2] * scale, 1.0f) * 255.0f);
+                    pixels[offset + 3] = 255;
+                }
+            }
+        });
+    }
+
+    // Writes the last rendered frame. ".png" goes through sf::Image, anything
+    // else is written as raw RGBA8 rows.
+    bool write(const std::string& path) const {
+        TRACE_ZONE("SoftwareRenderer::write");
+        if (path.size() >= 4 && path.compare(path.size() - 4, 4, ".png") == 0) {
+            sf::Image image;
+            image.create(width, height, pixels.data());
+            return image.saveToFile(path);
+        }
+
+        FILE* file = std::fopen(path.c_str(), "wb");
+        if (!file) return false;
+        bool ok = std::fwrite(pixels.data(), 1, pixels.size(), file) == pixels.size();
+        return (std::fclose(file) == 0) && ok;
+    }
+
+    static ToneMap parseToneMap(const std::string& name) {
+        if (name == "linear") return ToneMap::Linear;
+        if (name == "reinhard") return ToneMap::Reinhard;
+        return ToneMap::Log;
+    }
+
+    static ColorMode parseColorMode(const std::string& name) {
+        if (name == "density") return ColorMode::Density;
+        if (name == "mass") return ColorMode::Mass;
+        return ColorMode::Velocity;
+    }
+};
@@ -10,8 +10,17 @@
 
 
 struct Solver {
+    // Pairs closer than sumOfRadii - contactEpsilon are in contact.
+    constexpr static float contactEpsilon = 1.5f;
+
+    // Contact distance of two particles; merged particles are larger than
+    // the rest.
+    static float sumOfRadii(const Particle& body1, const Particle& body2) {
+        return std::max(body1.radius + body2.radius, config.particleSize * 2.0f);
+    }
+
     static void resolve_collision(Particle& body1, Particle& body2, float sumOfRadii = config.particleSize * 2) {
-        const float EPSILON = 1.5f;
+        const float EPSILON = contactEpsilon;
         
         float dX = body1.position.x - body2.position.x;
         float dY = body1.position.y - body2.position.y;
@@ -21,13 +30,31 @@ struct Solver {
 
         // get the normal force
         sf::Vector2f normalVector((dX / normalMagnitude), (dY / normalMagnitude));
+        if (!bounce(body1, body2, normalVector)) return;
+
+        // Positional correction to prevent overlap
+        float penetrationDepth = sumOfRadii - normalMagnitude + EPSILON;
+        sf::Vector2f correctionVector = normalVector * (penetrationDepth / 2.0f);
+
+        // Block timesteps keep the force of the last evaluation, which the
+        // next opening kick reuses, so only accumulated forces are damped.
+        if (!config.blockTimesteps) {
+            body1.force = -body1.force * 0.5f;
+            body2.force = -body2.force * 0.5f;
+        }
+        // body1.force += correctionVector;
+        // body2.force -= correctionVector;
+    }
 
+    // Exchanges momentum along `normalVector` (unit, pointing from body2 to
+    // body1). Returns false and leaves both alone if they are separating.
+    static bool bounce(Particle& body1, Particle& body2, sf::Vector2f normalVector) {
         // v2 - v1
         sf::Vector2f velocityDifference = body1.velocity - body2.velocity;
 
         // (v2 - v1) * (x2 - x1)
         float dotProductResult = dotProduct(velocityDifference, normalVector);
-        if (dotProductResult > 0) return;
+        if (dotProductResult > 0) return false;
 
         float massScaler1 = (2.0f * body2.mass) / (body1.mass + body2.mass);
         float massScaler2 = (2.0f * body1.mass) / (body1.mass + body2.mass);
@@ -37,14 +64,7 @@ struct Solver {
 
         body1.velocity -= scaleVec(impulse1, config.COLLISION_DAMPENING);
         body2.velocity += scaleVec(impulse2, config.COLLISION_DAMPENING);
-
-        // Positional correction to prevent overlap
-        float penetrationDepth = sumOfRadii - normalMagnitude + EPSILON;
-        sf::Vector2f correctionVector = normalVector * (penetrationDepth / 2.0f);
-        body1.force = -body1.force * 0.5f;
-        body2.force = -body2.force * 0.5f;
-        // body1.force += correctionVector;
-        // body2.force -= correctionVector;
+        return true;
     }
 
     // Brute Force O(n*n)
@@ -68,7 +88,7 @@ struct Solver {
 
         std::mutex forceMutex;
 
-        const int numThreads = std::thread::hardware_concurrency(); 
+        const int numThreads = config.threads();
         const int particlesPerThread = particles.size() / numThreads;
 
         auto calculateForcesInRange = [&](int startIdx, int endIdx) {
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <utility>
+
+// Bounded lock-free queue for exactly one producer and one consumer thread.
+template <typename T, size_t Capacity>
+struct SpscQueue {
+    std::array<T, Capacity> slots;
+    std::atomic<size_t> head{0};    // Next slot to pop, written by the consumer
+    std::atomic<size_t> tail{0};    // Next slot to push, written by the producer
+
+    // Returns false if the queue is full.
+    bool push(T&& item) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == Capacity) return false;
+
+        slots[t % Capacity] = std::move(item);
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Returns false if the queue is empty.
+    bool pop(T& item) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) return false;
+
+        item = std::move(slots[h % Capacity]);
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+};
@@ -0,0 +1,274 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include "CollisionGrid.hpp"
+#include "Config.hpp"
+#include "NeighbourList.hpp"
+#include "Numa.hpp"
+#include "Particle.hpp"
+#include "RigidBodies.hpp"
+#include "PerfCounters.hpp"
+#include "Solver.hpp"
+#include "Trace.hpp"
+
+/*
+Continuous collision detection for fast particles.
+
+The grid only sees where particles are at the start of a step, so a
+particle that moves more than its own size in one step (a launched clump)
+can pass through others without ever overlapping them. Particles whose
+displacement this step exceeds config.sweptThreshold particle radii are
+swept instead: their path is tested against every particle near it for
+the earliest time the two come within contact range, each moving along its
+own path.
+
+The grid query of a fast particle covers the box around its path, grown by
+the contact range plus the furthest any particle moves this step, so the
+slow and fast particles that can reach the path are both found. Only fast
+particles query, so the cost scales with how many there are and how far
+they move, and a step without any is a single pass over the velocities.
+
+Detection runs on all threads and only reads. The impacts are then applied
+in particle order: both particles bounce as in Solver::resolve_collision at
+their positions at the time of impact, and their positions are shifted so
+that integration moves them along the old velocity up to the impact and
+along the new one after it. A bounce only takes part of the approach speed
+away, so the particles that hit something are swept again from their
+impact onwards, up to maxPasses times a step. An impact whose partner was
+moved by an earlier one in the same pass is found again in the next.
+
+Block timesteps do not need this, they give fast particles finer steps
+instead.
+*/
+struct SweptCollisions {
+    constexpr static uint32_t none = UINT32_MAX;
+    constexpr static int maxPasses = 4;
+
+    struct Impact {
+        uint32_t other = none;
+        float time = 2.0f;      // Fraction of the step, > 1 for none
+    };
+
+    // Per fast particle, by position in `fast`
+    static std::vector<uint32_t> fast;      // Particle indices, ascending
+    static std::vector<Impact> impacts;     // Earliest impact in the current pass
+    static std::vector<float> after;        // Time of the last impact handled
+    static std::vector<uint32_t> lastOther; // Partner of that impact
+
+    static std::vector<uint32_t> active;    // Fast particles swept in this pass
+    static std::vector<uint32_t> next;
+    static std::vector<uint8_t> touched;    // Per particle, moved in this pass
+    static float maxDisplacement;
+    static size_t lastImpacts;              // Impacts applied in the last step
+
+    static bool isEnabled() {
+        return config.sweptThreshold > 0.0f && !config.blockTimesteps;
+    }
+
+    // Displacement the integrator (Particle::update) will apply this step.
+    static sf::Vector2f displacement(const Particle& particle, float dt) {
+        if (particle.mass <= 0.0f) return particle.velocity;
+        return particle.velocity + particle.force / particle.mass * dt;
+    }
+
+    static float limit() {
+        return config.sweptThreshold * Config::particleSize;
+    }
+
+    // Cheap check made before the task graph is built, from last step's
+    // velocities. Forces this step could push a particle over the limit, so
+    // this looks for half of it.
+    static bool mayBeNeeded(const std::vector<Particle>& particles) {
+        if (!isEnabled()) return false;
+        const float half = 0.5f * limit();
+        for (const Particle& particle : particles) {
+            if (particle.velocity.x * particle.velocity.x + particle.velocity.y * particle.velocity.y > half * half) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Runs after the collision phase and before integration. The grid must
+    // hold the current positions unless `refreshGrid` is set.
+    static void apply(std::vector<Particle>& particles, float dt, bool refreshGrid) {
+        TRACE_ZONE("SweptCollisions::apply");
+        lastImpacts = 0;
+        if (!isEnabled()) return;
+
+        fast.clear();
+        maxDisplacement = 0.0f;
+        const float limitSquared = limit() * limit();
+        for (size_t i = 0; i < particles.size(); i++) {
+            if (RigidBodies::isCenter(i)) continue;
+            sf::Vector2f d = displacement(particles[i], dt);
+            float lengthSquared = d.x * d.x + d.y * d.y;
+            if (lengthSquared > limitSquared) {
+                fast.push_back(static_cast<uint32_t>(i));
+                maxDisplacement = std::max(maxDisplacement, std::sqrt(lengthSquared));
+            }
+        }
+        if (fast.empty()) return;
+
+        if (refreshGrid) CollisionGrid::assignParticlesToGrid(particles);
+        impacts.assign(fast.size(), Impact());
+        after.assign(fast.size(), 0.0f);
+        lastOther.assign(fast.size(), none);
+        touched.assign(particles.size(), 0);
+
+        active.resize(fast.size());
+        for (size_t k = 0; k < fast.size(); k++) {
+            active[k] = static_cast<uint32_t>(k);
+        }
+
+        for (int pass = 0; pass < maxPasses && !active.empty(); pass++) {
+            detect(particles, dt);
+
+            next.clear();
+            for (uint32_t k : active) {
+                respond(particles, k, dt);
+            }
+            for (uint32_t k : active) {
+                touched[fast[k]] = 0;
+                if (impacts[k].other != none) touched[impacts[k].other] = 0;
+            }
+
+            std::sort(next.begin(), next.end());
+            next.erase(std::unique(next.begin(), next.end()), next.end());
+            active.swap(next);
+        }
+    }
+
+    // Finds the next impact of every active fast particle.
+    static void detect(const std::vector<Particle>& particles, float dt) {
+        const int numThreads = std::max(1, std::min(config.threads(), static_cast<int>(active.size())));
+        const size_t perThread = (active.size() + numThreads - 1) / numThreads;
+        std::vector<std::thread> threads;
+        for (int t = 0; t < numThreads; t++) {
+            size_t start = t * perThread;
+            size_t end = std::min(active.size(), start + perThread);
+            threads.emplace_back([&particles, dt, start, end, t, numThreads]() {
+                TRACE_ZONE("swept worker");
+                PERF_ZONE(PerfPhase::Collision);
+                Numa::pinWorker(t, numThreads);
+                for (size_t a = start; a < end; a++) {
+                    impacts[active[a]] = findImpact(particles, active[a], dt);
+                }
+            });
+        }
+
+        for (auto& t : threads) {
+            t.join();
+        }
+    }
+
+    // Time in (after, 1] at which two particles `offset` apart, whose offset
+    // changes by `relative` over the step, come within `range`; > 1 if
+    // never. Pairs already in range at `after` are left to the grid.
+    static float timeOfImpact(sf::Vector2f offset, sf::Vector2f relative, float range, float after) {
+        float a = relative.x * relative.x + relative.y * relative.y;
+        if (a <= 0.0f) return 2.0f;
+
+        float b = offset.x * relative.x + offset.y * relative.y;
+        float c = offset.x * offset.x + offset.y * offset.y - range * range;
+        float discriminant = b * b - a * c;
+        if (discriminant < 0.0f) return 2.0f;
+
+        float time = (-b - std::sqrt(discriminant)) / a;
+        return time > after ? time : 2.0f;
+    }
+
+    static Impact findImpact(const std::vector<Particle>& particles, uint32_t k, float dt) {
+        const Particle& particle = particles[fast[k]];
+        const Particle* base = particles.data();
+        const sf::Vector2f d = displacement(particle, dt);
+        const float range = NeighbourList::contactRange();
+        const float reach = range + std::max(limit(), maxDisplacement);
+        const int cellSize = CollisionGrid::cellSize;
+
+        sf::Vector2f end = particle.position + d;
+        int colStart = std::max(0, static_cast<int>(std::floor((std::min(particle.position.x, end.x) - reach) / cellSize)));
+        int colEnd = std::min(CollisionGrid::nColumns - 1, static_cast<int>(std::floor((std::max(particle.position.x, end.x) + reach) / cellSize)));
+        int rowStart = std::max(0, static_cast<int>(std::floor((std::min(particle.position.y, end.y) - reach) / cellSize)));
+        int rowEnd = std::min(CollisionGrid::nRows - 1, static_cast<int>(std::floor((std::max(particle.position.y, end.y) + reach) / cellSize)));
+
+        Impact impact;
+        for (int col = colStart; col <= colEnd; col++) {
+            for (int row = rowStart; row <= rowEnd; row++) {
+                for (const Particle* other : CollisionGrid::cells[col][row]) {
+                    uint32_t otherIndex = static_cast<uint32_t>(other - base);
+                    if (other == &particle || otherIndex == lastOther[k]) continue;
+                    if (RigidBodies::isSameBody(base, &particle, other)) continue;
+
+                    float time = timeOfImpact(particle.position - other->position, d - displacement(*other, dt), range, after[k]);
+                    if (time <= 1.0f && time < impact.time) {
+                        impact.time = time;
+                        impact.other = otherIndex;
+                    }
+                }
+            }
+        }
+        return impact;
+    }
+
+    static void respond(std::vector<Particle>& particles, uint32_t k, float dt) {
+        const Impact& impact = impacts[k];
+        if (impact.other == none) return;
+
+        const uint32_t index = fast[k];
+        const uint32_t otherIndex = impact.other;
+        auto found = std::lower_bound(fast.begin(), fast.end(), otherIndex);
+        const uint32_t otherK = found != fast.end() && *found == otherIndex ? static_cast<uint32_t>(found - fast.begin()) : none;
+
+        // Either was moved by an earlier impact, so this one may not happen
+        // any more. This includes the pair of two fast particles that found
+        // each other, which the lower one handled.
+        if (touched[index] || touched[otherIndex]) {
+            next.push_back(k);
+            return;
+        }
+
+        Particle& particle = particles[index];
+        Particle& other = particles[otherIndex];
+        const float time = impact.time;
+
+        sf::Vector2f offset = (particle.position + displacement(particle, dt) * time) -
+                              (other.position + displacement(other, dt) * time);
+        float distance = std::sqrt(offset.x * offset.x + offset.y * offset.y);
+        if (distance < Config::epsilon) return;
+
+        sf::Vector2f velocity = particle.velocity;
+        sf::Vector2f otherVelocity = other.velocity;
+        if (!Solver::bounce(particle, other, offset / distance)) return;
+
+        particle.position += (velocity - particle.velocity) * time;
+        other.position += (otherVelocity - other.velocity) * time;
+        touched[index] = 1;
+        touched[otherIndex] = 1;
+        lastImpacts++;
+
+        after[k] = time;
+        lastOther[k] = otherIndex;
+        next.push_back(k);
+        if (otherK != none) {
+            after[otherK] = time;
+            lastOther[otherK] = index;
+            next.push_back(otherK);
+        }
+    }
+};
+
+std::vector<uint32_t> SweptCollisions::fast;
+std::vector<SweptCollisions::Impact> SweptCollisions::impacts;
+std::vector<float> SweptCollisions::after;
+std::vector<uint32_t> SweptCollisions::lastOther;
+std::vector<uint32_t> SweptCollisions::active;
+std::vector<uint32_t> SweptCollisions::next;
+std::vector<uint8_t> SweptCollisions::touched;
+float SweptCollisions::maxDisplacement = 0.0f;
+size_t SweptCollisions::lastImpacts = 0;
@@ -0,0 +1,227 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Config.hpp"
+#include "Numa.hpp"
+#include "Trace.hpp"
+
+/*
+A set of tasks with explicit dependencies, run once per frame.
+
+    TaskGraph graph;
+    int build = graph.add("build", [&]() { ... });
+    int walk = graph.add("walk", [&]() { ... }, {build});
+    graph.run();
+
+A task becomes ready when everything it depends on has finished, so
+independent work overlaps instead of waiting at a join. run() returns when
+every task has finished. Tasks must not throw.
+*/
+struct TaskGraph {
+    struct Task {
+        const char* name;
+        std::function<void()> work;
+        std::vector<int> successors;
+        int dependencies = 0;
+        std::atomic<int> remaining{0};
+    };
+
+    // deque so tasks keep their address while the graph grows
+    std::deque<Task> tasks;
+
+    int add(const char* name, std::function<void()> work, const std::vector<int>& dependencies = {}) {
+        const int id = static_cast<int>(tasks.size());
+        Task& task = tasks.emplace_back();
+        task.name = name;
+        task.work = std::move(work);
+
+        for (int dependency : dependencies) {
+            if (dependency < 0) continue;
+            tasks[dependency].successors.push_back(id);
+            task.dependencies++;
+        }
+        return id;
+    }
+
+    void run();
+};
+
+/*
+Persistent workers with one deque each. A worker pushes the tasks it makes
+ready onto the back of its own deque and pops from the back, so dependent
+work tends to stay on the core that has its data in cache. Workers that run
+dry steal from the front of the others' deques. The thread calling run()
+works as worker 0 until the graph is done.
+*/
+struct TaskScheduler {
+    struct Queue {
+        std::mutex mutex;
+        std::deque<TaskGraph::Task*> tasks;
+    };
+
+    static std::vector<std::unique_ptr<Queue>> queues;
+    static std::vector<std::thread> workers;
+
+    static std::mutex sleepMutex;
+    static std::condition_variable wake;
+    static std::atomic<int> queued;         // Ready tasks not yet taken
+    static std::atomic<int> unfinished;     // Tasks of the running graph not yet done
+    static bool isStopping;
+
+    static TaskGraph* graph;
+
+    // (Re)starts the workers when the thread count changed.
+    static void ensureWorkers(int count) {
+        count = std::max(1, count);
+        if (static_cast<int>(queues.size()) == count) return;
+
+        shutdown();
+        static bool isRegistered = (std::atexit(shutdown), true);
+        (void)isRegistered;
+
+        isStopping = false;
+        for (int i = 0; i < count; i++) {
+            queues.push_back(std::make_unique<Queue>());
+        }
+        for (int i = 1; i < count; i++) {
+            workers.emplace_back(workerLoop, i, count);
+        }
+    }
+
+    static void shutdown() {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            isStopping = true;
+        }
+        wake.notify_all();
+
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        workers.clear();
+        queues.clear();
+    }
+
+    static void push(int index, TaskGraph::Task* task) {
+        {
+            std::lock_guard<std::mutex> lock(queues[index]->mutex);
+            queues[index]->tasks.push_back(task);
+        }
+        queued++;
+
+        // Taking the lock orders this with a worker that is about to sleep.
+        { std::lock_guard<std::mutex> lock(sleepMutex); }
+        wake.notify_one();
+    }
+
+    static TaskGraph::Task* take(int index) {
+        const int count = static_cast<int>(queues.size());
+
+        for (int i = 0; i < count; i++) {
+            Queue& queue = *queues[(index + i) % count];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.tasks.empty()) continue;
+
+            TaskGraph::Task* task;
+            if (i == 0) {
+                task = queue.tasks.back();
+                queue.tasks.pop_back();
+            } else {
+                task = queue.tasks.front();
+                queue.tasks.pop_front();
+            }
+            queued--;
+            return task;
+        }
+        return nullptr;
+    }
+
+    static void execute(int index, TaskGraph::Task* task, TaskGraph& graph) {
+        {
+            TRACE_ZONE(task->name);
+            task->work();
+        }
+
+        for (int successor : task->successors) {
+            TaskGraph::Task& next = graph.tasks[successor];
+            if (next.remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                push(index, &next);
+            }
+        }
+
+        if (unfinished.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            { std::lock_guard<std::mutex> lock(sleepMutex); }
+            wake.notify_all();
+        }
+    }
+
+    static void workerLoop(int index, int count) {
+        Numa::pinWorker(index, count);
+
+        while (true) {
+            TaskGraph::Task* task = take(index);
+            if (task) {
+                execute(index, task, *graph);
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            wake.wait(lock, []() { return isStopping || queued.load() > 0; });
+            if (isStopping) return;
+        }
+    }
+
+    static void run(TaskGraph& taskGraph) {
+        if (taskGraph.tasks.empty()) return;
+        ensureWorkers(config.threads());
+
+        graph = &taskGraph;
+        unfinished = static_cast<int>(taskGraph.tasks.size());
+
+        // Spread the tasks that are ready from the start over all deques.
+        int next = 0;
+        for (TaskGraph::Task& task : taskGraph.tasks) {
+            task.remaining = task.dependencies;
+        }
+        for (TaskGraph::Task& task : taskGraph.tasks) {
+            if (task.dependencies == 0) {
+                push(next, &task);
+                next = (next + 1) % static_cast<int>(queues.size());
+            }
+        }
+
+        while (unfinished.load() > 0) {
+            TaskGraph::Task* task = take(0);
+            if (task) {
+                execute(0, task, taskGraph);
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            wake.wait(lock, []() { return unfinished.load() == 0 || queued.load() > 0; });
+        }
+    }
+};
+
+void TaskGraph::run() {
+    TaskScheduler::run(*this);
+}
+
+std::vector<std::unique_ptr<TaskScheduler::Queue>> TaskScheduler::queues;
+std::vector<std::thread> TaskScheduler::workers;
+
+std::mutex TaskScheduler::sleepMutex;
+std::condition_variable TaskScheduler::wake;
+std::atomic<int> TaskScheduler::queued(0);
+std::atomic<int> TaskScheduler::unfinished(0);
+bool TaskScheduler::isStopping = false;
+TaskGraph* TaskScheduler::graph = nullptr;
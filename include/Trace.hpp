@@ -0,0 +1,193 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/*
+Scoped trace zones.
+
+Every thread records into its own fixed size ring buffer, so recording a zone
+is two clock reads and a store with no locking. Buffers are handed out as
+"lanes": when a thread exits its lane goes back to a free list and the next
+thread reuses it, so the per-frame worker threads show up as a stable set of
+tracks instead of a new track per frame.
+
+    TRACE_ZONE("QuadTree::insert");
+
+Trace::dump() writes everything still in the rings as Chrome trace JSON,
+which loads in chrome://tracing and ui.perfetto.dev.
+*/
+
+struct TraceEvent {
+    const char* name;       // Must be a string literal
+    uint64_t startNs;
+    uint64_t durationNs;
+};
+
+// A TraceEvent that dump() can read while its thread writes it. Relaxed
+// atomics compile to plain stores.
+struct TraceSlot {
+    std::atomic<const char*> name;
+    std::atomic<uint64_t> startNs;
+    std::atomic<uint64_t> durationNs;
+
+    void store(const TraceEvent& event) {
+        name.store(event.name, std::memory_order_relaxed);
+        startNs.store(event.startNs, std::memory_order_relaxed);
+        durationNs.store(event.durationNs, std::memory_order_relaxed);
+    }
+
+    TraceEvent load() const {
+        return {name.load(std::memory_order_relaxed), startNs.load(std::memory_order_relaxed),
+                durationNs.load(std::memory_order_relaxed)};
+    }
+};
+
+struct TraceBuffer {
+    constexpr static size_t capacity = 1 << 14;
+
+    std::array<TraceSlot, capacity> events;
+    std::atomic<uint64_t> head{0};     // Total events ever written
+    int lane = 0;
+
+    // Only called by the owning thread. The fence orders the last head
+    // update before the slot stores, so a reader that sees any of them
+    // also sees that head (see Trace::dump).
+    void push(const TraceEvent& event) {
+        uint64_t index = head.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        events[index % capacity].store(event);
+        head.store(index + 1, std::memory_order_release);
+    }
+};
+
+struct Trace {
+    static std::atomic<bool> enabled;
+    static std::string outputPath;
+
+    static std::mutex registryMutex;
+    static std::vector<TraceBuffer*> buffers;
+    static std::vector<TraceBuffer*> freeBuffers;
+
+    static uint64_t now() {
+        using namespace std::chrono;
+        return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+    }
+
+    static TraceBuffer* acquireBuffer() {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        if (!freeBuffers.empty()) {
+            TraceBuffer* buffer = freeBuffers.back();
+            freeBuffers.pop_back();
+            return buffer;
+        }
+
+        TraceBuffer* buffer = new TraceBuffer();
+        buffer->lane = static_cast<int>(buffers.size());
+        buffers.push_back(buffer);
+        return buffer;
+    }
+
+    static void releaseBuffer(TraceBuffer* buffer) {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        freeBuffers.push_back(buffer);
+    }
+
+    // Returns the calling thread's buffer, taking a lane on first use.
+    static TraceBuffer& local() {
+        struct Owner {
+            TraceBuffer* buffer = acquireBuffer();
+            ~Owner() { releaseBuffer(buffer); }
+        };
+        thread_local Owner owner;
+        return *owner.buffer;
+    }
+
+    static void record(const char* name, uint64_t startNs, uint64_t endNs) {
+        local().push({name, startNs, endNs - startNs});
+    }
+
+    // Writes the contents of every ring as Chrome trace JSON. Safe to call
+    // while other threads keep recording: the slots are atomic, and events
+    // overwritten or being written during the copy are dropped.
+    static bool dump(const std::string& path) {
+        std::vector<std::pair<int, TraceEvent>> events;
+        size_t laneCount;
+        {
+            std::lock_guard<std::mutex> lock(registryMutex);
+            laneCount = buffers.size();
+
+            for (TraceBuffer* buffer : buffers) {
+                uint64_t end = buffer->head.load(std::memory_order_acquire);
+                uint64_t begin = end > TraceBuffer::capacity ? end - TraceBuffer::capacity : 0;
+                size_t first = events.size();
+
+                for (uint64_t i = begin; i < end; i++) {
+                    events.emplace_back(buffer->lane, buffer->events[i % TraceBuffer::capacity].load());
+                }
+
+                // Anything the writer lapped while we were copying is garbage,
+                // including the slot of the event it may be writing now.
+                std::atomic_thread_fence(std::memory_order_acquire);
+                uint64_t after = buffer->head.load(std::memory_order_relaxed) + 1;
+                uint64_t overwritten = after > TraceBuffer::capacity ? after - TraceBuffer::capacity : 0;
+                if (overwritten > begin) {
+                    size_t drop = static_cast<size_t>(std::min(overwritten - begin, end - begin));
+                    events.erase(events.begin() + first, events.begin() + first + drop);
+                }
+            }
+        }
+
+        FILE* file = std::fopen(path.c_str(), "w");
+        if (!file) return false;
+
+        std::fprintf(file, "{\"traceEvents\":[\n");
+        for (size_t lane = 0; lane < laneCount; lane++) {
+            std::string laneName = lane == 0 ? "main" : "lane " + std::to_string(lane);
+            std::fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%zu,"
+                               "\"args\":{\"name\":\"%s\"}},\n",
+                         lane, laneName.c_str());
+        }
+
+        for (size_t i = 0; i < events.size(); i++) {
+            const TraceEvent& event = events[i].second;
+            std::fprintf(file, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}%s\n",
+                         event.name, events[i].first, event.startNs / 1000.0, event.durationNs / 1000.0,
+                         i + 1 < events.size() ? "," : "");
+        }
+
+        std::fprintf(file, "]}\n");
+        return std::fclose(file) == 0;
+    }
+};
+
+struct TraceZone {
+    const char* name;
+    uint64_t start = 0;
+
+    explicit TraceZone(const char* name) : name(name) {
+        if (Trace::enabled.load(std::memory_order_relaxed)) start = Trace::now();
+    }
+
+    ~TraceZone() {
+        if (start) Trace::record(name, start, Trace::now());
+    }
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_ZONE(name) TraceZone TRACE_CONCAT(traceZone, __LINE__)(name)
+
+std::atomic<bool> Trace::enabled(false);
+std::string Trace::outputPath = "trace.json";
+
+std::mutex Trace::registryMutex;
+std::vector<TraceBuffer*> Trace::buffers;
+std::vector<TraceBuffer*> Trace::freeBuffers;
@@ -0,0 +1,329 @@
+#pragma once
+
+#include <condition_variable>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Particle.hpp"
+#include "Trace.hpp"
+
+/*
+Trajectory output:
+
+    <dir>/frames.idx        TrajectoryIndexHeader followed by one fixed size
+                            TrajectoryIndexEntry per frame, so frame n lives at
+                            sizeof(header) + n * sizeof(entry).
+    <dir>/chunk_NNNNN.trj   Encoded frames, framesPerChunk per file.
+
+Each frame holds four channels (position x/y, velocity x/y). Values are
+quantized to fixed point, delta coded against the previous frame and written
+as zigzag varints, so slow moving bodies cost a byte or two per channel.
+Every chunk starts with a keyframe (coded against zero) and a keyframe is
+also forced whenever the particle count changes, so decoding any frame only
+needs the frames back to its keyframe.
+*/
+
+struct TrajectoryIndexHeader {
+    char magic[8];          // "MAGTRAJ"
+    uint32_t version;
+    uint32_t framesPerChunk;
+    float positionScale;    // Quantization steps per pixel
+    float velocityScale;    // Quantization steps per pixel/frame
+};
+
+struct TrajectoryIndexEntry {
+    uint64_t step;          // Simulation step of the frame
+    uint64_t offset;        // Byte offset inside its chunk
+    uint32_t bytes;         // Encoded size
+    uint32_t chunk;
+    uint32_t count;         // Number of particles
+    uint32_t keyframe;      // Frame number of the keyframe it depends on
+};
+
+struct TrajectoryCodec {
+    enum Channel { PositionX, PositionY, VelocityX, VelocityY, ChannelCount };
+
+    // Values are kept within +-limit so that the difference of any two still
+    // fits in an int32.
+    constexpr static float limit = 1.0e9f;
+
+    static int32_t quantize(float value, float scale) {
+        float scaled = value * scale;
+        if (scaled > limit) scaled = limit;
+        if (scaled < -limit) scaled = -limit;
+        return static_cast<int32_t>(std::lrintf(scaled));
+    }
+
+    static void writeVarint(std::vector<uint8_t>& out, int32_t value) {
+        uint32_t zigzag = (static_cast<uint32_t>(value) << 1) ^ static_cast<uint32_t>(value >> 31);
+        while (zigzag >= 0x80) {
+            out.push_back(static_cast<uint8_t>(zigzag | 0x80));
+            zigzag >>= 7;
+        }
+        out.push_back(static_cast<uint8_t>(zigzag));
+    }
+
+    // Reads one varint from [in, end). Throws on data that runs out or
+    // does not fit 32 bits.
+    static const uint8_t* readVarint(const uint8_t* in, const uint8_t* end, int32_t& value) {
+        uint32_t zigzag = 0;
+        int shift = 0;
+        for (;;) {
+            if (in == end) throw std::runtime_error("Trajectory frame is truncated");
+            if (shift > 28) throw std::runtime_error("Trajectory frame holds an overlong varint");
+            if (!(*in & 0x80)) break;
+            zigzag |= static_cast<uint32_t>(*in++ & 0x7f) << shift;
+            shift += 7;
+        }
+        zigzag |= static_cast<uint32_t>(*in++) << shift;
+        value = static_cast<int32_t>(zigzag >> 1) ^ -static_cast<int32_t>(zigzag & 1);
+        return in;
+    }
+
+    // Appends one channel, delta coded against `previous` (nullptr for keyframes).
+    static void encodeChannel(std::vector<uint8_t>& out, const int32_t* values,
+                              const int32_t* previous, size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            writeVarint(out, previous ? values[i] - previous[i] : values[i]);
+        }
+    }
+
+    // Decodes one channel in place: `values` holds the previous frame on entry
+    // for delta frames and the decoded frame on return.
+    static const uint8_t* decodeChannel(const uint8_t* in, const uint8_t* end, int32_t* values,
+                                        size_t count, bool isDelta) {
+        for (size_t i = 0; i < count; i++) {
+            int32_t value;
+            in = readVarint(in, end, value);
+            // Wraps instead of overflowing on a corrupt file
+            values[i] = isDelta ? static_cast<int32_t>(static_cast<uint32_t>(values[i]) + static_cast<uint32_t>(value)) : value;
+        }
+        return in;
+    }
+};
+
+struct TrajectoryWriter {
+    struct StagedFrame {
+        uint64_t step = 0;
+        std::vector<float> channels[TrajectoryCodec::ChannelCount];
+    };
+
+    constexpr static char magic[8] = "MAGTRAJ";
+    constexpr static uint32_t version = 1;
+
+    static std::string directory;
+    static int interval;                // Record every N steps, 0 = disabled
+    static uint32_t framesPerChunk;
+    static float positionScale;
+    static float velocityScale;
+    static size_t stagingBuffers;       // Frames that may be in flight at once
+
+    static std::mutex queueMutex;
+    static std::condition_variable frameQueued;
+    static std::condition_variable bufferFreed;
+    static std::deque<StagedFrame*> queue;
+    static std::vector<StagedFrame*> freeBuffers;
+    static std::vector<StagedFrame> buffers;
+    static std::thread worker;
+    static bool isRunning;
+
+    // Encoder state, only touched by the worker thread.
+    static std::vector<int32_t> quantized[TrajectoryCodec::ChannelCount];
+    static std::vector<int32_t> previous[TrajectoryCodec::ChannelCount];
+    static std::vector<uint8_t> encoded;
+    static FILE* chunkFile;
+    static FILE* indexFile;
+    static uint32_t frameNumber;
+    static uint32_t lastKeyframe;
+    static uint64_t chunkOffset;
+
+    static void start() {
+        if (interval <= 0 || isRunning) return;
+
+        std::filesystem::create_directories(directory);
+        indexFile = std::fopen((directory + "/frames.idx").c_str(), "wb");
+        if (!indexFile) {
+            std::cerr << "Could not create trajectory index in " << directory << std::endl;
+            return;
+        }
+
+        TrajectoryIndexHeader header = {};
+        std::memcpy(header.magic, magic, sizeof(magic));
+        header.version = version;
+        header.framesPerChunk = framesPerChunk;
+        header.positionScale = positionScale;
+        header.velocityScale = velocityScale;
+        std::fwrite(&header, sizeof(header), 1, indexFile);
+
+        buffers.resize(stagingBuffers);
+        for (StagedFrame& buffer : buffers) {
+            freeBuffers.push_back(&buffer);
+        }
+
+        frameNumber = 0;
+        isRunning = true;
+        worker = std::thread(run);
+    }
+
+    // Copies the current particle state into a staging buffer. Blocks only
+    // when every staging buffer is still waiting to be encoded.
+    static void capture(uint64_t step) {
+        if (!isRunning || step % interval != 0) return;
+        TRACE_ZONE("TrajectoryWriter::capture");
+
+        StagedFrame* frame;
+        {
+            std::unique_lock<std::mutex> lock(queueMutex);
+            bufferFreed.wait(lock, [] { return !freeBuffers.empty(); });
+            frame = freeBuffers.back();
+            freeBuffers.pop_back();
+        }
+
+        const std::vector<Particle>& particles = Particle::particles;
+        const size_t count = particles.size();
+
+        frame->step = step;
+        for (auto& channel : frame->channels) {
+            channel.resize(count);
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            frame->channels[TrajectoryCodec::PositionX][i] = particles[i].position.x;
+            frame->channels[TrajectoryCodec::PositionY][i] = particles[i].position.y;
+            frame->channels[TrajectoryCodec::VelocityX][i] = particles[i].velocity.x;
+            frame->channels[TrajectoryCodec::VelocityY][i] = particles[i].velocity.y;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            queue.push_back(frame);
+        }
+        frameQueued.notify_one();
+    }
+
+    static void run() {
+        while (true) {
+            StagedFrame* frame;
+            {
+                std::unique_lock<std::mutex> lock(queueMutex);
+                frameQueued.wait(lock, [] { return !queue.empty() || !isRunning; });
+                if (queue.empty()) break;
+                frame = queue.front();
+                queue.pop_front();
+            }
+
+            encodeFrame(*frame);
+
+            {
+                std::lock_guard<std::mutex> lock(queueMutex);
+                freeBuffers.push_back(frame);
+            }
+            bufferFreed.notify_one();
+        }
+
+        if (chunkFile) std::fclose(chunkFile);
+        if (indexFile) std::fclose(indexFile);
+        chunkFile = nullptr;
+        indexFile = nullptr;
+    }
+
+    static void encodeFrame(const StagedFrame& frame) {
+        TRACE_ZONE("TrajectoryWriter::encodeFrame");
+        const size_t count = frame.channels[0].size();
+        const uint32_t chunk = frameNumber / framesPerChunk;
+        const bool isChunkStart = frameNumber % framesPerChunk == 0;
+
+        if (isChunkStart) {
+            if (chunkFile) std::fclose(chunkFile);
+            char name[32];
+            std::snprintf(name, sizeof(name), "/chunk_%05u.trj", chunk);
+            chunkFile = std::fopen((directory + name).c_str(), "wb");
+            chunkOffset = 0;
+        }
+
+        const bool isKeyframe = isChunkStart || previous[0].size() != count;
+        if (isKeyframe) lastKeyframe = frameNumber;
+
+        encoded.clear();
+        for (int c = 0; c < TrajectoryCodec::ChannelCount; c++) {
+            float scale = c < TrajectoryCodec::VelocityX ? positionScale : velocityScale;
+            quantized[c].resize(count);
+            for (size_t i = 0; i < count; i++) {
+                quantized[c][i] = TrajectoryCodec::quantize(frame.channels[c][i], scale);
+            }
+
+            TrajectoryCodec::encodeChannel(encoded, quantized[c].data(),
+                                           isKeyframe ? nullptr : previous[c].data(), count);
+            previous[c].swap(quantized[c]);
+        }
+
+        if (!chunkFile || std::fwrite(encoded.data(), 1, encoded.size(), chunkFile) != encoded.size()) {
+            std::cerr << "Failed to write trajectory frame " << frameNumber << std::endl;
+        }
+
+        TrajectoryIndexEntry entry = {};
+        entry.step = frame.step;
+        entry.offset = chunkOffset;
+        entry.bytes = static_cast<uint32_t>(encoded.size());
+        entry.chunk = chunk;
+        entry.count = static_cast<uint32_t>(count);
+        entry.keyframe = lastKeyframe;
+        std::fwrite(&entry, sizeof(entry), 1, indexFile);
+
+        chunkOffset += encoded.size();
+        frameNumber++;
+
+        // Keep completed chunks readable while the run is still going.
+        if (frameNumber % framesPerChunk == 0) {
+            std::fflush(chunkFile);
+            std::fflush(indexFile);
+        }
+    }
+
+    // Encodes whatever is still queued and closes the files.
+    static void stop() {
+        if (!isRunning) return;
+
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            isRunning = false;
+        }
+        frameQueued.notify_one();
+        worker.join();
+    }
+};
+
+std::string TrajectoryWriter::directory = "trajectory";
+int TrajectoryWriter::interval = 0;
+uint32_t TrajectoryWriter::framesPerChunk = 256;
+float TrajectoryWriter::positionScale = 256.0f;
+float TrajectoryWriter::velocityScale = 4096.0f;
+size_t TrajectoryWriter::stagingBuffers = 2;
+
+std::mutex TrajectoryWriter::queueMutex;
+std::condition_variable TrajectoryWriter::frameQueued;
+std::condition_variable TrajectoryWriter::bufferFreed;
+std::deque<TrajectoryWriter::StagedFrame*> TrajectoryWriter::queue;
+std::vector<TrajectoryWriter::StagedFrame*> TrajectoryWriter::freeBuffers;
+std::vector<TrajectoryWriter::StagedFrame> TrajectoryWriter::buffers;
+std::thread TrajectoryWriter::worker;
+bool TrajectoryWriter::isRunning = false;
+
+std::vector<int32_t> TrajectoryWriter::quantized[TrajectoryCodec::ChannelCount];
+std::vector<int32_t> TrajectoryWriter::previous[TrajectoryCodec::ChannelCount];
+std::vector<uint8_t> TrajectoryWriter::encoded;
+FILE* TrajectoryWriter::chunkFile = nullptr;
+FILE* TrajectoryWriter::indexFile = nullptr;
+uint32_t TrajectoryWriter::frameNumber = 0;
+uint32_t TrajectoryWriter::lastKeyframe = 0;
+uint64_t TrajectoryWriter::chunkOffset = 0;
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/*
+Message passing between the processes of a distributed run (see
+Distributed). A transport connects `size` ranks and moves opaque byte
+buffers between them; everything collective is built on sendReceive so a
+new backend only has to implement that one call.
+*/
+struct Transport {
+    virtual ~Transport() = default;
+
+    virtual int rank() const = 0;
+    virtual int size() const = 0;
+
+    // Sends `out` to destination while receiving one message from source.
+    // Both sides of every pair call this in the same round, so it must not
+    // wait for the send to finish before starting to receive.
+    virtual std::vector<char> sendReceive(int destination, const std::vector<char>& out, int source) = 0;
+
+    // outgoing[r] is sent to rank r; returns what every rank sent to this
+    // one. outgoing[rank()] is passed through unchanged.
+    std::vector<std::vector<char>> allToAll(const std::vector<std::vector<char>>& outgoing) {
+        std::vector<std::vector<char>> incoming(size());
+        incoming[rank()] = outgoing[rank()];
+
+        for (int round = 1; round < size(); round++) {
+            int destination = (rank() + round) % size();
+            int source = (rank() - round + size()) % size();
+            incoming[source] = sendReceive(destination, outgoing[destination], source);
+        }
+        return incoming;
+    }
+
+    std::vector<std::vector<char>> allGather(const std::vector<char>& bytes) {
+        return allToAll(std::vector<std::vector<char>>(size(), bytes));
+    }
+};
+
+/*
+Unix domain socket backend for ranks on one machine. The parent creates one
+socketpair per pair of ranks before forking, so every rank ends up with a
+direct, full duplex connection to every other rank. Messages are framed
+with a 64 bit length.
+*/
+struct SocketTransport : Transport {
+    int ownRank = 0;
+    std::vector<int> sockets;   // sockets[r] connects to rank r, -1 for self
+
+    SocketTransport(int rank, std::vector<int> sockets) : ownRank(rank), sockets(std::move(sockets)) {
+        for (int fd : this->sockets) {
+            if (fd >= 0) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        }
+    }
+
+    ~SocketTransport() override {
+        for (int fd : sockets) {
+            if (fd >= 0) ::close(fd);
+        }
+    }
+
+    int rank() const override { return ownRank; }
+    int size() const override { return static_cast<int>(sockets.size()); }
+
+    std::vector<char> sendReceive(int destination, const std::vector<char>& out, int source) override {
+        const int sendSocket = sockets[destination];
+        const int receiveSocket = sockets[source];
+
+        uint64_t outLength = out.size();
+        size_t sent = 0;
+        const size_t sendTotal = sizeof(outLength) + out.size();
+
+        uint64_t inLength = 0;
+        size_t received = 0;
+        std::vector<char> in;
+
+        auto sendDone = [&]() { return sent == sendTotal; };
+        auto receiveDone = [&]() { return received >= sizeof(inLength) && received == sizeof(inLength) + inLength; };
+
+        while (!sendDone() || !receiveDone()) {
+            pollfd fds[2];
+            int count = 0;
+            if (!sendDone()) fds[count++] = {sendSocket, POLLOUT, 0};
+            if (!receiveDone()) fds[count++] = {receiveSocket, POLLIN, 0};
+
+            if (poll(fds, count, -1) < 0) {
+                if (errno == EINTR) continue;
+                throw std::runtime_error(std::string("Transport poll failed: ") + std::strerror(errno));
+            }
+
+            for (int i = 0; i < count; i++) {
+                if (fds[i].revents & (POLLERR | POLLNVAL)) {
+                    throw std::runtime_error("Transport connection failed");
+                }
+            }
+
+            if (!sendDone()) {
+                const char* data;
+                size_t remaining;
+                if (sent < sizeof(outLength)) {
+                    data = reinterpret_cast<const char*>(&outLength) + sent;
+                    remaining = sizeof(outLength) - sent;
+                } else {
+                    data = out.data() + (sent - sizeof(outLength));
+                    remaining = sendTotal - sent;
+                }
+
+                ssize_t written = ::send(sendSocket, data, remaining, MSG_NOSIGNAL);
+                if (written > 0) sent += written;
+                else if (written < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    throw std::runtime_error(std::string("Transport send failed: ") + std::strerror(errno));
+                }
+            }
+
+            if (!receiveDone()) {
+                char* data;
+                size_t remaining;
+                if (received < sizeof(inLength)) {
+                    data = reinterpret_cast<char*>(&inLength) + received;
+                    remaining = sizeof(inLength) - received;
+                } else {
+                    data = in.data() + (received - sizeof(inLength));
+                    remaining = sizeof(inLength) + inLength - received;
+                }
+
+                ssize_t got = ::recv(receiveSocket, data, remaining, 0);
+                if (got == 0) throw std::runtime_error("Transport peer closed the connection");
+                if (got > 0) {
+                    received += got;
+                    if (received == sizeof(inLength)) in.resize(inLength);
+                } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    throw std::runtime_error(std::string("Transport receive failed: ") + std::strerror(errno));
+                }
+            }
+        }
+
+        return in;
+    }
+};
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+// Lock-free triple buffer for one writer and one reader. The writer fills
+// writeBuffer() and publishes it; the reader picks up the newest published
+// buffer with acquire(). Neither side ever waits, and the reader always
+// sees a complete buffer.
+template <typename T>
+struct TripleBuffer {
+    T slots[3];
+
+    // Bits 0-1: index of the shared slot, bit 2: shared slot holds unread data
+    std::atomic<uint8_t> shared{1};
+    uint8_t back = 0;   // Owned by the writer
+    uint8_t front = 2;  // Owned by the reader
+
+    T& writeBuffer() {
+        return slots[back];
+    }
+
+    void publish() {
+        back = shared.exchange(back | 4, std::memory_order_acq_rel) & 3;
+    }
+
+    // Returns true if a newer buffer was taken.
+    bool acquire() {
+        if (!(shared.load(std::memory_order_acquire) & 4)) return false;
+        front = shared.exchange(front, std::memory_order_acq_rel) & 3;
+        return true;
+    }
+
+    const T& readBuffer() const {
+        return slots[front];
+    }
+};
@@ -2,6 +2,7 @@
 
 #include "Config.hpp"
 #include <SFML/Graphics.hpp>
+#include "Trace.hpp"
 
 sf::ContextSettings settings;
 
@@ -9,14 +10,16 @@ struct WindowManager {
     static sf::RenderWindow window;
     static sf::Clock frameClock;
 
-    WindowManager() {
-        window.setFramerateLimit(60);
-        // settings.antialiasingLevel = 0;
-        // window.setVerticalSyncEnabled(false);
-
+    // Opens the window. Headless runs never call this, so they work without
+    // a display.
+    static void open() {
+        window.create(sf::VideoMode(config.windowWidth, config.windowHeight), "");
     }
 
+    // The only place the render loop is throttled. Simulation time is paced
+    // separately by FixedStep.
     static void awaitFrame() {
+        TRACE_ZONE("WindowManager::awaitFrame");
         sf::Time deltaTime = frameClock.restart();
         if (deltaTime.asSeconds() < config.dt) {
             sf::sleep(sf::seconds(config.dt - deltaTime.asSeconds()));
@@ -24,7 +27,7 @@ struct WindowManager {
     }
 };
 
-sf::RenderWindow WindowManager::window(sf::VideoMode(config.windowWidth, config.windowHeight), "");
+sf::RenderWindow WindowManager::window;
 sf::RenderWindow& window = WindowManager::window;
 sf::Clock WindowManager::frameClock;
 
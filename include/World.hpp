@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "magnetsim.h"
+
+/*
+One simulation, owned by the host program. This is the C++ face of
+libmagnetsim (see magnetsim.h); it includes none of the engine headers.
+The shared library exports only this API, so it can be used next to code
+that has its own globals. The static archive still defines the engine's
+globals (config, quadTree, Particle::particles, ...) with external
+linkage, and a host must not define symbols of the same names.
+
+    World world;
+    world.generate("plummer", 50000, 7);
+    world.step(100);
+    const MagnetParticle* particles = world.particles();
+
+The engine's subsystems are static, so a World keeps its particles, step
+count and settings to itself and moves them into the engine only while
+one of its calls runs. Moving means swapping vectors, never copying.
+Errors are thrown as std::runtime_error / std::invalid_argument.
+*/
+class MAGNETSIM_API World {
+public:
+    explicit World(const MagnetSettings& settings = magnetsim_default_settings());
+    ~World();
+
+    World(const World&) = delete;
+    World& operator=(const World&) = delete;
+
+    void generate(const std::string& scenario, size_t count, uint64_t seed = 0);
+    void load(const std::string& path);
+    void step(int steps = 1);
+
+    // Valid until the next generate, load or step.
+    const MagnetParticle* particles() const;
+    size_t particleCount() const;
+    uint64_t stepCount() const;
+
+    MagnetSettings settings;
+
+    // Engine side state, defined in World.cpp
+    struct State;
+
+private:
+    std::unique_ptr<State> state;
+};
@@ -0,0 +1,95 @@
+#pragma once
+
+/*
+C interface of libmagnetsim, the simulation without a window.
+
+    MagnetWorld* world = magnetsim_create(NULL);
+    magnetsim_generate(world, "disc", 100000, 1);
+    magnetsim_step(world, 600);
+
+    const MagnetParticle* particles = magnetsim_particles(world);
+    for (size_t i = 0; i < magnetsim_particle_count(world); i++) { ... }
+
+    magnetsim_destroy(world);
+
+magnetsim_particles() returns the world's own particle array. A world with
+rigid bodies returns a copy instead, made after each call, with the body
+members appended as free particles. Either stays valid until the next call
+that changes the world (step, generate, load, destroy).
+
+Functions that can fail return 0 on success and -1 on failure, with the
+reason in magnetsim_last_error().
+
+Worlds are independent, but the engine underneath is shared, so calls on
+different worlds from different threads run one after another. Each step
+still uses settings.threads worker threads.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__GNUC__)
+#define MAGNETSIM_API __attribute__((visibility("default")))
+#else
+#define MAGNETSIM_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Same layout as the engine's Particle, so the array is handed out as is. */
+typedef struct MagnetParticle {
+    float positionX, positionY;
+    float positionOffsetX, positionOffsetY;
+    float velocityX, velocityY;
+    float forceX, forceY;
+    float radius;
+    float mass;
+    int rung;
+} MagnetParticle;
+
+typedef struct MagnetSettings {
+    float gravitationalConstant;
+    float gravitationalSoftening;
+    float theta;
+    int threads;                /* 0 = one per hardware thread */
+    int gridCellSize;
+    int collisionSubsteps;
+    int gravitySolver;          /* 0 = tree, 1 = particle mesh, 2 = TreePM */
+    int meshSize;
+    int multipoleOrder;         /* 0 = monopole, 2 = quadrupole */
+    int blockTimesteps;
+    int mergeOnContact;
+    int neighbourLists;
+    int taskGraph;
+} MagnetSettings;
+
+typedef struct MagnetWorld MagnetWorld;
+
+/* The settings the interactive program starts with. */
+MAGNETSIM_API MagnetSettings magnetsim_default_settings(void);
+
+/* NULL settings = magnetsim_default_settings(). Returns NULL on failure. */
+MAGNETSIM_API MagnetWorld* magnetsim_create(const MagnetSettings* settings);
+MAGNETSIM_API void magnetsim_destroy(MagnetWorld* world);
+
+/* Replaces the particles with a generated scenario: disc, plummer, galaxies or gas. */
+MAGNETSIM_API int magnetsim_generate(MagnetWorld* world, const char* scenario, size_t count, uint64_t seed);
+
+/* Replaces the particles and the step count with a snapshot file. */
+MAGNETSIM_API int magnetsim_load(MagnetWorld* world, const char* path);
+
+/* Advances the world by `steps` fixed steps. */
+MAGNETSIM_API int magnetsim_step(MagnetWorld* world, int steps);
+
+MAGNETSIM_API size_t magnetsim_particle_count(const MagnetWorld* world);
+MAGNETSIM_API const MagnetParticle* magnetsim_particles(const MagnetWorld* world);
+MAGNETSIM_API uint64_t magnetsim_step_count(const MagnetWorld* world);
+
+/* Reason for the last failure on this thread, "" if none. */
+MAGNETSIM_API const char* magnetsim_last_error(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -4,13 +4,14 @@
 #include "Simulation.hpp"
 #include "Renderer.hpp"
 #include "InputManger.hpp"
+#include "Replay.hpp"
 #include "Particle.hpp"
 #include "TextManager.hpp"
 
 
 
 LiveText liveText({10.0f, 10.0f}, []() -> std::string {
-    return "Particles: " + std::to_string(Particle::particles.size() * 3);
+    return "Particles: " + std::to_string(Renderer::frame->particleCount * 3);
 });
 
 LiveText renderingTime({10.0f, 40.0f}, []() -> std::string {
@@ -27,49 +28,93 @@ LiveText fps({10.0f, 100.0f}, []() -> std::string {
     return "FPS: " + std::to_string(Simulation::fps);
 });
 
+LiveText replay({10.0f, 130.0f}, []() -> std::string {
+    if (!Replay::isActive()) return "";
+    return Replay::describe();
+});
+
 LiveText paused({900.0f, 10.0f}, []() -> std::string {
-    if (Simulation::isPaused) return "PAUSED";
+    if (Renderer::frame->isPaused) return "PAUSED";
     return "";
 });
 
 LiveText simulationTime({10.0f, 220.0f}, []() -> std::string {
-    if (Simulation::simulationTimeUs > 1000) {
-        return "Simulation Time: " + std::to_string(Simulation::simulationTimeUs / 1000) + "ms";
+    int simulationTimeUs = Renderer::frame->simulationTimeUs;
+    if (simulationTimeUs > 1000) {
+        return "Simulation Time: " + std::to_string(simulationTimeUs / 1000) + "ms";
     }
 
     else {
-        return "Simulation Time: " + std::to_string(Simulation::simulationTimeUs) + "us";
+        return "Simulation Time: " + std::to_string(simulationTimeUs) + "us";
     }
 });
 
 LiveText collisionTime({10.0f, 160.0f}, []() -> std::string {
-    if (Simulation::collisionTime > 1000) {
-        return "Collision Time: " + std::to_string(Simulation::collisionTime / 1000) + "ms";
+    int collisionTime = Renderer::frame->collisionTime;
+    if (collisionTime > 1000) {
+        return "Collision Time: " + std::to_string(collisionTime / 1000) + "ms";
     }
 
     else {
-        return "Collision Time: " + std::to_string(Simulation::collisionTime) + "us";
+        return "Collision Time: " + std::to_string(collisionTime) + "us";
     }
 });
 
 LiveText gravityTime({10.0f, 190.0f}, []() -> std::string {
-    if (Simulation::gravityTime > 1000) {
-        return "Gravity Time: " + std::to_string(Simulation::gravityTime / 1000) + "ms";
+    int gravityTime = Renderer::frame->gravityTime;
+    if (gravityTime > 1000) {
+        return "Gravity Time: " + std::to_string(gravityTime / 1000) + "ms";
     }
 
     else {
-        return "Gravity Time: " + std::to_string(Simulation::gravityTime) + "us";
+        return "Gravity Time: " + std::to_string(gravityTime) + "us";
     }
 });
 
+LiveText theta({10.0f, 250.0f}, []() -> std::string {
+    return "Theta: " + std::to_string(Renderer::frame->theta).substr(0, 4);
+});
+
+LiveText frameLoad({10.0f, 280.0f}, []() -> std::string {
+    if (config.frameBudgetMs <= 0.0f) return "";
+    return "Frame Budget: " + std::to_string(static_cast<int>(Renderer::frame->frameLoad * 100.0f)) + "%";
+});
+
+LiveText forceEvaluations({10.0f, 310.0f}, []() -> std::string {
+    if (Renderer::frame->forceEvaluations == 0) return "";
+    return "Force Evaluations: " + std::to_string(Renderer::frame->forceEvaluations);
+});
+
+LiveText gravityCounters({10.0f, 340.0f}, []() -> std::string {
+    if (!Renderer::frame->hasCounters) return "";
+    return Renderer::frame->counters[static_cast<int>(PerfPhase::Gravity)];
+});
+
+LiveText collisionCounters({10.0f, 370.0f}, []() -> std::string {
+    if (!Renderer::frame->hasCounters) return "";
+    return Renderer::frame->counters[static_cast<int>(PerfPhase::Collision)];
+});
+
+LiveText integrationCounters({10.0f, 400.0f}, []() -> std::string {
+    if (!Renderer::frame->hasCounters) return "";
+    return Renderer::frame->counters[static_cast<int>(PerfPhase::Integration)];
+});
+
 void initText() {
     TextManager::textObjects.push_back(liveText);
     TextManager::textObjects.push_back(renderingTime);
     TextManager::textObjects.push_back(fps);
     TextManager::textObjects.push_back(inputHandlingTime);
     TextManager::textObjects.push_back(paused);
+    TextManager::textObjects.push_back(replay);
 
     TextManager::textObjects.push_back(simulationTime);
     TextManager::textObjects.push_back(gravityTime);
     TextManager::textObjects.push_back(collisionTime);
+    TextManager::textObjects.push_back(theta);
+    TextManager::textObjects.push_back(frameLoad);
+    TextManager::textObjects.push_back(forceEvaluations);
+    TextManager::textObjects.push_back(gravityCounters);
+    TextManager::textObjects.push_back(collisionCounters);
+    TextManager::textObjects.push_back(integrationCounters);
 }
\ No newline at end of file
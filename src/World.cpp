@@ -0,0 +1,229 @@
+// libmagnetsim: the engine without a window or HUD, driven through World
+// and the C API in magnetsim.h. Built by `make lib`, never linked into the
+// interactive program.
+
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include "World.hpp"
+#include "Config.hpp"
+#include "Particle.hpp"
+#include "Simulation.hpp"
+#include "Scenarios.hpp"
+#include "Snapshot.hpp"
+#include "CollisionGrid.hpp"
+#include "LiveConfig.hpp"
+#include "BarnesHut.cpp"
+
+Config config;
+
+static_assert(sizeof(MagnetParticle) == sizeof(Particle), "MagnetParticle must mirror Particle");
+static_assert(offsetof(MagnetParticle, positionX) == offsetof(Particle, position), "MagnetParticle must mirror Particle");
+static_assert(offsetof(MagnetParticle, velocityX) == offsetof(Particle, velocity), "MagnetParticle must mirror Particle");
+static_assert(offsetof(MagnetParticle, forceX) == offsetof(Particle, force), "MagnetParticle must mirror Particle");
+static_assert(offsetof(MagnetParticle, radius) == offsetof(Particle, radius), "MagnetParticle must mirror Particle");
+static_assert(offsetof(MagnetParticle, mass) == offsetof(Particle, mass), "MagnetParticle must mirror Particle");
+static_assert(offsetof(MagnetParticle, rung) == offsetof(Particle, rung), "MagnetParticle must mirror Particle");
+
+struct World::State {
+    std::vector<Particle> particles;
+    std::vector<RigidBody> bodies;
+    std::vector<Particle> withMembers;  // particles plus the body members, while there are bodies
+    uint64_t step = 0;
+};
+
+namespace {
+
+std::mutex engineMutex;
+
+// Lends a world's state to the engine for the lifetime of the scope.
+struct Engine {
+    std::lock_guard<std::mutex> lock;
+    World::State& state;
+
+    Engine(World::State& state, const MagnetSettings& settings) : lock(engineMutex), state(state) {
+        static bool isInitialized = false;
+        if (!isInitialized) {
+            LiveConfig::pollInterval = 0;   // Settings only come from the host
+            Node::initializeNodePool(10000);
+            isInitialized = true;
+        }
+
+        config = Config();
+        config.gravitational_constant = settings.gravitationalConstant;
+        config.gravitationalSoftening = settings.gravitationalSoftening;
+        config.theta = settings.theta;
+        config.threadCount = std::min(settings.threads, Config::maxThreads);
+        config.gridCellSize = std::clamp(settings.gridCellSize, Config::particleSize, Config::maxGridCellSize);
+        config.collisionSubsteps = std::max(1, settings.collisionSubsteps);
+        config.gravitySolver = static_cast<Config::GravitySolver>(std::clamp(settings.gravitySolver, 0, 2));
+        config.meshSize = settings.meshSize;
+        config.multipoleOrder = settings.multipoleOrder;
+        config.blockTimesteps = settings.blockTimesteps != 0;
+        config.mergeOnContact = settings.mergeOnContact != 0;
+        config.neighbourLists = settings.neighbourLists != 0;
+        config.taskGraph = settings.taskGraph != 0;
+
+        if (CollisionGrid::cells.empty() || CollisionGrid::cellSize != config.gridCellSize) {
+            CollisionGrid::initialize();
+        }
+
+        Particle::particles.swap(state.particles);
+        RigidBodies::bodies.swap(state.bodies);
+        std::swap(Simulation::step, state.step);
+        BlockTimesteps::isPrimed = false;   // Rungs were chosen for whichever world ran last
+    }
+
+    ~Engine() {
+        // The host sees rigid body members as free particles.
+        state.withMembers.clear();
+        if (RigidBodies::isActive()) {
+            state.withMembers = Particle::particles;
+            RigidBodies::appendMembers(state.withMembers);
+        }
+
+        Particle::particles.swap(state.particles);
+        RigidBodies::bodies.swap(state.bodies);
+        std::swap(Simulation::step, state.step);
+    }
+};
+
+thread_local std::string lastError;
+
+// Runs `call` for the C API, turning exceptions into -1.
+template <typename Function>
+int guarded(Function call) {
+    try {
+        call();
+        lastError.clear();
+        return 0;
+    } catch (const std::exception& error) {
+        lastError = error.what();
+        return -1;
+    }
+}
+
+}
+
+World::World(const MagnetSettings& settings) : settings(settings), state(std::make_unique<State>()) {}
+
+World::~World() = default;
+
+void World::generate(const std::string& scenario, size_t count, uint64_t seed) {
+    Engine engine(*state, settings);
+    Particle::particles.clear();
+    RigidBodies::clear();
+    Simulation::step = 0;
+    Scenarios::generate(scenario, count, seed);
+}
+
+void World::load(const std::string& path) {
+    Engine engine(*state, settings);
+    RigidBodies::clear();
+    Simulation::step = Snapshot::load(path);
+}
+
+void World::step(int steps) {
+    if (steps < 0) throw std::invalid_argument("Negative step count");
+    if (settings.gravitySolver != 0 && (settings.meshSize < 16 || (settings.meshSize & (settings.meshSize - 1)) != 0)) {
+        throw std::invalid_argument("meshSize must be a power of two of at least 16");
+    }
+
+    Engine engine(*state, settings);
+    for (int i = 0; i < steps; i++) {
+        Simulation::update(Config::dt);
+    }
+}
+
+const MagnetParticle* World::particles() const {
+    const std::vector<Particle>& particles = state->bodies.empty() ? state->particles : state->withMembers;
+    return reinterpret_cast<const MagnetParticle*>(particles.data());
+}
+
+size_t World::particleCount() const {
+    return state->bodies.empty() ? state->particles.size() : state->withMembers.size();
+}
+
+uint64_t World::stepCount() const {
+    return state->step;
+}
+
+struct MagnetWorld {
+    World world;
+
+    explicit MagnetWorld(const MagnetSettings& settings) : world(settings) {}
+};
+
+extern "C" {
+
+MagnetSettings magnetsim_default_settings(void) {
+    const Config defaults;
+    MagnetSettings settings;
+    settings.gravitationalConstant = defaults.gravitational_constant;
+    settings.gravitationalSoftening = defaults.gravitationalSoftening;
+    settings.theta = defaults.theta;
+    settings.threads = defaults.threadCount;
+    settings.gridCellSize = defaults.gridCellSize;
+    settings.collisionSubsteps = defaults.collisionSubsteps;
+    settings.gravitySolver = static_cast<int>(defaults.gravitySolver);
+    settings.meshSize = defaults.meshSize;
+    settings.multipoleOrder = defaults.multipoleOrder;
+    settings.blockTimesteps = defaults.blockTimesteps;
+    settings.mergeOnContact = defaults.mergeOnContact;
+    settings.neighbourLists = defaults.neighbourLists;
+    settings.taskGraph = defaults.taskGraph;
+    return settings;
+}
+
+MagnetWorld* magnetsim_create(const MagnetSettings* settings) {
+    try {
+        return new MagnetWorld(settings ? *settings : magnetsim_default_settings());
+    } catch (const std::exception& error) {
+        lastError = error.what();
+        return nullptr;
+    }
+}
+
+void magnetsim_destroy(MagnetWorld* world) {
+    delete world;
+}
+
+int magnetsim_generate(MagnetWorld* world, const char* scenario, size_t count, uint64_t seed) {
+    return guarded([&]() {
+        if (!scenario) throw std::invalid_argument("No scenario given");
+        world->world.generate(scenario, count, seed);
+    });
+}
+
+int magnetsim_load(MagnetWorld* world, const char* path) {
+    return guarded([&]() {
+        if (!path) throw std::invalid_argument("No snapshot path given");
+        world->world.load(path);
+    });
+}
+
+int magnetsim_step(MagnetWorld* world, int steps) {
+    return guarded([&]() { world->world.step(steps); });
+}
+
+size_t magnetsim_particle_count(const MagnetWorld* world) {
+    return world->world.particleCount();
+}
+
+const MagnetParticle* magnetsim_particles(const MagnetWorld* world) {
+    return world->world.particles();
+}
+
+uint64_t magnetsim_step_count(const MagnetWorld* world) {
+    return world->world.stepCount();
+}
+
+const char* magnetsim_last_error(void) {
+    return lastError.c_str();
+}
+
+}
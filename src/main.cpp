@@ -1,5 +1,8 @@
 #include <SFML/Graphics.hpp>
+#include <cctype>
+#include <cstdio>
 #include <iostream>
+#include <sstream>
 #include "Simulation.hpp"
 #include "Solver.hpp"
 #include "WindowManager.hpp"
@@ -9,25 +12,408 @@
 #include "Particle.hpp"
 #include "CollisionGrid.hpp"    
 #include "TextManager.hpp"
+#include "Snapshot.hpp"
+#include "TrajectoryWriter.hpp"
+#include "Scenarios.hpp"
+#include "Trace.hpp"
+#include "LiveConfig.hpp"
+#include "SimulationThread.hpp"
+#include "SoftwareRenderer.hpp"
+#include "FixedStep.hpp"
+#include "FrameGovernor.hpp"
+#include "Distributed.hpp"
+#include "Numa.hpp"
+#include "PerfCounters.hpp"
+#include "Ensemble.hpp"
+#include "Replay.hpp"
 #include "BarnesHut.cpp"
 #include "Text.cpp"
 
 
 Config config; // Stores Globals
 
-int main() {
-    initText();
+struct Options {
+    std::string restorePath;
+    std::string scenario;
 
-    // Particle::uniform_disc(1000);
-    CollisionGrid::initialize();
-    Node::initializeNodePool(10000);
+    // Headless batch runs
+    bool headless = false;
+    uint64_t steps = 1000;
+    std::string renderDirectory;
+    std::string renderFormat = "png";
+    int renderEvery = 1;
+
+    int ranks = 1;
+
+    std::string replayDirectory;
+
+    std::string ensembleJobs;
+    std::string ensembleDirectory = "ensemble";
+    int ensembleWorkers = 0;
+
+    bool numa = false;
+    bool perfCounters = false;
+
+    std::string analysisDirectory;
+    std::string analyses;
+
+    bool verifyDeterminism = false;
+    std::vector<int> verifyThreadCounts;
+};
+
+Options options;
+SoftwareRenderer softwareRenderer;
+
+/*
+Usage: program [options]
+
+    --restore <file>            Start from a snapshot instead of an empty scene
+    --scenario <name:n[:seed]>  Start from generated initial conditions, one of
+                                disc, plummer, galaxies, gas or bodies
+    --checkpoint <file>         Where periodic checkpoints are written
+    --checkpoint-every <steps>  Write a checkpoint every N steps (0 = never)
+    --trajectory <dir>          Record positions and velocities into <dir>
+    --trajectory-every <steps>  Record every N steps (default 1 once enabled)
+    --replay <dir>              Play back a recorded trajectory instead of simulating
+                                (see Replay for the keys)
+    --sequential                Run simulation and rendering on one thread
+    --neighbour-lists [skin]    Reuse per particle contact lists until something has
+                                moved half the skin (default skin 1)
+    --phase-barriers            Run gravity, collisions and integration one after
+                                another instead of as an overlapping task graph
+    --deterministic             Bit-identical results for any thread count
+    --verify-determinism [n,m,...]
+                                Run the starting scene (default scenario
+                                disc:5000:1) for --steps steps once per thread count
+                                (default 1,2,3 and all hardware threads), compare the
+                                final states and exit; `make verify-determinism`
+    --time-scale <f>            Simulated seconds per real second (default 1)
+    --max-steps-per-frame <n>   Steps taken at most to catch up (default 4)
+    --frame-budget <ms>         Lower accuracy and detail to hold this frame time
+    --gravity <tree|pm|treepm>  Gravity solver (default tree)
+    --theta <f>                 Barnes-Hut opening angle (default 0.3)
+    --quadrupole                Use quadrupole moments for far nodes, which allows
+                                a larger theta at the same accuracy
+    --mesh-size <n>             Particle mesh cells per side, power of two (default 256)
+    --mesh-assignment <cic|tsc> Mass assignment scheme (default cic)
+    --block-steps [max rung]    Per particle power of two timesteps (default max rung 6)
+    --merge                     Combine touching particles slower than the merge velocity
+    --merge-velocity <v>        Relative speed below which contacts merge (default 0.5)
+    --config <file>             Runtime settings, reloaded when the file changes
+                                (default liveconfig.json)
+    --analysis <dir>            Run in-situ analyses every --analysis-every steps and
+                                write their results to <dir> (see Analysis)
+    --analysis-every <steps>    Steps between analysis runs (default 60)
+    --analyses <a,b,...>        Which of density, profile, momentum and clumps to run
+                                (default all)
+    --trace <file>              Record trace zones from startup and write them
+                                as Chrome trace JSON on exit (T toggles at runtime)
+
+Headless runs (no window or GPU needed):
+
+    --headless                  Simulate without opening a window
+    --steps <n>                 Steps to simulate (default 1000)
+    --render-out <dir>          Write frames from the software renderer to <dir>
+    --render-every <steps>      Write every N steps (default 1)
+    --render-size <w>x<h>       Output resolution (default window size)
+    --render-format <png|raw>   PNG or raw RGBA8 frames (default png)
+    --tone <log|linear|reinhard>
+    --color <velocity|mass|density>
+    --exposure <f>
+    --ranks <n>                 Split the run over n processes (see Distributed)
+    --ensemble <jobs file>      Run many independent simulations at once and exit
+                                (see Ensemble); --steps is the default length
+    --ensemble-out <dir>        Where results and final snapshots go (default ensemble)
+    --ensemble-workers <n>      Simulations running at once (default one per hardware thread)
+    --numa                      Pin workers and place particles and tree nodes on
+                                the workers' NUMA nodes
+    --numa-bench                Compare local and remote memory placement and exit
+    --perf-counters [file]      Count cycles, instructions, cache and branch misses per
+                                phase, shown in the HUD and written to <file> as JSON
+                                lines (one per step)
+*/
+void parseArguments(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+
+        if (arg == "--restore" && hasValue) {
+            options.restorePath = argv[++i];
+        } else if (arg == "--scenario" && hasValue) {
+            options.scenario = argv[++i];
+            try {
+                Scenarios::parseSpec(options.scenario);
+            } catch (const std::invalid_argument& error) {
+                std::cerr << "--scenario: " << error.what() << std::endl;
+                std::exit(1);
+            }
+        } else if (arg == "--checkpoint" && hasValue) {
+            Snapshot::checkpointPath = argv[++i];
+        } else if (arg == "--checkpoint-every" && hasValue) {
+            Snapshot::checkpointInterval = std::stoi(argv[++i]);
+        } else if (arg == "--trajectory" && hasValue) {
+            TrajectoryWriter::directory = argv[++i];
+            if (TrajectoryWriter::interval == 0) TrajectoryWriter::interval = 1;
+        } else if (arg == "--trajectory-every" && hasValue) {
+            TrajectoryWriter::interval = std::stoi(argv[++i]);
+        } else if (arg == "--replay" && hasValue) {
+            options.replayDirectory = argv[++i];
+        } else if (arg == "--sequential") {
+            SimulationThread::pipelined = false;
+            FrameGovernor::overlapped = false;
+        } else if (arg == "--neighbour-lists") {
+            config.neighbourLists = true;
+            if (hasValue && std::isdigit(static_cast<unsigned char>(argv[i + 1][0]))) {
+                config.neighbourSkin = std::max(0.1f, std::stof(argv[++i]));
+            }
+        } else if (arg == "--analysis" && hasValue) {
+            options.analysisDirectory = argv[++i];
+        } else if (arg == "--analysis-every" && hasValue) {
+            config.analysisInterval = std::max(0, std::stoi(argv[++i]));
+        } else if (arg == "--analyses" && hasValue) {
+            options.analyses = argv[++i];
+        } else if (arg == "--deterministic") {
+            config.deterministic = true;
+        } else if (arg == "--verify-determinism") {
+            options.verifyDeterminism = true;
+            if (hasValue && std::isdigit(static_cast<unsigned char>(argv[i + 1][0]))) {
+                std::stringstream counts(argv[++i]);
+                std::string count;
+                while (std::getline(counts, count, ',')) {
+                    options.verifyThreadCounts.push_back(std::max(1, std::stoi(count)));
+                }
+            }
+        } else if (arg == "--phase-barriers") {
+            config.taskGraph = false;
+        } else if (arg == "--time-scale" && hasValue) {
+            config.timeScale = std::max(1e-3f, std::stof(argv[++i]));
+        } else if (arg == "--max-steps-per-frame" && hasValue) {
+            config.maxStepsPerFrame = std::max(1, std::stoi(argv[++i]));
+        } else if (arg == "--frame-budget" && hasValue) {
+            config.frameBudgetMs = std::max(0.0f, std::stof(argv[++i]));
+        } else if (arg == "--theta" && hasValue) {
+            config.theta = std::max(0.0f, std::stof(argv[++i]));
+        } else if (arg == "--quadrupole") {
+            config.multipoleOrder = 2;
+        } else if (arg == "--gravity" && hasValue) {
+            std::string solver = argv[++i];
+            if (solver == "pm") config.gravitySolver = Config::GravitySolver::ParticleMesh;
+            else if (solver == "treepm") config.gravitySolver = Config::GravitySolver::TreePM;
+            else config.gravitySolver = Config::GravitySolver::Tree;
+        } else if (arg == "--mesh-size" && hasValue) {
+            int size = std::stoi(argv[++i]);
+            if (size >= 16 && (size & (size - 1)) == 0) config.meshSize = size;
+            else std::cerr << "--mesh-size must be a power of two, keeping " << config.meshSize << std::endl;
+        } else if (arg == "--block-steps") {
+            config.blockTimesteps = true;
+            if (hasValue && std::isdigit(static_cast<unsigned char>(argv[i + 1][0]))) {
+                config.maxRung = std::clamp(std::stoi(argv[++i]), 0, 12);
+            }
+        } else if (arg == "--merge") {
+            config.mergeOnContact = true;
+        } else if (arg == "--merge-velocity" && hasValue) {
+            config.mergeVelocity = std::max(0.0f, std::stof(argv[++i]));
+        } else if (arg == "--mesh-assignment" && hasValue) {
+            ParticleMesh::assignment = ParticleMesh::parseAssignment(argv[++i]);
+        } else if (arg == "--config" && hasValue) {
+            LiveConfig::path = argv[++i];
+        } else if (arg == "--trace" && hasValue) {
+            Trace::outputPath = argv[++i];
+            Trace::enabled = true;
+        } else if (arg == "--headless") {
+            options.headless = true;
+        } else if (arg == "--steps" && hasValue) {
+            options.steps = std::stoull(argv[++i]);
+        } else if (arg == "--render-out" && hasValue) {
+            options.renderDirectory = argv[++i];
+        } else if (arg == "--render-every" && hasValue) {
+            options.renderEvery = std::max(1, std::stoi(argv[++i]));
+        } else if (arg == "--render-size" && hasValue) {
+            std::string size = argv[++i];
+            int width = 0, height = 0;
+            char rest = 0;
+            if (std::sscanf(size.c_str(), "%dx%d%c", &width, &height, &rest) != 2 || width <= 0 || height <= 0) {
+                std::cerr << "--render-size expects <w>x<h>, like 1920x1080, got " << size << std::endl;
+                std::exit(1);
+            }
+            softwareRenderer.width = width;
+            softwareRenderer.height = height;
+        } else if (arg == "--render-format" && hasValue) {
+            options.renderFormat = argv[++i];
+        } else if (arg == "--tone" && hasValue) {
+            softwareRenderer.toneMap = SoftwareRenderer::parseToneMap(argv[++i]);
+        } else if (arg == "--color" && hasValue) {
+            softwareRenderer.colorMode = SoftwareRenderer::parseColorMode(argv[++i]);
+        } else if (arg == "--numa") {
+            options.numa = true;
+        } else if (arg == "--perf-counters") {
+            options.perfCounters = true;
+            if (hasValue && argv[i + 1][0] != '-') PerfCounters::outputPath = argv[++i];
+        } else if (arg == "--numa-bench") {
+            Numa::benchmark();
+            std::exit(0);
+        } else if (arg == "--ensemble" && hasValue) {
+            options.ensembleJobs = argv[++i];
+        } else if (arg == "--ensemble-out" && hasValue) {
+            options.ensembleDirectory = argv[++i];
+        } else if (arg == "--ensemble-workers" && hasValue) {
+            options.ensembleWorkers = std::max(0, std::stoi(argv[++i]));
+        } else if (arg == "--ranks" && hasValue) {
+            options.ranks = std::max(1, std::stoi(argv[++i]));
+        } else if (arg == "--exposure" && hasValue) {
+            softwareRenderer.exposure = std::stof(argv[++i]);
+        } else {
+            std::cerr << "Unknown argument: " << arg << std::endl;
+        }
+    }
+}
+
+// Steps the simulation on the calling thread, writing software rendered
+// frames if requested.
+void runHeadless() {
+    if (!options.renderDirectory.empty()) {
+        std::filesystem::create_directories(options.renderDirectory);
+    }
+
+    for (uint64_t i = 0; i < options.steps; i++) {
+        if (Distributed::isActive()) Distributed::step(config.dt);
+        else Simulation::update(config.dt);
+
+        if (options.renderDirectory.empty() || Simulation::step % options.renderEvery != 0) continue;
+
+        char name[32];
+        std::snprintf(name, sizeof(name), "/frame_%06llu.", static_cast<unsigned long long>(Simulation::step));
+        std::string path = options.renderDirectory + name + options.renderFormat;
+
+        auto renderFrame = [&]() {
+            softwareRenderer.render(Particle::particles);
+            if (!softwareRenderer.write(path)) {
+                std::cerr << "Failed to write " << path << std::endl;
+            }
+        };
+
+        if (Distributed::isActive()) Distributed::withGathered(renderFrame);
+        else renderFrame();
+    }
+}
+
+// Plays a recorded trajectory in the window; nothing is simulated.
+void runReplay() {
+    Replay::open(options.replayDirectory);
+    WindowManager::open();
 
     while (window.isOpen()) {
-        Simulation::update(config.dt);
         InputManager::handle_inputs();
-        Renderer::render();
+        Replay::update();
+        Renderer::render(Replay::frame());
         WindowManager::awaitFrame();
     }
 
+    Replay::close();
+    if (Trace::enabled) Trace::dump(Trace::outputPath);
+}
+
+// Everything main does; errors it cannot recover from (a missing snapshot,
+// a bad scenario or jobs file) are thrown and reported by main.
+int run(int argc, char* argv[]) {
+    parseArguments(argc, argv);
+
+    if (!options.ensembleJobs.empty()) {
+        return Ensemble::run(options.ensembleJobs, options.ensembleDirectory, options.ensembleWorkers, options.steps);
+    }
+
+    if (options.ranks > 1) {
+        if (!options.headless) std::cerr << "Distributed runs are headless" << std::endl;
+        options.headless = true;
+        Distributed::launch(options.ranks);
+    }
+    Trace::local(); // The main thread always owns lane 0
+    initText();
+
+    if (!options.replayDirectory.empty()) {
+        runReplay();
+        return 0;
+    }
+
+    LiveConfig::initialize();
+    Numa::initialize(options.numa);
+    PerfCounters::initialize(options.perfCounters, PerfCounters::outputPath);
+    CollisionGrid::initialize();
+    Node::initializeNodePool(10000);
+
+    if (!options.analysisDirectory.empty()) {
+        if (Distributed::isActive()) std::cerr << "In-situ analysis only runs in single process runs" << std::endl;
+        else Analysis::initialize(options.analysisDirectory, options.analyses);
+    }
+
+    auto startingScene = [&]() {
+        if (!options.restorePath.empty()) {
+            Simulation::step = Snapshot::load(options.restorePath);
+        } else if (!options.scenario.empty()) {
+            Scenarios::generateFromSpec(options.scenario);
+        }
+    };
+
+    if (options.verifyDeterminism) {
+        // An empty scene would match trivially.
+        if (options.restorePath.empty() && options.scenario.empty()) options.scenario = "disc:5000:1";
+
+        std::vector<int> counts = options.verifyThreadCounts;
+        if (counts.empty()) {
+            counts = {1, 2, 3, static_cast<int>(std::max(1u, std::thread::hardware_concurrency()))};
+            std::sort(counts.begin(), counts.end());
+            counts.erase(std::unique(counts.begin(), counts.end()), counts.end());
+        }
+        return Simulation::verifyDeterminism(startingScene, options.steps, counts) ? 0 : 1;
+    }
+
+    startingScene();
+
+    // Ranks exchange plain particles only.
+    if (Distributed::isActive() && RigidBodies::isActive()) {
+        if (Distributed::rank() == 0) std::cerr << "Rigid bodies are simulated as free particles in distributed runs" << std::endl;
+        RigidBodies::release(Particle::particles);
+    }
+    Distributed::partition();
+    if (Distributed::rank() == 0) TrajectoryWriter::start();
+
+    if (options.headless) {
+        runHeadless();
+    } else {
+        WindowManager::open();
+        SimulationThread::start();
+
+        while (window.isOpen()) {
+            if (!SimulationThread::pipelined) SimulationThread::advance(FixedStep::due());
+
+            InputManager::handle_inputs();
+            SimulationThread::cameras.writeBuffer() = Camera::state;
+            SimulationThread::cameras.publish();
+
+            SimulationThread::frames.acquire();
+            Renderer::render(SimulationThread::frames.readBuffer());
+            WindowManager::awaitFrame();
+        }
+
+        SimulationThread::stop();
+    }
+
+    TrajectoryWriter::stop();
+    Snapshot::wait();
+
+    if (Trace::enabled) Trace::dump(Trace::outputPath);
+    PerfCounters::printSummary();
+    PerfCounters::finish();
+    Analysis::finish();
+    Distributed::finish();
     return 0;
-}
\ No newline at end of file
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        return run(argc, argv);
+    } catch (const std::exception& error) {
+        std::cerr << error.what() << std::endl;
+        return 1;
+    }
+}